@@ -1,16 +1,108 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+// Headless contexts come from EGL on Linux (surfaceless Mesa or a pbuffer);
+// elsewhere, or when built with -DSHINE_NO_EGL, a hidden GLFW window is used
+#if defined(__linux__) && !defined(SHINE_NO_EGL)
+#define SHINE_EGL 1
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+// Binary scene files are memory-mapped where POSIX mmap is available and
+// read into memory elsewhere
+#if defined(__unix__) || defined(__APPLE__)
+#define SHINE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/packing.hpp>
+// The software renderer's shading kernel uses GCC/Clang vector extensions,
+// which compile to AVX2 with -mavx2, SSE on x86-64 and NEON on arm64. Other
+// compilers only get the scalar kernel.
+#if defined(__GNUC__)
+#define SHINE_SIMD 1
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#endif
 #include <iostream>
+#include <fstream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <array>
+#include <deque>
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <atomic>
+#include <condition_variable>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <thread>
 
 // Window dimensions
 const GLuint WIDTH = 800, HEIGHT = 600;
 
+// Frame-constant uniforms shared by every program through a std140 uniform
+// buffer. Must match the FrameUniforms struct below.
+#define FRAME_UNIFORM_BLOCK \
+    "layout(std140) uniform FrameData {\n" \
+    "    mat4 projection;\n" \
+    "    mat4 view;\n" \
+    "    vec3 viewPos;\n" \
+    "    vec3 lightColor;\n" \
+    "};\n"
+
+// Uniform buffer binding point for FrameData
+const GLuint FRAME_UNIFORM_BINDING = 0;
+
+// Specular term shared by the lighting shaders. Each program is a
+// permutation of it: BLINN_PHONG uses the half vector with 4x the exponent,
+// which keeps the highlight close to Phong's size, and SHININESS_SQUARINGS
+// specializes it for one power-of-two exponent, squaring that many times
+// instead of calling pow().
+#define SPECULAR_FUNCTION \
+    "float specular(vec3 norm, vec3 lightDir, vec3 viewDir, float shininess)\n" \
+    "{\n" \
+    "#ifdef BLINN_PHONG\n" \
+    "    float x = max(dot(norm, normalize(lightDir + viewDir)), 0.0);\n" \
+    "    shininess *= 4.0;\n" \
+    "#else\n" \
+    "    float x = max(dot(viewDir, reflect(-lightDir, norm)), 0.0);\n" \
+    "#endif\n" \
+    "#ifdef SHININESS_SQUARINGS\n" \
+    "    for (int i = 0; i < SHININESS_SQUARINGS; i++)\n" \
+    "        x *= x;\n" \
+    "    return x;\n" \
+    "#else\n" \
+    "    return pow(x, shininess);\n" \
+    "#endif\n" \
+    "}\n"
+
+// Forward+ light clusters: screen tiles CLUSTER_TILE_SIZE pixels square,
+// each split into CLUSTER_SLICES view-space depth slices spanning the
+// scene's depth range. A cluster lists at most MAX_LIGHTS_PER_CLUSTER
+// lights; any beyond that are dropped.
+const int CLUSTER_TILE_SIZE = 32;
+const int CLUSTER_SLICES = 32;
+const int MAX_LIGHTS_PER_CLUSTER = 1024;
+
 // Vertex Shader Source
 const char* vertexShaderSource =
     "#version 330 core\n"
@@ -20,14 +112,18 @@ const char* vertexShaderSource =
     "out vec3 FragPos;\n"
     "out vec3 Normal;\n"
     "\n"
+    FRAME_UNIFORM_BLOCK
     "uniform mat4 model;\n"
-    "uniform mat4 view;\n"
-    "uniform mat4 projection;\n"
+    "uniform mat3 normalMatrix;\n"
+    "\n"
+    "#ifdef DEPTH_PREPASS\n"
+    "invariant gl_Position;\n"
+    "#endif\n"
     "\n"
     "void main()\n"
     "{\n"
     "    FragPos = vec3(model * vec4(aPos, 1.0));\n"
-    "    Normal = mat3(transpose(inverse(model))) * aNormal;\n"
+    "    Normal = normalMatrix * aNormal;\n"
     "    gl_Position = projection * view * model * vec4(aPos, 1.0);\n"
     "}\n";
 
@@ -39,12 +135,13 @@ const char* fragmentShaderSource =
     "in vec3 FragPos;\n"
     "in vec3 Normal;\n"
     "\n"
+    FRAME_UNIFORM_BLOCK
     "uniform vec3 lightPos;\n"
-    "uniform vec3 viewPos;\n"
-    "uniform vec3 lightColor;\n"
     "uniform vec3 objectColor;\n"
     "uniform float shininess;\n"
     "\n"
+    SPECULAR_FUNCTION
+    "\n"
     "void main()\n"
     "{\n"
     "    // Ambient lighting\n"
@@ -60,8 +157,112 @@ const char* fragmentShaderSource =
     "    // Specular lighting\n"
     "    float specularStrength = 0.5;\n"
     "    vec3 viewDir = normalize(viewPos - FragPos);\n"
-    "    vec3 reflectDir = reflect(-lightDir, norm);\n"
-    "    float spec = pow(max(dot(viewDir, reflectDir), 0.0), shininess);\n"
+    "    float spec = specular(norm, lightDir, viewDir, shininess);\n"
+    "    vec3 specular = specularStrength * spec * lightColor;\n"
+    "\n"
+    "    // Combine results\n"
+    "    vec3 result = (ambient + diffuse + specular) * objectColor;\n"
+    "    FragColor = vec4(result, 1.0);\n"
+    "}\n";
+
+// Baked lighting atlas layout: every cube has a tile of its six faces in a
+// 3x2 grid of squares tile.z texels wide, with the tile's corner at
+// tile.xy. Gives the face's corner in the atlas and the position of a cube
+// mesh vertex within the face, in texels.
+#define LIGHTMAP_FUNCTION \
+    "void lightmapFace(vec3 pos, vec3 normal, vec3 tile, out vec2 origin, out vec2 texel)\n" \
+    "{\n" \
+    "    vec3 a = abs(normal);\n" \
+    "    int axis = a.x > a.y ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);\n" \
+    "    int face = axis * 2 + (normal[axis] < 0.0 ? 1 : 0);\n" \
+    "    origin = tile.xy + vec2(face % 3, face / 3) * tile.z;\n" \
+    "    texel = ((axis == 0 ? pos.yz : axis == 1 ? pos.xz : pos.xy) + 0.5) * tile.z;\n" \
+    "}\n"
+
+// Instanced vertex shader: model and normal matrices, light position and
+// shininess are per-instance attributes so the whole grid goes out in a
+// single draw call. With BAKE_LIGHTING each face is rasterized into its
+// lightmap square instead of onto the screen.
+const char* instancedVertexShaderSource =
+    "#version 330 core\n"
+    "layout(location = 0) in vec3 aPos;\n"
+    "layout(location = 1) in vec3 aNormal;\n"
+    "layout(location = 2) in mat4 aModel;\n"
+    "layout(location = 6) in vec3 aLightPos;\n"
+    "layout(location = 7) in float aShininess;\n"
+    "#ifndef RIGID_TRANSFORMS\n"
+    "layout(location = 8) in mat3 aNormalMatrix;\n"
+    "#endif\n"
+    "#ifdef BAKE_LIGHTING\n"
+    "layout(location = 11) in vec3 aTile;\n"
+    "uniform vec2 atlasSize;\n"
+    "#endif\n"
+    "\n"
+    "out vec3 FragPos;\n"
+    "out vec3 Normal;\n"
+    "flat out vec3 LightPos;\n"
+    "flat out float Shininess;\n"
+    "#ifdef DEPTH_PREPASS\n"
+    "invariant gl_Position;\n"
+    "#endif\n"
+    "\n"
+    FRAME_UNIFORM_BLOCK
+    "\n"
+    LIGHTMAP_FUNCTION
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    FragPos = vec3(aModel * vec4(aPos, 1.0));\n"
+    "#ifdef RIGID_TRANSFORMS\n"
+    "    // Rotation and uniform scale only: mat3(model) is the normal matrix\n"
+    "    // up to a scale factor, which the fragment shader normalizes away\n"
+    "    Normal = mat3(aModel) * aNormal;\n"
+    "#else\n"
+    "    Normal = aNormalMatrix * aNormal;\n"
+    "#endif\n"
+    "    LightPos = aLightPos;\n"
+    "    Shininess = aShininess;\n"
+    "#ifdef BAKE_LIGHTING\n"
+    "    vec2 origin, texel;\n"
+    "    lightmapFace(aPos, aNormal, aTile, origin, texel);\n"
+    "    gl_Position = vec4((origin + texel) / atlasSize * 2.0 - 1.0, 0.0, 1.0);\n"
+    "#else\n"
+    "    gl_Position = projection * view * aModel * vec4(aPos, 1.0);\n"
+    "#endif\n"
+    "}\n";
+
+// Instanced fragment shader: same lighting as fragmentShaderSource, with the
+// per-cube values coming from the vertex stage instead of uniforms
+const char* instancedFragmentShaderSource =
+    "#version 330 core\n"
+    "out vec4 FragColor;\n"
+    "\n"
+    "in vec3 FragPos;\n"
+    "in vec3 Normal;\n"
+    "flat in vec3 LightPos;\n"
+    "flat in float Shininess;\n"
+    "\n"
+    FRAME_UNIFORM_BLOCK
+    "uniform vec3 objectColor;\n"
+    "\n"
+    SPECULAR_FUNCTION
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    // Ambient lighting\n"
+    "    float ambientStrength = 0.1;\n"
+    "    vec3 ambient = ambientStrength * lightColor;\n"
+    "\n"
+    "    // Diffuse lighting\n"
+    "    vec3 norm = normalize(Normal);\n"
+    "    vec3 lightDir = normalize(LightPos - FragPos);\n"
+    "    float diff = max(dot(norm, lightDir), 0.0);\n"
+    "    vec3 diffuse = diff * lightColor;\n"
+    "\n"
+    "    // Specular lighting\n"
+    "    float specularStrength = 0.5;\n"
+    "    vec3 viewDir = normalize(viewPos - FragPos);\n"
+    "    float spec = specular(norm, lightDir, viewDir, Shininess);\n"
     "    vec3 specular = specularStrength * spec * lightColor;\n"
     "\n"
     "    // Combine results\n"
@@ -69,6 +270,443 @@ const char* fragmentShaderSource =
     "    FragColor = vec4(result, 1.0);\n"
     "}\n";
 
+// Point light loop shared by the forward+ and deferred lighting shaders:
+// the same Phong terms as fragmentShaderSource, summed over every light in
+// range with a smooth falloff to zero at each light's radius. With
+// CULL_LIGHTS only the lights binned into the fragment's cluster are
+// visited, otherwise all of them are. Needs SPECULAR_FUNCTION.
+#define POINT_LIGHTING_FUNCTION \
+    "uniform samplerBuffer lights;\n" \
+    "#ifdef CULL_LIGHTS\n" \
+    "uniform usamplerBuffer clusters;\n" \
+    "uniform usamplerBuffer lightIndices;\n" \
+    "uniform ivec3 clusterCounts;\n" \
+    "uniform float clusterNear;\n" \
+    "uniform float sliceDepth;\n" \
+    "#ifdef BAKE_LIGHTING\n" \
+    "uniform vec2 screenSize;\n" \
+    "#endif\n" \
+    "#else\n" \
+    "uniform int lightCount;\n" \
+    "#endif\n" \
+    "\n" \
+    "vec3 pointLighting(vec3 fragPos, vec3 norm, float shininess)\n" \
+    "{\n" \
+    "    // Ambient lighting\n" \
+    "    float ambientStrength = 0.1;\n" \
+    "    vec3 lighting = ambientStrength * lightColor;\n" \
+    "\n" \
+    "    vec3 viewDir = normalize(viewPos - fragPos);\n" \
+    "    float specularStrength = 0.5;\n" \
+    "\n" \
+    "#ifdef CULL_LIGHTS\n" \
+    "    // Cluster from the screen tile and the view-space depth slice\n" \
+    "#ifdef BAKE_LIGHTING\n" \
+    "    // Baking into a lightmap: the tile the point projects to, if on screen\n" \
+    "    vec4 clip = projection * view * vec4(fragPos, 1.0);\n" \
+    "    ivec2 tile = ivec2((clip.xy / clip.w * 0.5 + 0.5) * screenSize) / CLUSTER_TILE_SIZE;\n" \
+    "    tile = clamp(tile, ivec2(0), clusterCounts.xy - 1);\n" \
+    "#else\n" \
+    "    ivec2 tile = ivec2(gl_FragCoord.xy) / CLUSTER_TILE_SIZE;\n" \
+    "#endif\n" \
+    "    float depth = -(view * vec4(fragPos, 1.0)).z;\n" \
+    "    int slice = clamp(int((depth - clusterNear) / sliceDepth), 0, clusterCounts.z - 1);\n" \
+    "    uvec2 cluster = texelFetch(clusters, (slice * clusterCounts.y + tile.y) * clusterCounts.x + tile.x).rg;\n" \
+    "    for (uint i = 0u; i < cluster.y; i++) {\n" \
+    "        // Element 0 of the index buffer is the culling pass's counter\n" \
+    "        vec4 light = texelFetch(lights, int(texelFetch(lightIndices, int(cluster.x + 1u + i)).r));\n" \
+    "#else\n" \
+    "    for (int i = 0; i < lightCount; i++) {\n" \
+    "        vec4 light = texelFetch(lights, i);\n" \
+    "#endif\n" \
+    "        vec3 toLight = light.xyz - fragPos;\n" \
+    "        float distanceSq = dot(toLight, toLight);\n" \
+    "        float radiusSq = light.w * light.w;\n" \
+    "        if (distanceSq >= radiusSq)\n" \
+    "            continue;\n" \
+    "        float falloff = 1.0 - distanceSq / radiusSq;\n" \
+    "        falloff *= falloff;\n" \
+    "\n" \
+    "        // Diffuse lighting\n" \
+    "        vec3 lightDir = toLight * inversesqrt(distanceSq);\n" \
+    "        float diff = max(dot(norm, lightDir), 0.0);\n" \
+    "\n" \
+    "        // Specular lighting\n" \
+    "        float spec = specular(norm, lightDir, viewDir, shininess);\n" \
+    "\n" \
+    "        lighting += falloff * (diff + specularStrength * spec) * lightColor;\n" \
+    "    }\n" \
+    "    return lighting;\n" \
+    "}\n"
+
+// Forward+ fragment shader: every light in range, see POINT_LIGHTING_FUNCTION
+const char* clusteredFragmentShaderSource =
+    "#version 330 core\n"
+    "out vec4 FragColor;\n"
+    "\n"
+    "in vec3 FragPos;\n"
+    "in vec3 Normal;\n"
+    "flat in float Shininess;\n"
+    "\n"
+    FRAME_UNIFORM_BLOCK
+    "uniform vec3 objectColor;\n"
+    "\n"
+    SPECULAR_FUNCTION
+    "\n"
+    POINT_LIGHTING_FUNCTION
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    // Combine results\n"
+    "    vec3 result = pointLighting(FragPos, normalize(Normal), Shininess) * objectColor;\n"
+    "    FragColor = vec4(result, 1.0);\n"
+    "}\n";
+
+// Octahedral normal encoding for the G-buffer: the unit sphere is projected
+// onto an octahedron and its lower half folded over the upper one, which
+// maps every direction into [0, 1]^2 with nearly uniform precision
+#define OCTAHEDRAL_FUNCTIONS \
+    "vec2 octEncode(vec3 n)\n" \
+    "{\n" \
+    "    n /= abs(n.x) + abs(n.y) + abs(n.z);\n" \
+    "    vec2 e = n.xy;\n" \
+    "    if (n.z < 0.0)\n" \
+    "        e = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);\n" \
+    "    return e * 0.5 + 0.5;\n" \
+    "}\n" \
+    "\n" \
+    "vec3 octDecode(vec2 e)\n" \
+    "{\n" \
+    "    e = e * 2.0 - 1.0;\n" \
+    "    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));\n" \
+    "    float t = max(-n.z, 0.0);\n" \
+    "    n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);\n" \
+    "    return normalize(n);\n" \
+    "}\n"
+
+// Deferred geometry pass, after instancedVertexShaderSource: stores the
+// surface normal, shininess and linear view depth of the nearest fragment.
+// Its position is rebuilt from the depth; the depth buffer's own values are
+// far too coarse for that once the grid is a few hundred units away.
+const char* gBufferFragmentShaderSource =
+    "#version 330 core\n"
+    "layout(location = 0) out vec2 GNormal;\n"
+    "layout(location = 1) out float GShininess;\n"
+    "layout(location = 2) out float GDepth;\n"
+    "\n"
+    "in vec3 FragPos;\n"
+    "in vec3 Normal;\n"
+    "flat in float Shininess;\n"
+    "\n"
+    FRAME_UNIFORM_BLOCK
+    "\n"
+    OCTAHEDRAL_FUNCTIONS
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    GNormal = octEncode(normalize(Normal));\n"
+    "    GShininess = Shininess;\n"
+    "    GDepth = -(view * vec4(FragPos, 1.0)).z;\n"
+    "}\n";
+
+// One triangle covering the viewport, generated from the vertex index
+const char* fullscreenVertexShaderSource =
+    "#version 330 core\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);\n"
+    "    gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);\n"
+    "}\n";
+
+// Deferred lighting pass: lights every covered pixel once with
+// POINT_LIGHTING_FUNCTION, from the world position rebuilt from the view
+// depth and the G-buffer's normal and shininess. Pixels no cube covers
+// (depth 0) keep the clear color.
+const char* deferredLightingFragmentShaderSource =
+    "#version 330 core\n"
+    "out vec4 FragColor;\n"
+    "\n"
+    FRAME_UNIFORM_BLOCK
+    "uniform vec3 objectColor;\n"
+    "uniform sampler2D gNormal;\n"
+    "uniform sampler2D gShininess;\n"
+    "uniform sampler2D gDepth;\n"
+    "uniform mat4 inverseView;\n"
+    "uniform vec2 viewportSize;\n"
+    "\n"
+    SPECULAR_FUNCTION
+    "\n"
+    POINT_LIGHTING_FUNCTION
+    "\n"
+    OCTAHEDRAL_FUNCTIONS
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "    float depth = texelFetch(gDepth, pixel, 0).r;\n"
+    "    if (depth == 0.0)\n"
+    "        discard;\n"
+    "\n"
+    "    // View-space position of the pixel centre at that depth\n"
+    "    vec2 ndc = gl_FragCoord.xy / viewportSize * 2.0 - 1.0;\n"
+    "    vec2 viewXY = depth * (ndc + vec2(projection[2][0], projection[2][1])) /\n"
+    "                  vec2(projection[0][0], projection[1][1]);\n"
+    "    vec3 fragPos = vec3(inverseView * vec4(viewXY, -depth, 1.0));\n"
+    "\n"
+    "    vec3 norm = octDecode(texelFetch(gNormal, pixel, 0).rg);\n"
+    "    float shininess = texelFetch(gShininess, pixel, 0).r;\n"
+    "\n"
+    "    // Combine results\n"
+    "    vec3 result = pointLighting(fragPos, norm, shininess) * objectColor;\n"
+    "    FragColor = vec4(result, 1.0);\n"
+    "}\n";
+
+// Baked lighting: cubes drawn with their faces' shading looked up in the
+// lightmap atlas
+const char* bakedVertexShaderSource =
+    "#version 330 core\n"
+    "layout(location = 0) in vec3 aPos;\n"
+    "layout(location = 1) in vec3 aNormal;\n"
+    "layout(location = 2) in mat4 aModel;\n"
+    "layout(location = 11) in vec3 aTile;\n"
+    "\n"
+    "out vec2 FaceTexel;\n"
+    "flat out vec2 FaceOrigin;\n"
+    "flat out float FaceSize;\n"
+    "#ifdef DEPTH_PREPASS\n"
+    "invariant gl_Position;\n"
+    "#endif\n"
+    "\n"
+    FRAME_UNIFORM_BLOCK
+    "\n"
+    LIGHTMAP_FUNCTION
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    lightmapFace(aPos, aNormal, aTile, FaceOrigin, FaceTexel);\n"
+    "    FaceSize = aTile.z;\n"
+    "    gl_Position = projection * view * aModel * vec4(aPos, 1.0);\n"
+    "}\n";
+
+const char* bakedFragmentShaderSource =
+    "#version 330 core\n"
+    "out vec4 FragColor;\n"
+    "\n"
+    "in vec2 FaceTexel;\n"
+    "flat in vec2 FaceOrigin;\n"
+    "flat in float FaceSize;\n"
+    "\n"
+    "uniform sampler2D lightmap;\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    // Stay half a texel inside the face so filtering never reads a neighbour\n"
+    "    vec2 texel = FaceOrigin + clamp(FaceTexel, 0.5, FaceSize - 0.5);\n"
+    "    FragColor = vec4(texture(lightmap, texel / vec2(textureSize(lightmap, 0))).rgb, 1.0);\n"
+    "}\n";
+
+// Depth pre-pass, after the shading pass's own vertex shader: writes depth
+// only. With DEPTH_PREPASS defined those shaders declare gl_Position
+// invariant, so the shading pass computes exactly the same depths. Also
+// counts covered pixels with a fullscreen triangle.
+const char* depthFragmentShaderSource =
+    "#version 330 core\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "}\n";
+
+// Base of the hi-Z pyramid, after fullscreenVertexShaderSource: every
+// texel is the farthest depth of a blockSize x blockSize block of the depth
+// buffer, cut off at the viewport's edge
+const char* hiZReduceFragmentShaderSource =
+    "#version 330 core\n"
+    "out float MaxDepth;\n"
+    "\n"
+    "uniform sampler2D depthBuffer;\n"
+    "uniform int blockSize;\n"
+    "uniform ivec2 viewportSize;\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    ivec2 first = ivec2(gl_FragCoord.xy) * blockSize;\n"
+    "    ivec2 last = min(first + blockSize, viewportSize);\n"
+    "    float depth = 0.0;\n"
+    "    for (int y = first.y; y < last.y; y++)\n"
+    "        for (int x = first.x; x < last.x; x++)\n"
+    "            depth = max(depth, texelFetch(depthBuffer, ivec2(x, y), 0).r);\n"
+    "    MaxDepth = depth;\n"
+    "}\n";
+
+// Material sweep: one cube per instance, posed as in the grid and drawn
+// into its own tile of the atlas, tiles filling rows left to right from the
+// top. aMaterial holds the shininess, the specular strength and how far the
+// light is shifted left from where the grid puts it, 1 to the cube's right.
+// tileSize is in normalized device coordinates. The four clip distances are
+// the tile's edges, so nothing spills into the neighbouring tiles.
+const char* sweepVertexShaderSource =
+    "#version 330 core\n"
+    "layout(location = 0) in vec3 aPos;\n"
+    "layout(location = 1) in vec3 aNormal;\n"
+    "layout(location = 2) in vec2 aTile;\n"
+    "layout(location = 3) in vec3 aMaterial;\n"
+    "layout(location = 4) in vec3 aColor;\n"
+    "\n"
+    "out vec3 FragPos;\n"
+    "out vec3 Normal;\n"
+    "flat out vec3 LightPos;\n"
+    "flat out vec3 ObjectColor;\n"
+    "flat out float Shininess;\n"
+    "flat out float SpecularStrength;\n"
+    "\n"
+    FRAME_UNIFORM_BLOCK
+    "uniform mat4 model;\n"
+    "uniform mat3 normalMatrix;\n"
+    "uniform vec2 tileSize;\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    FragPos = vec3(model * vec4(aPos, 1.0));\n"
+    "    Normal = normalMatrix * aNormal;\n"
+    "    LightPos = vec3(1.0 - aMaterial.z, 0.0, 2.0);\n"
+    "    ObjectColor = aColor;\n"
+    "    Shininess = aMaterial.x;\n"
+    "    SpecularStrength = aMaterial.y;\n"
+    "\n"
+    "    vec4 clip = projection * view * vec4(FragPos, 1.0);\n"
+    "    gl_ClipDistance[0] = clip.w + clip.x;\n"
+    "    gl_ClipDistance[1] = clip.w - clip.x;\n"
+    "    gl_ClipDistance[2] = clip.w + clip.y;\n"
+    "    gl_ClipDistance[3] = clip.w - clip.y;\n"
+    "    vec2 center = vec2(-1.0, 1.0) + (aTile + 0.5) * vec2(tileSize.x, -tileSize.y);\n"
+    "    gl_Position = vec4(clip.xy * 0.5 * tileSize + center * clip.w, clip.zw);\n"
+    "}\n";
+
+// Material sweep fragment shader: the lighting of instancedFragmentShaderSource
+// with the object colour and specular strength of the tile
+const char* sweepFragmentShaderSource =
+    "#version 330 core\n"
+    "out vec4 FragColor;\n"
+    "\n"
+    "in vec3 FragPos;\n"
+    "in vec3 Normal;\n"
+    "flat in vec3 LightPos;\n"
+    "flat in vec3 ObjectColor;\n"
+    "flat in float Shininess;\n"
+    "flat in float SpecularStrength;\n"
+    "\n"
+    FRAME_UNIFORM_BLOCK
+    "\n"
+    SPECULAR_FUNCTION
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    // Ambient lighting\n"
+    "    float ambientStrength = 0.1;\n"
+    "    vec3 ambient = ambientStrength * lightColor;\n"
+    "\n"
+    "    // Diffuse lighting\n"
+    "    vec3 norm = normalize(Normal);\n"
+    "    vec3 lightDir = normalize(LightPos - FragPos);\n"
+    "    float diff = max(dot(norm, lightDir), 0.0);\n"
+    "    vec3 diffuse = diff * lightColor;\n"
+    "\n"
+    "    // Specular lighting\n"
+    "    vec3 viewDir = normalize(viewPos - FragPos);\n"
+    "    float spec = specular(norm, lightDir, viewDir, Shininess);\n"
+    "    vec3 specular = SpecularStrength * spec * lightColor;\n"
+    "\n"
+    "    // Combine results\n"
+    "    vec3 result = (ambient + diffuse + specular) * ObjectColor;\n"
+    "    FragColor = vec4(result, 1.0);\n"
+    "}\n";
+
+// Forward+ light culling, one work group per cluster. The invocations split
+// the lights between them, test each against the cluster's view-space box
+// and collect the hits in shared memory; the list is then appended to the
+// shared light index buffer. lightIndexCount counts every index requested,
+// so the caller can tell when the buffer was too small.
+const char* lightCullingComputeShaderSource =
+    "#version 430 core\n"
+    "layout(local_size_x = 64) in;\n"
+    "\n"
+    "layout(std430, binding = 0) readonly buffer LightData {\n"
+    "    vec4 lights[];\n"
+    "};\n"
+    "layout(std430, binding = 1) writeonly buffer ClusterData {\n"
+    "    uvec2 clusters[];\n"
+    "};\n"
+    "layout(std430, binding = 2) buffer LightIndexData {\n"
+    "    uint lightIndexCount;\n"
+    "    uint lightIndices[];\n"
+    "};\n"
+    "\n"
+    FRAME_UNIFORM_BLOCK
+    "uniform mat4 inverseProjection;\n"
+    "uniform int lightCount;\n"
+    "uniform vec2 screenSize;\n"
+    "uniform float clusterNear;\n"
+    "uniform float sliceDepth;\n"
+    "uniform int lightIndexCapacity;\n"
+    "\n"
+    "shared uint hitCount;\n"
+    "shared uint hits[MAX_LIGHTS_PER_CLUSTER];\n"
+    "shared uint listOffset;\n"
+    "shared uint listCount;\n"
+    "\n"
+    "// View-space direction through a pixel, scaled to a depth of 1\n"
+    "vec3 viewRay(vec2 pixel)\n"
+    "{\n"
+    "    vec4 point = inverseProjection * vec4(pixel / screenSize * 2.0 - 1.0, 1.0, 1.0);\n"
+    "    return point.xyz / -point.z;\n"
+    "}\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    uvec3 id = gl_WorkGroupID;\n"
+    "    uint cluster = (id.z * gl_NumWorkGroups.y + id.y) * gl_NumWorkGroups.x + id.x;\n"
+    "    if (gl_LocalInvocationIndex == 0u)\n"
+    "        hitCount = 0u;\n"
+    "    barrier();\n"
+    "\n"
+    "    // Bounding box of the cluster's frustum slice\n"
+    "    vec2 minPixel = vec2(id.xy * uint(CLUSTER_TILE_SIZE));\n"
+    "    vec2 maxPixel = min(minPixel + float(CLUSTER_TILE_SIZE), screenSize);\n"
+    "    vec3 rays[4] = vec3[4](viewRay(minPixel), viewRay(vec2(maxPixel.x, minPixel.y)), viewRay(maxPixel),\n"
+    "                           viewRay(vec2(minPixel.x, maxPixel.y)));\n"
+    "    float nearDepth = clusterNear + float(id.z) * sliceDepth;\n"
+    "    vec3 boxMin = vec3(1e30);\n"
+    "    vec3 boxMax = vec3(-1e30);\n"
+    "    for (int corner = 0; corner < 4; corner++) {\n"
+    "        boxMin = min(boxMin, min(rays[corner] * nearDepth, rays[corner] * (nearDepth + sliceDepth)));\n"
+    "        boxMax = max(boxMax, max(rays[corner] * nearDepth, rays[corner] * (nearDepth + sliceDepth)));\n"
+    "    }\n"
+    "\n"
+    "    for (uint i = gl_LocalInvocationIndex; i < uint(lightCount); i += gl_WorkGroupSize.x) {\n"
+    "        vec3 center = vec3(view * vec4(lights[i].xyz, 1.0));\n"
+    "        vec3 offset = clamp(center, boxMin, boxMax) - center;\n"
+    "        if (dot(offset, offset) < lights[i].w * lights[i].w) {\n"
+    "            uint slot = atomicAdd(hitCount, 1u);\n"
+    "            if (slot < MAX_LIGHTS_PER_CLUSTER)\n"
+    "                hits[slot] = i;\n"
+    "        }\n"
+    "    }\n"
+    "    barrier();\n"
+    "\n"
+    "    if (gl_LocalInvocationIndex == 0u) {\n"
+    "        listCount = min(hitCount, MAX_LIGHTS_PER_CLUSTER);\n"
+    "        listOffset = atomicAdd(lightIndexCount, listCount);\n"
+    "        if (listOffset + listCount > uint(lightIndexCapacity))\n"
+    "            listCount = 0u;\n"
+    "        clusters[cluster] = uvec2(listOffset, listCount);\n"
+    "    }\n"
+    "    barrier();\n"
+    "\n"
+    "    for (uint i = gl_LocalInvocationIndex; i < listCount; i += gl_WorkGroupSize.x)\n"
+    "        lightIndices[listOffset + i] = hits[i];\n"
+    "}\n";
+
 // Cube vertices with normals
 float vertices[] = {
     // positions          // normals
@@ -115,6 +753,156 @@ float vertices[] = {
     -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f
 };
 
+// Vertex layouts a Mesh can be uploaded in
+enum class VertexFormat {
+    Float,   // 36 non-indexed vertices, 3 float position + 3 float normal (24 bytes)
+    Packed,  // indexed, 3 float position + GL_INT_2_10_10_10_REV normal (16 bytes)
+    Half     // indexed, 4 half-float position + GL_INT_2_10_10_10_REV normal (12 bytes)
+};
+
+// One command of a multi-draw indirect call, laid out as
+// DrawElementsIndirectCommand. Non-indexed meshes fill in the first four
+// words as DrawArraysIndirectCommand and leave the last one 0.
+struct IndirectCommand {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint first;
+    GLuint baseVertex;
+    GLuint baseInstance;
+};
+
+// Static triangle mesh with position (attribute 0) and normal (attribute 1).
+// The mesh owns its buffers; callers own the vertex arrays so the plain and
+// instanced paths can each add their own attributes on top.
+class Mesh {
+public:
+    // Upload interleaved position/normal triangles, deduplicating them into an
+    // indexed mesh for the packed formats
+    void create(const float* triangles, size_t vertexCount, VertexFormat format);
+    void destroy();
+
+    // Point attributes 0 and 1 (and the element buffer) of the bound VAO at this mesh
+    void bindAttributes() const;
+
+    void draw() const;
+    void drawInstanced(GLsizei instances) const;
+
+    // Draw instances [baseInstance, baseInstance + instances) of the mesh,
+    // as a command for multiDrawIndirect()
+    IndirectCommand indirectCommand(GLuint instances, GLuint baseInstance) const;
+    // Run commands from the bound GL_DRAW_INDIRECT_BUFFER, starting offset
+    // bytes in; needs OpenGL 4.3
+    void multiDrawIndirect(size_t offset, GLsizei commands) const;
+
+private:
+    unsigned int vbo = 0;
+    unsigned int ebo = 0;
+    VertexFormat format = VertexFormat::Float;
+    GLsizei count = 0;
+};
+
+void Mesh::create(const float* triangles, size_t vertexCount, VertexFormat vertexFormat) {
+    format = vertexFormat;
+    glGenBuffers(1, &vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+
+    if (format == VertexFormat::Float) {
+        count = (GLsizei)vertexCount;
+        glBufferData(GL_ARRAY_BUFFER, vertexCount * 6 * sizeof(float), triangles, GL_STATIC_DRAW);
+        return;
+    }
+
+    // Collapse duplicate vertices (the cube has 24 unique ones out of 36)
+    std::vector<const float*> unique;
+    std::vector<uint16_t> indices;
+    for (size_t i = 0; i < vertexCount; i++) {
+        const float* vertex = triangles + i * 6;
+        size_t index = 0;
+        while (index < unique.size() && std::memcmp(unique[index], vertex, 6 * sizeof(float)) != 0)
+            index++;
+        if (index == unique.size())
+            unique.push_back(vertex);
+        indices.push_back((uint16_t)index);
+    }
+    count = (GLsizei)indices.size();
+
+    std::vector<uint8_t> data;
+    for (const float* vertex : unique) {
+        uint32_t normal = glm::packSnorm3x10_1x2(glm::vec4(vertex[3], vertex[4], vertex[5], 0.0f));
+        if (format == VertexFormat::Half) {
+            uint16_t position[4] = {glm::packHalf1x16(vertex[0]), glm::packHalf1x16(vertex[1]),
+                                    glm::packHalf1x16(vertex[2]), 0};
+            data.insert(data.end(), (const uint8_t*)position, (const uint8_t*)(position + 4));
+        } else {
+            data.insert(data.end(), (const uint8_t*)vertex, (const uint8_t*)(vertex + 3));
+        }
+        data.insert(data.end(), (const uint8_t*)&normal, (const uint8_t*)(&normal + 1));
+    }
+    glBufferData(GL_ARRAY_BUFFER, data.size(), data.data(), GL_STATIC_DRAW);
+
+    glGenBuffers(1, &ebo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint16_t), indices.data(), GL_STATIC_DRAW);
+}
+
+void Mesh::destroy() {
+    glDeleteBuffers(1, &vbo);
+    if (ebo)
+        glDeleteBuffers(1, &ebo);
+    vbo = ebo = 0;
+}
+
+void Mesh::bindAttributes() const {
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    switch (format) {
+    case VertexFormat::Float:
+        // Position attribute
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
+        // Normal attribute
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(3 * sizeof(float)));
+        break;
+    case VertexFormat::Packed:
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 16, (void*)0);
+        glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, 16, (void*)12);
+        break;
+    case VertexFormat::Half:
+        glVertexAttribPointer(0, 3, GL_HALF_FLOAT, GL_FALSE, 12, (void*)0);
+        glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, 12, (void*)8);
+        break;
+    }
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    if (ebo)
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+}
+
+void Mesh::draw() const {
+    if (ebo)
+        glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_SHORT, (void*)0);
+    else
+        glDrawArrays(GL_TRIANGLES, 0, count);
+}
+
+void Mesh::drawInstanced(GLsizei instances) const {
+    if (ebo)
+        glDrawElementsInstanced(GL_TRIANGLES, count, GL_UNSIGNED_SHORT, (void*)0, instances);
+    else
+        glDrawArraysInstanced(GL_TRIANGLES, 0, count, instances);
+}
+
+IndirectCommand Mesh::indirectCommand(GLuint instances, GLuint baseInstance) const {
+    if (ebo)
+        return IndirectCommand{(GLuint)count, instances, 0, 0, baseInstance};
+    return IndirectCommand{(GLuint)count, instances, 0, baseInstance, 0};
+}
+
+void Mesh::multiDrawIndirect(size_t offset, GLsizei commands) const {
+    if (ebo)
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_SHORT, (void*)offset, commands, sizeof(IndirectCommand));
+    else
+        glMultiDrawArraysIndirect(GL_TRIANGLES, (void*)offset, commands, sizeof(IndirectCommand));
+}
+
 unsigned int compileShader(unsigned int type, const char* source) {
     unsigned int id = glCreateShader(type);
     glShaderSource(id, 1, &source, nullptr);
@@ -125,51 +913,5953 @@ unsigned int compileShader(unsigned int type, const char* source) {
     if (!success) {
         char infoLog[512];
         glGetShaderInfoLog(id, 512, nullptr, infoLog);
-        std::cerr << "ERROR::SHADER::" << (type == GL_VERTEX_SHADER ? "VERTEX" : "FRAGMENT")
+        std::cerr << "ERROR::SHADER::"
+                  << (type == GL_VERTEX_SHADER ? "VERTEX" : type == GL_COMPUTE_SHADER ? "COMPUTE" : "FRAGMENT")
                   << "::COMPILATION_FAILED\n" << infoLog << std::endl;
     }
     return id;
 }
 
-unsigned int createShaderProgram(const char* vertexSource, const char* fragmentSource) {
-    unsigned int program = glCreateProgram();
-    unsigned int vs = compileShader(GL_VERTEX_SHADER, vertexSource);
-    unsigned int fs = compileShader(GL_FRAGMENT_SHADER, fragmentSource);
+// On-disk cache of linked program binaries (glGetProgramBinary), keyed by
+// a hash of the final shader sources and the driver's identification
+// strings so a driver update never loads a stale binary. Off when no
+// directory is set or the driver offers no binary formats.
+class ProgramCache {
+public:
+    void setDirectory(const std::string& path) { directory = path; }
+    bool enabled();
 
-    glAttachShader(program, vs);
-    glAttachShader(program, fs);
-    glLinkProgram(program);
+    uint64_t key(const std::vector<std::string>& sources) const;
+    // Load the binary for key into program. False if there is none or the
+    // driver rejects it, in which case the program must be built from source.
+    bool load(unsigned int program, uint64_t key);
+    void store(unsigned int program, uint64_t key);
 
-    int success;
-    glGetProgramiv(program, GL_LINK_STATUS, &success);
-    if (!success) {
-        char infoLog[512];
-        glGetProgramInfoLog(program, 512, nullptr, infoLog);
-        std::cerr << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
-    }
+    // Programs loaded from the cache, built from source, and cached
+    // binaries the driver refused
+    int hits = 0;
+    int misses = 0;
+    int rejected = 0;
 
-    glDeleteShader(vs);
-    glDeleteShader(fs);
-    return program;
+private:
+    std::string path(uint64_t key) const;
+
+    std::string directory;
+    int binaryFormats = -1; // Queried on first use
+};
+
+ProgramCache programCache;
+
+// $XDG_CACHE_HOME/shine or ~/.cache/shine, or nothing if neither is set
+std::string defaultShaderCacheDirectory() {
+    if (const char* cache = std::getenv("XDG_CACHE_HOME"))
+        return std::string(cache) + "/shine";
+    if (const char* home = std::getenv("HOME"))
+        return std::string(home) + "/.cache/shine";
+    return "";
 }
 
-void processInput(GLFWwindow* window) {
-    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
-        glfwSetWindowShouldClose(window, true);
+bool ProgramCache::enabled() {
+    if (directory.empty())
+        return false;
+    if (binaryFormats < 0) {
+        binaryFormats = 0;
+        if (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary)
+            glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &binaryFormats);
+    }
+    return binaryFormats > 0;
 }
 
-void framebuffer_size_callback(GLFWwindow* window, int width, int height) {
-    glViewport(0, 0, width, height);
+// 64-bit FNV-1a over the driver strings and every source
+uint64_t ProgramCache::key(const std::vector<std::string>& sources) const {
+    uint64_t hash = 14695981039346656037ull;
+    auto add = [&](const char* text, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            hash ^= (uint8_t)text[i];
+            hash *= 1099511628211ull;
+        }
+        // Separator, so moving text between strings changes the hash
+        hash ^= 0xff;
+        hash *= 1099511628211ull;
+    };
+    for (GLenum name : {GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION}) {
+        const char* text = (const char*)glGetString(name);
+        add(text ? text : "", text ? std::strlen(text) : 0);
+    }
+    for (const std::string& source : sources)
+        add(source.data(), source.size());
+    return hash;
 }
 
-int main() {
-    // Initialize GLFW
-    if (!glfwInit()) {
-        std::cerr << "Failed to initialize GLFW" << std::endl;
-        return -1;
+std::string ProgramCache::path(uint64_t key) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)key);
+    return directory + "/" + name;
+}
+
+// File layout: "SHPB", binary format (uint32), then the binary itself
+bool ProgramCache::load(unsigned int program, uint64_t key) {
+    if (!enabled()) {
+        misses++;
+        return false;
     }
+    std::ifstream file(path(key), std::ios::binary);
+    char magic[4];
+    uint32_t format = 0;
+    if (!file.read(magic, sizeof(magic)) || std::memcmp(magic, "SHPB", 4) != 0 ||
+        !file.read((char*)&format, sizeof(format))) {
+        misses++;
+        return false;
+    }
+    std::vector<char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
 
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glProgramBinary(program, format, binary.data(), (GLsizei)binary.size());
+    int success = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success) {
+        // Usually a driver change the key did not catch; rebuild and replace it
+        while (glGetError() != GL_NO_ERROR) {
+        }
+        std::cerr << "Cached program binary " << path(key) << " was rejected, compiling from source" << std::endl;
+        rejected++;
+        misses++;
+        return false;
+    }
+    hits++;
+    return true;
+}
+
+void ProgramCache::store(unsigned int program, uint64_t key) {
+    if (!enabled())
+        return;
+    int length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+    std::vector<char> binary(length);
+    GLenum format = 0;
+    glGetProgramBinary(program, length, &length, &format, binary.data());
+
+    // Write to a temporary name and rename, so concurrent runs never read
+    // a partly written file
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    std::string target = path(key);
+    std::string temporary = target + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary);
+        uint32_t format32 = format;
+        file.write("SHPB", 4);
+        file.write((const char*)&format32, sizeof(format32));
+        file.write(binary.data(), length);
+        if (!file) {
+            std::cerr << "Failed to write " << temporary << std::endl;
+            return;
+        }
+    }
+    std::filesystem::rename(temporary, target, error);
+}
+
+// Linked shader program. Uniform locations are resolved once at link time and
+// the last value written to each uniform is cached, so setting a uniform to
+// the value it already holds does not reach the driver.
+class ShaderProgram {
+public:
+    ShaderProgram() = default;
+    // defines is inserted after the #version line of both stages
+    ShaderProgram(const char* vertexSource, const char* fragmentSource, const char* defines = "");
+
+    // Compute-only program; needs OpenGL 4.3
+    static ShaderProgram compute(const char* computeSource, const char* defines = "");
+
+    void use() const { glUseProgram(id); }
+    void destroy();
+    // False for a default-constructed or destroyed program
+    bool isCreated() const { return id != 0; }
+
+    // Index of a uniform for the set() calls, or -1 if the program does not
+    // use it (setting -1 is a no-op, like glUniform* with location -1)
+    int uniform(const char* name) const;
+
+    // The program must be current
+    void set(int uniform, int value);
+    void set(int uniform, const glm::ivec2& value);
+    void set(int uniform, const glm::ivec3& value);
+    void set(int uniform, float value);
+    void set(int uniform, const glm::vec2& value);
+    void set(int uniform, const glm::vec3& value);
+    void set(int uniform, const glm::mat3& value);
+    void set(int uniform, const glm::mat4& value);
+
+    // Uniform writes that reached the driver, across all programs
+    static size_t getUploads() { return uploads; }
+
+private:
+    struct Uniform {
+        std::string name;
+        int location;
+        bool valid;
+        float value[16];
+    };
+
+    bool changed(int uniform, const float* value, size_t count);
+    void finishLink();
+
+    unsigned int id = 0;
+    std::vector<Uniform> uniforms;
+    static size_t uploads;
+};
+
+size_t ShaderProgram::uploads = 0;
+
+// Insert preprocessor defines after the #version line of a shader source
+std::string addDefines(const char* source, const char* defines) {
+    std::string text = source;
+    size_t versionEnd = text.find('\n') + 1;
+    return text.insert(versionEnd, defines);
+}
+
+ShaderProgram::ShaderProgram(const char* vertexSource, const char* fragmentSource, const char* defines) {
+    std::string vertexText = addDefines(vertexSource, defines);
+    std::string fragmentText = addDefines(fragmentSource, defines);
+    uint64_t key = programCache.key({vertexText, fragmentText});
+
+    id = glCreateProgram();
+    if (!programCache.load(id, key)) {
+        // The program may hold a rejected binary; start from a clean one
+        glDeleteProgram(id);
+        id = glCreateProgram();
+        unsigned int vs = compileShader(GL_VERTEX_SHADER, vertexText.c_str());
+        unsigned int fs = compileShader(GL_FRAGMENT_SHADER, fragmentText.c_str());
+
+        glAttachShader(id, vs);
+        glAttachShader(id, fs);
+        if (programCache.enabled())
+            glProgramParameteri(id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        glLinkProgram(id);
+
+        glDeleteShader(vs);
+        glDeleteShader(fs);
+        programCache.store(id, key);
+    }
+    finishLink();
+}
+
+ShaderProgram ShaderProgram::compute(const char* computeSource, const char* defines) {
+    std::string computeText = addDefines(computeSource, defines);
+    uint64_t key = programCache.key({computeText});
+
+    ShaderProgram program;
+    program.id = glCreateProgram();
+    if (!programCache.load(program.id, key)) {
+        glDeleteProgram(program.id);
+        program.id = glCreateProgram();
+        unsigned int cs = compileShader(GL_COMPUTE_SHADER, computeText.c_str());
+        glAttachShader(program.id, cs);
+        if (programCache.enabled())
+            glProgramParameteri(program.id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        glLinkProgram(program.id);
+        glDeleteShader(cs);
+        programCache.store(program.id, key);
+    }
+    program.finishLink();
+    return program;
+}
+
+// Check the link status and resolve what the program uses
+void ShaderProgram::finishLink() {
+    int success;
+    glGetProgramiv(id, GL_LINK_STATUS, &success);
+    if (!success) {
+        char infoLog[512];
+        glGetProgramInfoLog(id, 512, nullptr, infoLog);
+        std::cerr << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+    }
+
+    // Share the frame uniform buffer with every program that declares it
+    unsigned int frameBlock = glGetUniformBlockIndex(id, "FrameData");
+    if (frameBlock != GL_INVALID_INDEX)
+        glUniformBlockBinding(id, frameBlock, FRAME_UNIFORM_BINDING);
+
+    // Resolve every active uniform outside a block
+    int count = 0;
+    glGetProgramiv(id, GL_ACTIVE_UNIFORMS, &count);
+    for (int i = 0; i < count; i++) {
+        char name[256];
+        int size;
+        GLenum type;
+        glGetActiveUniform(id, i, sizeof(name), nullptr, &size, &type, name);
+        int location = glGetUniformLocation(id, name);
+        if (location < 0)
+            continue;
+        if (char* bracket = std::strchr(name, '['))
+            *bracket = '\0';
+        uniforms.push_back(Uniform{name, location, false, {}});
+    }
+}
+
+void ShaderProgram::destroy() {
+    glDeleteProgram(id);
+    id = 0;
+    uniforms.clear();
+}
+
+int ShaderProgram::uniform(const char* name) const {
+    for (size_t i = 0; i < uniforms.size(); i++) {
+        if (uniforms[i].name == name)
+            return (int)i;
+    }
+    return -1;
+}
+
+bool ShaderProgram::changed(int uniform, const float* value, size_t count) {
+    if (uniform < 0)
+        return false;
+    Uniform& cached = uniforms[uniform];
+    if (cached.valid && std::memcmp(cached.value, value, count * sizeof(float)) == 0)
+        return false;
+    std::memcpy(cached.value, value, count * sizeof(float));
+    cached.valid = true;
+    uploads++;
+    return true;
+}
+
+void ShaderProgram::set(int uniform, int value) {
+    float bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    if (changed(uniform, &bits, 1))
+        glUniform1i(uniforms[uniform].location, value);
+}
+
+void ShaderProgram::set(int uniform, const glm::ivec2& value) {
+    float bits[2];
+    std::memcpy(bits, &value.x, sizeof(bits));
+    if (changed(uniform, bits, 2))
+        glUniform2iv(uniforms[uniform].location, 1, &value.x);
+}
+
+void ShaderProgram::set(int uniform, const glm::ivec3& value) {
+    float bits[3];
+    std::memcpy(bits, &value.x, sizeof(bits));
+    if (changed(uniform, bits, 3))
+        glUniform3iv(uniforms[uniform].location, 1, &value.x);
+}
+
+void ShaderProgram::set(int uniform, float value) {
+    if (changed(uniform, &value, 1))
+        glUniform1f(uniforms[uniform].location, value);
+}
+
+void ShaderProgram::set(int uniform, const glm::vec2& value) {
+    if (changed(uniform, glm::value_ptr(value), 2))
+        glUniform2fv(uniforms[uniform].location, 1, glm::value_ptr(value));
+}
+
+void ShaderProgram::set(int uniform, const glm::vec3& value) {
+    if (changed(uniform, glm::value_ptr(value), 3))
+        glUniform3fv(uniforms[uniform].location, 1, glm::value_ptr(value));
+}
+
+void ShaderProgram::set(int uniform, const glm::mat3& value) {
+    if (changed(uniform, glm::value_ptr(value), 9))
+        glUniformMatrix3fv(uniforms[uniform].location, 1, GL_FALSE, glm::value_ptr(value));
+}
+
+void ShaderProgram::set(int uniform, const glm::mat4& value) {
+    if (changed(uniform, glm::value_ptr(value), 16))
+        glUniformMatrix4fv(uniforms[uniform].location, 1, GL_FALSE, glm::value_ptr(value));
+}
+
+// CPU side of the FrameData block, laid out with std140 rules
+struct FrameUniforms {
+    glm::mat4 projection;
+    glm::mat4 view;
+    glm::vec3 viewPos;
+    float pad0;
+    glm::vec3 lightColor;
+    float pad1;
+};
+
+// Uniform buffer holding FrameUniforms, bound at FRAME_UNIFORM_BINDING. The
+// buffer is only written when the frame data actually changes.
+class FrameUniformBuffer {
+public:
+    void create();
+    void update(const FrameUniforms& data);
+    void destroy();
+
+private:
+    unsigned int ubo = 0;
+    FrameUniforms current = {};
+    bool valid = false;
+};
+
+void FrameUniformBuffer::create() {
+    glGenBuffers(1, &ubo);
+    glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), nullptr, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_UNIFORM_BINDING, ubo);
+    valid = false;
+}
+
+void FrameUniformBuffer::update(const FrameUniforms& data) {
+    if (valid && std::memcmp(&current, &data, sizeof(FrameUniforms)) == 0)
+        return;
+    current = data;
+    valid = true;
+    glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &current);
+}
+
+void FrameUniformBuffer::destroy() {
+    glDeleteBuffers(1, &ubo);
+    ubo = 0;
+    valid = false;
+}
+
+// Frames of data in flight in a StreamBuffer
+const int STREAM_BUFFER_FRAMES = 3;
+
+// Vertex data rewritten every frame. With ARB_buffer_storage it is one
+// buffer mapped once, persistent and coherent, split into
+// STREAM_BUFFER_FRAMES sections; each frame writes the next section after
+// waiting on the fence of the frame that last drew from it. Otherwise each
+// frame orphans the buffer with glBufferData and uploads with
+// glBufferSubData, which leaves the copy to the driver.
+class StreamBuffer {
+public:
+    void create(size_t frameSize, bool persistent);
+    void destroy();
+
+    // Space for size bytes of this frame's data, growing the buffer if needed
+    uint8_t* map(size_t size);
+    // Finish this frame's data and return its offset in getBuffer()
+    size_t unmap();
+    // Call after the last draw reading this frame's data
+    void fence();
+
+    unsigned int getBuffer() const { return buffer; }
+    bool isPersistent() const { return persistent; }
+    // Frames that found their section still in use by the GPU
+    int getStalls() const { return stalls; }
+
+private:
+    void allocate(size_t frameSize);
+
+    unsigned int buffer = 0;
+    bool persistent = false;
+    size_t sectionSize = 0;
+    uint8_t* mapped = nullptr;
+    GLsync fences[STREAM_BUFFER_FRAMES] = {};
+    int section = 0;
+    std::vector<uint8_t> staging; // Orphaning path only
+    size_t stagingSize = 0;
+    int stalls = 0;
+};
+
+void StreamBuffer::create(size_t frameSize, bool persistentMap) {
+    persistent = persistentMap;
+    stalls = 0;
+    allocate(frameSize);
+}
+
+void StreamBuffer::allocate(size_t frameSize) {
+    // Sections start on a 256 byte boundary
+    sectionSize = std::max<size_t>((frameSize + 255) & ~(size_t)255, 256);
+    if (buffer) {
+        // Growing: the old buffer may still be read by queued draws
+        for (GLsync& fence : fences) {
+            if (fence) {
+                glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, UINT64_MAX);
+                glDeleteSync(fence);
+                fence = nullptr;
+            }
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        if (mapped)
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+        glDeleteBuffers(1, &buffer);
+        mapped = nullptr;
+    }
+    section = 0;
+
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    if (persistent) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_ARRAY_BUFFER, sectionSize * STREAM_BUFFER_FRAMES, nullptr, flags);
+        mapped = (uint8_t*)glMapBufferRange(GL_ARRAY_BUFFER, 0, sectionSize * STREAM_BUFFER_FRAMES, flags);
+    } else {
+        glBufferData(GL_ARRAY_BUFFER, sectionSize, nullptr, GL_STREAM_DRAW);
+    }
+}
+
+uint8_t* StreamBuffer::map(size_t size) {
+    if (size > sectionSize)
+        allocate(std::max(size, sectionSize * 2));
+
+    if (!persistent) {
+        staging.resize(std::max(staging.size(), size));
+        stagingSize = size;
+        return staging.data();
+    }
+
+    // The GPU may still be drawing from this section three frames back
+    if (GLsync fence = fences[section]) {
+        if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+            stalls++;
+            glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, UINT64_MAX);
+        }
+        glDeleteSync(fence);
+        fences[section] = nullptr;
+    }
+    return mapped + section * sectionSize;
+}
+
+size_t StreamBuffer::unmap() {
+    if (persistent)
+        return section * sectionSize;
+
+    // Orphan the old storage so the upload never waits for draws using it
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glBufferData(GL_ARRAY_BUFFER, sectionSize, nullptr, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, stagingSize, staging.data());
+    return 0;
+}
+
+void StreamBuffer::fence() {
+    if (!persistent)
+        return;
+    fences[section] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    section = (section + 1) % STREAM_BUFFER_FRAMES;
+}
+
+void StreamBuffer::destroy() {
+    for (GLsync& fence : fences) {
+        if (fence)
+            glDeleteSync(fence);
+        fence = nullptr;
+    }
+    if (mapped) {
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        mapped = nullptr;
+    }
+    glDeleteBuffers(1, &buffer);
+    buffer = 0;
+    sectionSize = 0;
+    staging.clear();
+}
+
+// Per-cube data, laid out to match the instanced vertex attributes
+struct CubeInstance {
+    glm::mat4 model;
+    glm::vec3 lightPos;
+    float shininess;
+    glm::mat3 normalMatrix;
+};
+
+// Radius of a sphere around the cube's centre that holds it in any
+// orientation: half the diagonal of a unit cube at its largest scale
+float cubeBoundingRadius(const glm::mat4& model) {
+    return 0.87f * std::max({glm::length(glm::vec3(model[0])), glm::length(glm::vec3(model[1])),
+                             glm::length(glm::vec3(model[2]))});
+}
+
+// True when the upper 3x3 of the model matrix is a rotation with uniform
+// scale, i.e. its columns are orthogonal and of equal length
+bool isRigidTransform(const glm::mat4& model) {
+    glm::mat3 linear(model);
+    float lengthSq0 = glm::dot(linear[0], linear[0]);
+    float lengthSq1 = glm::dot(linear[1], linear[1]);
+    float lengthSq2 = glm::dot(linear[2], linear[2]);
+    float tolerance = 1e-5f * lengthSq0;
+    return lengthSq0 > 0.0f &&
+           std::abs(glm::dot(linear[0], linear[1])) <= tolerance &&
+           std::abs(glm::dot(linear[0], linear[2])) <= tolerance &&
+           std::abs(glm::dot(linear[1], linear[2])) <= tolerance &&
+           std::abs(lengthSq1 - lengthSq0) <= tolerance &&
+           std::abs(lengthSq2 - lengthSq0) <= tolerance;
+}
+
+// Inverse transpose of the model matrix's upper 3x3, for transforming
+// normals. Call whenever the model matrix changes. Rigid transforms skip the
+// inverse: the inverse transpose of R * s is R / s.
+glm::mat3 computeNormalMatrix(const glm::mat4& model) {
+    glm::mat3 linear(model);
+    if (isRigidTransform(model))
+        return linear * (1.0f / glm::dot(linear[0], linear[0]));
+    return glm::transpose(glm::inverse(linear));
+}
+
+// Animation time between frames in headless and benchmark runs, which do
+// not follow the clock
+const float ANIMATION_TIME_STEP = 1.0f / 60.0f;
+
+// How the forward+ path bins lights into screen tiles
+enum class LightCulling {
+    Auto, // Compute shader when available, otherwise CPU
+    Gpu,  // Compute shader writing the tile lists into SSBOs
+    Cpu,  // Binned on the CPU and uploaded
+    None  // No tiles: every fragment loops over every light
+};
+
+// Specular term compiled into the lighting shaders
+enum class SpecularModel {
+    Phong,     // reflect(-lightDir, norm) against the view direction
+    BlinnPhong // Half vector against the normal, 4x the exponent
+};
+
+// How animated per-instance data is streamed to the GPU
+enum class StreamUpload {
+    Auto,       // Persistent when buffer storage is available
+    Persistent, // Triple-buffered persistently mapped ring
+    Orphan      // glBufferData orphaning and glBufferSubData
+};
+
+// When the window's render thread presents a frame
+enum class PresentMode {
+    Vsync,    // Swap interval 1: at the display's refresh
+    Uncapped, // Swap interval 0: as soon as the frame is rendered
+    Capped    // Swap interval 0, sleeping to hold Options::maxFps
+};
+
+// Command line options
+struct Options {
+    // Scene file, text or binary, drawn instead of the generated grid; the
+    // grid, lights and shininess options then do not apply
+    std::string sceneFile;
+    // Write the scene to this file, binary for .bin, and exit
+    std::string saveScene;
+
+    int gridColumns = 4;
+    int gridRows = 2;
+    int lights = 0; // 0 gives every cube its own light
+    std::vector<float> shininess = {2.0f, 4.0f, 8.0f, 16.0f, 32.0f, 64.0f, 128.0f, 256.0f};
+    bool instanced = false;
+    VertexFormat vertexFormat = VertexFormat::Packed;
+    SpecularModel specular = SpecularModel::Phong;
+    // Compile a shader variant per power-of-two shininess that squares
+    // instead of calling pow(); other values use the generic variant
+    bool specializeShininess = true;
+
+    // Forward+ lighting: every fragment is lit by all lights in range
+    bool clusteredLighting = false;
+    LightCulling lightCulling = LightCulling::Auto;
+    float lightRadius = 0.0f; // 0 scales the radius with the light spacing
+    // Shade the forward+ lights once per pixel from a G-buffer instead of
+    // per fragment; implies clusteredLighting
+    bool deferred = false;
+    // Bake the shading of the current view into a lightmap and redraw from
+    // it until the view changes; animated scenes are always shaded live
+    bool bakeLighting = false;
+
+    // Spin the cubes and circle their lights, streaming the instance data
+    // to the GPU every frame
+    bool animate = false;
+    StreamUpload streamUpload = StreamUpload::Auto;
+
+    // Camera zoom, > 1 moves the camera closer to the grid
+    float zoom = 1.0f;
+    // Skip cubes outside the view frustum
+    bool frustumCulling = true;
+    // Submit each program's sorted draws on the instanced paths with one
+    // multi-draw indirect call instead of a draw per command
+    bool multiDraw = true;
+    // Sort the draws into this many depth layers, nearest first, before
+    // grouping them by state within a layer
+    int depthLayers = 1;
+    // Lay down depth in a depth-only pass first, so the shading pass shades
+    // each covered pixel about once
+    bool depthPrepass = false;
+    // Skip cubes hidden behind the hi-Z pyramid of an earlier frame of the
+    // same view
+    bool occlusionCulling = false;
+
+    // Windowed mode redraws only when something changed unless continuous
+    bool continuous = false;
+    // Dynamic resolution: scale the rendered resolution to keep frames
+    // under this many milliseconds; 0 always renders at full resolution
+    float targetFrameMs = 0.0f;
+    PresentMode presentMode = PresentMode::Vsync;
+    int maxFps = 60; // PresentMode::Capped only
+
+    // Headless mode
+    bool headless = false;
+    int width = WIDTH;
+    int height = HEIGHT;
+    int frames = 0; // 0 picks the mode's default
+    std::string output = "shine.png";
+
+    // Stream every rendered frame to this .y4m or .ppm file
+    std::string capture;
+    int captureFps = 60;
+
+    // Software reference renderer
+    bool software = false;
+    bool validate = false;
+    int threads = 0; // 0 uses every hardware thread
+    bool simd = true;
+
+    // Linked program binaries are cached here; empty disables the cache
+    std::string shaderCache = defaultShaderCacheDirectory();
+
+    // Chrome trace of the run's CPU and GPU zones; needs a SHINE_TRACE build
+    std::string trace;
+
+    // Material sweep: every combination of the shininess values and these
+    // is rendered into a tile of atlases the size of the headless image
+    bool sweep = false;
+    std::vector<float> sweepStrengths = {0.5f};
+    std::vector<glm::vec3> sweepColors; // Empty sweeps only the scene's object colour
+    std::vector<float> sweepShifts = {0.0f, 0.35f, 0.7f, 1.05f};
+    int tileSize = 64;
+
+    // Benchmark mode
+    bool bench = false;
+    int warmupFrames = 10;
+    std::vector<std::string> benchScenes;
+    std::string benchJson = "bench.json";
+};
+
+void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " [options]\n"
+              << "  --scene-file FILE    Draw a text or binary scene file instead of the grid\n"
+              << "  --save-scene FILE    Write the scene as text, or binary for .bin, and exit\n"
+              << "  --grid COLUMNSxROWS  Size of the cube grid (default 4x2)\n"
+              << "  --lights N           Number of point lights, shared by nearby cubes (default one per cube)\n"
+              << "  --shininess A:B:...  Shininess values cycled across the cubes (default 2:4:...:256)\n"
+              << "  --instanced          Draw the whole grid with one instanced draw call\n"
+              << "  --mesh FORMAT        Cube vertex format: float, packed or half (default packed)\n"
+              << "  --specular MODEL     Specular term: phong or blinn (default phong)\n"
+              << "  --generic-shaders    Use pow() for every shininess instead of specialized shaders\n"
+              << "  --clustered-lights   Forward+ lighting: each fragment sums every light in range\n"
+              << "  --light-culling MODE Forward+ light binning: gpu, cpu or none (default gpu if supported)\n"
+              << "  --light-radius R     Forward+ light range (default scales with the light spacing)\n"
+              << "  --deferred           Shade the forward+ lights in a G-buffer lighting pass (G toggles)\n"
+              << "  --bake-lighting      Cache the shaded cube faces in a lightmap while the view is unchanged\n"
+              << "  --animate            Spin the cubes and move their lights\n"
+              << "  --stream-upload MODE Animated instance uploads: persistent or orphan (default persistent if supported)\n"
+              << "  --zoom F             Move the camera F times closer to the grid (default 1)\n"
+              << "  --no-cull            Draw every cube instead of frustum culling them\n"
+              << "  --no-multi-draw      Issue every indirect command as its own instanced draw\n"
+              << "  --depth-layers N     Draw in N depth layers front to back, each sorted by state (default 1)\n"
+              << "  --depth-prepass      Draw depth first, then shade only the nearest surface of each pixel\n"
+              << "  --occlusion-culling  Skip cubes hidden in the previous frame's hi-Z depth pyramid\n"
+              << "  --continuous         Redraw every frame instead of only when something changed\n"
+              << "  --frame-budget MS    Dynamic resolution: render smaller to keep frames under MS milliseconds\n"
+              << "  --present MODE       Window presentation: vsync, uncapped or capped (default vsync)\n"
+              << "  --max-fps N          Frame rate of --present capped (default 60)\n"
+              << "  --headless           Render offscreen without a window, save the image and exit\n"
+              << "  --size WIDTHxHEIGHT  Headless render resolution (default 800x600)\n"
+              << "  --frames N           Number of headless or measured benchmark frames (default 1 / 100)\n"
+              << "  --output FILE        Headless image, .png or .ppm (default shine.png)\n"
+              << "  --capture FILE       Record every frame as Y4M video (.y4m) or a PPM sequence\n"
+              << "  --capture-fps N      Frame rate written to the Y4M header (default 60)\n"
+              << "  --software           Render headless on the CPU reference renderer, no GL needed\n"
+              << "  --validate           Render with GL and the CPU renderer and compare the images\n"
+              << "  --threads N          Scene update and CPU renderer threads (default: all hardware threads)\n"
+              << "  --no-simd            Use the scalar CPU shading kernel\n"
+              << "  --shader-cache DIR   Program binary cache (default $XDG_CACHE_HOME/shine or ~/.cache/shine)\n"
+              << "  --no-shader-cache    Always compile shaders from source\n"
+              << "  --trace FILE         Write a Chrome trace of the run (builds with -DSHINE_TRACE)\n"
+              << "  --sweep              Render every material combination into tiles of atlases named after --output\n"
+              << "  --sweep-strength A:B Specular strengths swept along with --shininess (default 0.5)\n"
+              << "  --sweep-colors C:D   Object colours swept, as hex RRGGBB (default ff804f)\n"
+              << "  --sweep-shift A:B    Distances the light is shifted left, swept (default 0:0.35:0.7:1.05)\n"
+              << "  --tile-size N        Sweep tile width and height in pixels (default 64)\n"
+              << "  --bench              Run the benchmark headless and report frame-time statistics\n"
+              << "  --warmup N           Benchmark warm-up frames per scene (default 10)\n"
+              << "  --scene SPEC         Benchmark scene, e.g. grid=32x32,size=1280x720,lights=64,\n"
+              << "                       shininess=2:32:256,instanced=1,mesh=half,clustered=1,culling=cpu,\n"
+              << "                       radius=4,deferred=1,bake=1,zoom=8,cull=0,specular=blinn,specialize=0,animate=1,\n"
+              << "                       upload=orphan,file=big.bin,budget=16.6,multidraw=0,layers=8,prepass=1,\n"
+              << "                       occlusion=1 (repeatable)\n"
+              << "  --json FILE          Benchmark results as JSON (default bench.json)\n";
+}
+
+// Colon-separated numbers, e.g. 2:4:8
+bool parseFloatList(const char* text, std::vector<float>& values) {
+    values.clear();
+    for (const char* p = text; *p; ) {
+        char* end;
+        float value = std::strtof(p, &end);
+        if (end == p || !std::isfinite(value))
+            return false;
+        values.push_back(value);
+        p = (*end == ':') ? end + 1 : end;
+        if (*end != ':' && *end != '\0')
+            return false;
+    }
+    return !values.empty();
+}
+
+bool parseShininess(const char* text, std::vector<float>& values) {
+    return parseFloatList(text, values) &&
+           std::all_of(values.begin(), values.end(), [](float value) { return value > 0.0f; });
+}
+
+// Colon-separated hex colours, e.g. ff804f:c0c0c0
+bool parseColors(const char* text, std::vector<glm::vec3>& colors) {
+    colors.clear();
+    for (const char* p = text; *p; ) {
+        unsigned int red, green, blue;
+        int length = 0;
+        if (std::sscanf(p, "%2x%2x%2x%n", &red, &green, &blue, &length) != 3 || length != 6)
+            return false;
+        colors.push_back(glm::vec3(red, green, blue) / 255.0f);
+        p += length;
+        if (*p == ':')
+            p++;
+        else if (*p != '\0')
+            return false;
+    }
+    return !colors.empty();
+}
+
+bool parseSpecularModel(const char* text, SpecularModel& specular) {
+    if (std::strcmp(text, "phong") == 0)
+        specular = SpecularModel::Phong;
+    else if (std::strcmp(text, "blinn") == 0)
+        specular = SpecularModel::BlinnPhong;
+    else
+        return false;
+    return true;
+}
+
+bool parseStreamUpload(const char* text, StreamUpload& upload) {
+    if (std::strcmp(text, "persistent") == 0)
+        upload = StreamUpload::Persistent;
+    else if (std::strcmp(text, "orphan") == 0)
+        upload = StreamUpload::Orphan;
+    else
+        return false;
+    return true;
+}
+
+bool parsePresentMode(const char* text, PresentMode& mode) {
+    if (std::strcmp(text, "vsync") == 0)
+        mode = PresentMode::Vsync;
+    else if (std::strcmp(text, "uncapped") == 0)
+        mode = PresentMode::Uncapped;
+    else if (std::strcmp(text, "capped") == 0)
+        mode = PresentMode::Capped;
+    else
+        return false;
+    return true;
+}
+
+bool parseLightCulling(const char* text, LightCulling& culling) {
+    if (std::strcmp(text, "gpu") == 0)
+        culling = LightCulling::Gpu;
+    else if (std::strcmp(text, "cpu") == 0)
+        culling = LightCulling::Cpu;
+    else if (std::strcmp(text, "none") == 0)
+        culling = LightCulling::None;
+    else
+        return false;
+    return true;
+}
+
+// Apply a benchmark scene spec of comma-separated key=value pairs on top of
+// the command line options
+bool parseScene(const std::string& spec, Options& options) {
+    size_t start = 0;
+    while (start < spec.size()) {
+        size_t end = spec.find(',', start);
+        if (end == std::string::npos)
+            end = spec.size();
+        std::string item = spec.substr(start, end - start);
+        start = end + 1;
+
+        size_t equals = item.find('=');
+        std::string key = item.substr(0, equals);
+        std::string value = equals == std::string::npos ? "" : item.substr(equals + 1);
+        bool valid = true;
+        if (key == "file") {
+            options.sceneFile = value;
+            valid = !value.empty();
+        } else if (key == "grid") {
+            valid = std::sscanf(value.c_str(), "%dx%d", &options.gridColumns, &options.gridRows) == 2 &&
+                    options.gridColumns > 0 && options.gridRows > 0;
+        } else if (key == "size") {
+            valid = std::sscanf(value.c_str(), "%dx%d", &options.width, &options.height) == 2 &&
+                    options.width > 0 && options.height > 0;
+        } else if (key == "lights") {
+            options.lights = std::atoi(value.c_str());
+            valid = options.lights >= 0;
+        } else if (key == "shininess") {
+            valid = parseShininess(value.c_str(), options.shininess);
+        } else if (key == "instanced") {
+            options.instanced = value != "0";
+        } else if (key == "mesh") {
+            valid = value == "float" || value == "packed" || value == "half";
+            if (valid)
+                options.vertexFormat = value == "float" ? VertexFormat::Float :
+                                       value == "half" ? VertexFormat::Half : VertexFormat::Packed;
+        } else if (key == "specular") {
+            valid = parseSpecularModel(value.c_str(), options.specular);
+        } else if (key == "specialize") {
+            options.specializeShininess = value != "0";
+        } else if (key == "animate") {
+            options.animate = value != "0";
+        } else if (key == "upload") {
+            valid = parseStreamUpload(value.c_str(), options.streamUpload);
+        } else if (key == "zoom") {
+            options.zoom = std::strtof(value.c_str(), nullptr);
+            valid = options.zoom > 0.0f;
+        } else if (key == "cull") {
+            options.frustumCulling = value != "0";
+        } else if (key == "multidraw") {
+            options.multiDraw = value != "0";
+        } else if (key == "layers") {
+            options.depthLayers = std::atoi(value.c_str());
+            valid = options.depthLayers >= 1 && options.depthLayers <= 256;
+        } else if (key == "prepass") {
+            options.depthPrepass = value != "0";
+        } else if (key == "occlusion") {
+            options.occlusionCulling = value != "0";
+        } else if (key == "clustered") {
+            options.clusteredLighting = value != "0";
+            options.deferred = options.deferred && options.clusteredLighting;
+        } else if (key == "deferred") {
+            options.deferred = value != "0";
+            options.clusteredLighting = options.clusteredLighting || options.deferred;
+        } else if (key == "budget") {
+            options.targetFrameMs = std::strtof(value.c_str(), nullptr);
+            valid = options.targetFrameMs >= 0.0f;
+        } else if (key == "bake") {
+            options.bakeLighting = value != "0";
+        } else if (key == "culling") {
+            valid = parseLightCulling(value.c_str(), options.lightCulling);
+        } else if (key == "radius") {
+            options.lightRadius = std::strtof(value.c_str(), nullptr);
+            valid = options.lightRadius >= 0.0f;
+        } else {
+            valid = false;
+        }
+        if (!valid) {
+            std::cerr << "Invalid scene setting '" << item << "' in " << spec << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool parseOptions(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--scene-file") == 0 && i + 1 < argc) {
+            options.sceneFile = argv[++i];
+        } else if (std::strcmp(argv[i], "--save-scene") == 0 && i + 1 < argc) {
+            options.saveScene = argv[++i];
+        } else if (std::strcmp(argv[i], "--grid") == 0 && i + 1 < argc) {
+            if (std::sscanf(argv[++i], "%dx%d", &options.gridColumns, &options.gridRows) != 2 ||
+                options.gridColumns < 1 || options.gridRows < 1) {
+                std::cerr << "Invalid grid size: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(argv[i], "--lights") == 0 && i + 1 < argc) {
+            options.lights = std::atoi(argv[++i]);
+            if (options.lights < 0) {
+                std::cerr << "Invalid light count: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(argv[i], "--shininess") == 0 && i + 1 < argc) {
+            if (!parseShininess(argv[++i], options.shininess)) {
+                std::cerr << "Invalid shininess list: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(argv[i], "--instanced") == 0) {
+            options.instanced = true;
+        } else if (std::strcmp(argv[i], "--mesh") == 0 && i + 1 < argc) {
+            const char* format = argv[++i];
+            if (std::strcmp(format, "float") == 0) {
+                options.vertexFormat = VertexFormat::Float;
+            } else if (std::strcmp(format, "packed") == 0) {
+                options.vertexFormat = VertexFormat::Packed;
+            } else if (std::strcmp(format, "half") == 0) {
+                options.vertexFormat = VertexFormat::Half;
+            } else {
+                std::cerr << "Invalid mesh format: " << format << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(argv[i], "--specular") == 0 && i + 1 < argc) {
+            if (!parseSpecularModel(argv[++i], options.specular)) {
+                std::cerr << "Invalid specular model: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(argv[i], "--generic-shaders") == 0) {
+            options.specializeShininess = false;
+        } else if (std::strcmp(argv[i], "--clustered-lights") == 0) {
+            options.clusteredLighting = true;
+        } else if (std::strcmp(argv[i], "--deferred") == 0) {
+            options.deferred = true;
+            options.clusteredLighting = true;
+        } else if (std::strcmp(argv[i], "--bake-lighting") == 0) {
+            options.bakeLighting = true;
+        } else if (std::strcmp(argv[i], "--light-culling") == 0 && i + 1 < argc) {
+            if (!parseLightCulling(argv[++i], options.lightCulling)) {
+                std::cerr << "Invalid light culling mode: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(argv[i], "--light-radius") == 0 && i + 1 < argc) {
+            options.lightRadius = std::strtof(argv[++i], nullptr);
+            if (options.lightRadius <= 0.0f) {
+                std::cerr << "Invalid light radius: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(argv[i], "--animate") == 0) {
+            options.animate = true;
+        } else if (std::strcmp(argv[i], "--stream-upload") == 0 && i + 1 < argc) {
+            if (!parseStreamUpload(argv[++i], options.streamUpload)) {
+                std::cerr << "Invalid stream upload mode: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(argv[i], "--zoom") == 0 && i + 1 < argc) {
+            options.zoom = std::strtof(argv[++i], nullptr);
+            if (options.zoom <= 0.0f) {
+                std::cerr << "Invalid zoom: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(argv[i], "--no-cull") == 0) {
+            options.frustumCulling = false;
+        } else if (std::strcmp(argv[i], "--no-multi-draw") == 0) {
+            options.multiDraw = false;
+        } else if (std::strcmp(argv[i], "--depth-layers") == 0 && i + 1 < argc) {
+            options.depthLayers = std::atoi(argv[++i]);
+            if (options.depthLayers < 1 || options.depthLayers > 256) {
+                std::cerr << "Invalid depth layer count: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(argv[i], "--depth-prepass") == 0) {
+            options.depthPrepass = true;
+        } else if (std::strcmp(argv[i], "--occlusion-culling") == 0) {
+            options.occlusionCulling = true;
+        } else if (std::strcmp(argv[i], "--continuous") == 0) {
+            options.continuous = true;
+        } else if (std::strcmp(argv[i], "--frame-budget") == 0 && i + 1 < argc) {
+            options.targetFrameMs = std::strtof(argv[++i], nullptr);
+            if (options.targetFrameMs <= 0.0f) {
+                std::cerr << "Invalid frame budget: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(argv[i], "--present") == 0 && i + 1 < argc) {
+            if (!parsePresentMode(argv[++i], options.presentMode)) {
+                std::cerr << "Invalid present mode: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(argv[i], "--max-fps") == 0 && i + 1 < argc) {
+            options.maxFps = std::atoi(argv[++i]);
+            if (options.maxFps <= 0) {
+                std::cerr << "Invalid frame rate: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(argv[i], "--headless") == 0) {
+            options.headless = true;
+        } else if (std::strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            if (std::sscanf(argv[++i], "%dx%d", &options.width, &options.height) != 2 ||
+                options.width < 1 || options.height < 1) {
+                std::cerr << "Invalid size: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            options.frames = std::atoi(argv[++i]);
+            if (options.frames < 1) {
+                std::cerr << "Invalid frame count: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            options.output = argv[++i];
+        } else if (std::strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+            options.capture = argv[++i];
+        } else if (std::strcmp(argv[i], "--capture-fps") == 0 && i + 1 < argc) {
+            options.captureFps = std::atoi(argv[++i]);
+            if (options.captureFps <= 0) {
+                std::cerr << "Invalid capture frame rate: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(argv[i], "--software") == 0) {
+            options.software = true;
+        } else if (std::strcmp(argv[i], "--validate") == 0) {
+            options.validate = true;
+        } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            options.threads = std::atoi(argv[++i]);
+            if (options.threads < 0) {
+                std::cerr << "Invalid thread count: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(argv[i], "--no-simd") == 0) {
+            options.simd = false;
+        } else if (std::strcmp(argv[i], "--shader-cache") == 0 && i + 1 < argc) {
+            options.shaderCache = argv[++i];
+        } else if (std::strcmp(argv[i], "--no-shader-cache") == 0) {
+            options.shaderCache.clear();
+        } else if (std::strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            options.trace = argv[++i];
+        } else if (std::strcmp(argv[i], "--sweep") == 0) {
+            options.sweep = true;
+        } else if (std::strcmp(argv[i], "--sweep-strength") == 0 && i + 1 < argc) {
+            if (!parseFloatList(argv[++i], options.sweepStrengths) ||
+                std::any_of(options.sweepStrengths.begin(), options.sweepStrengths.end(),
+                            [](float strength) { return strength < 0.0f; })) {
+                std::cerr << "Invalid specular strength list: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(argv[i], "--sweep-colors") == 0 && i + 1 < argc) {
+            if (!parseColors(argv[++i], options.sweepColors)) {
+                std::cerr << "Invalid colour list: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(argv[i], "--sweep-shift") == 0 && i + 1 < argc) {
+            if (!parseFloatList(argv[++i], options.sweepShifts)) {
+                std::cerr << "Invalid light shift list: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(argv[i], "--tile-size") == 0 && i + 1 < argc) {
+            options.tileSize = std::atoi(argv[++i]);
+            if (options.tileSize < 1) {
+                std::cerr << "Invalid tile size: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(argv[i], "--bench") == 0) {
+            options.bench = true;
+        } else if (std::strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+            options.warmupFrames = std::atoi(argv[++i]);
+            if (options.warmupFrames < 0) {
+                std::cerr << "Invalid warm-up frame count: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(argv[i], "--scene") == 0 && i + 1 < argc) {
+            options.benchScenes.push_back(argv[++i]);
+        } else if (std::strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            options.benchJson = argv[++i];
+        } else {
+            printUsage(argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string jsonEscape(const std::string& text) {
+    std::string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\')
+            escaped += '\\';
+        escaped += c;
+    }
+    return escaped;
+}
+
+// Tracing, compiled in with -DSHINE_TRACE and recorded with --trace FILE.
+// CPU zones go into a ring per thread that only that thread writes, so
+// recording a zone takes no lock; the thread that renders (the render
+// thread in windowed mode) drains the rings once a frame. GPU zones are
+// timestamp query pairs read back once the GPU has passed them. Both are
+// written as Chrome trace-event JSON, which Perfetto and chrome://tracing
+// open. Without SHINE_TRACE the TRACE_ macros expand to nothing.
+#ifdef SHINE_TRACE
+const size_t TRACE_RING_SIZE = 1 << 16;    // Zones a thread can record between drains
+const size_t TRACE_MAX_EVENTS = 1 << 22;   // Zones kept for the file, about 100 MB
+const size_t TRACE_GPU_QUERY_PAIRS = 1024; // GPU zones in flight
+const int TRACE_GPU_THREAD = 1000;         // Track id of the GPU zones
+
+// A zone on the steady clock, in nanoseconds. Names are string literals.
+struct TraceEvent {
+    const char* name;
+    int64_t start;
+    int64_t end;
+};
+
+// Single-producer single-consumer ring of one thread's zones. A full ring
+// drops new zones rather than wait for the drain.
+class TraceRing {
+public:
+    TraceRing(int id, const std::string& name) : id(id), name(name), events(new TraceEvent[TRACE_RING_SIZE]) {}
+
+    void push(const TraceEvent& event);
+    // Call visit on every zone pushed so far, oldest first, and drop them
+    template <typename Visit>
+    void drain(Visit&& visit);
+
+    const int id;
+    std::string name;
+    std::atomic<uint64_t> dropped{0};
+
+private:
+    std::unique_ptr<TraceEvent[]> events;
+    std::atomic<size_t> head{0}; // Written by the owning thread
+    std::atomic<size_t> tail{0}; // Written by the drain
+};
+
+void TraceRing::push(const TraceEvent& event) {
+    size_t position = head.load(std::memory_order_relaxed);
+    if (position - tail.load(std::memory_order_acquire) == TRACE_RING_SIZE) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    events[position % TRACE_RING_SIZE] = event;
+    head.store(position + 1, std::memory_order_release);
+}
+
+template <typename Visit>
+void TraceRing::drain(Visit&& visit) {
+    size_t position = tail.load(std::memory_order_relaxed);
+    size_t end = head.load(std::memory_order_acquire);
+    for (; position != end; position++)
+        visit(events[position % TRACE_RING_SIZE]);
+    tail.store(position, std::memory_order_release);
+}
+
+class Tracer {
+public:
+    // Record from now on, for finish() to write to path
+    void start(const std::string& path);
+    bool recording() const { return active.load(std::memory_order_relaxed); }
+    static int64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Name the calling thread's track
+    void nameThread(const std::string& name);
+    void record(const char* name, int64_t start, int64_t end) { threadRing().push(TraceEvent{name, start, end}); }
+
+    // GPU zones need the context current from startGpu() to stopGpu().
+    // beginGpu() returns the query pair for endGpu(), or -1 when GPU zones
+    // are off or every pair is in flight.
+    void startGpu();
+    int beginGpu();
+    void endGpu(int pair, const char* name);
+    void stopGpu();
+
+    // Move the rings' zones and the finished GPU zones into the trace; once
+    // a frame on the thread that renders (the render thread in windowed
+    // mode). TraceRing::drain is single-consumer, so only one thread may
+    // call this at a time.
+    void collect();
+    // Write the trace and stop recording. False if the file could not be
+    // written.
+    bool finish();
+
+private:
+    struct Recorded {
+        TraceEvent event;
+        int thread;
+    };
+    struct GpuZone {
+        const char* name;
+        int pair;
+    };
+
+    TraceRing& threadRing();
+    void keep(const TraceEvent& event, int thread);
+    void resolveGpu(bool wait);
+
+    std::string path;
+    std::atomic<bool> active{false};
+    int64_t epoch = 0;
+
+    std::mutex ringsMutex; // Guards rings, only taken by a thread's first zone
+    std::vector<std::unique_ptr<TraceRing>> rings;
+    std::vector<Recorded> events;
+    uint64_t dropped = 0;
+
+    bool gpu = false;
+    int64_t gpuOffset = 0; // Steady clock minus GPU timestamp
+    std::vector<unsigned int> queries;
+    std::vector<int> freePairs;
+    std::deque<GpuZone> pendingGpu;
+};
+
+Tracer tracer;
+
+void Tracer::start(const std::string& tracePath) {
+    path = tracePath;
+    epoch = now();
+    nameThread("Main");
+    active.store(true, std::memory_order_relaxed);
+}
+
+TraceRing& Tracer::threadRing() {
+    thread_local TraceRing* ring = nullptr;
+    if (!ring) {
+        std::lock_guard<std::mutex> lock(ringsMutex);
+        int id = (int)rings.size();
+        rings.push_back(std::make_unique<TraceRing>(id, "Thread " + std::to_string(id)));
+        ring = rings.back().get();
+    }
+    return *ring;
+}
+
+void Tracer::nameThread(const std::string& name) {
+    TraceRing& ring = threadRing();
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    ring.name = name;
+}
+
+// Timestamps are calibrated against the steady clock once; drivers without
+// a timestamp counter get no GPU zones
+void Tracer::startGpu() {
+    if (!recording())
+        return;
+    int bits = 0;
+    glGetQueryiv(GL_TIMESTAMP, GL_QUERY_COUNTER_BITS, &bits);
+    if (bits == 0) {
+        std::cerr << "GPU timestamps are not supported, tracing the CPU only" << std::endl;
+        return;
+    }
+    queries.resize(2 * TRACE_GPU_QUERY_PAIRS);
+    glGenQueries((GLsizei)queries.size(), queries.data());
+    for (int pair = (int)TRACE_GPU_QUERY_PAIRS - 1; pair >= 0; pair--)
+        freePairs.push_back(pair);
+    GLint64 gpuNow = 0;
+    glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+    gpuOffset = now() - gpuNow;
+    gpu = true;
+}
+
+int Tracer::beginGpu() {
+    if (!gpu || freePairs.empty())
+        return -1;
+    int pair = freePairs.back();
+    freePairs.pop_back();
+    glQueryCounter(queries[2 * pair], GL_TIMESTAMP);
+    return pair;
+}
+
+void Tracer::endGpu(int pair, const char* name) {
+    glQueryCounter(queries[2 * pair + 1], GL_TIMESTAMP);
+    pendingGpu.push_back(GpuZone{name, pair});
+}
+
+// Zones finish in order, so the first one not yet available ends the scan
+void Tracer::resolveGpu(bool wait) {
+    while (!pendingGpu.empty()) {
+        const GpuZone& zone = pendingGpu.front();
+        if (!wait) {
+            GLint available = 0;
+            glGetQueryObjectiv(queries[2 * zone.pair + 1], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                return;
+        }
+        GLint64 start = 0, end = 0;
+        glGetQueryObjecti64v(queries[2 * zone.pair], GL_QUERY_RESULT, &start);
+        glGetQueryObjecti64v(queries[2 * zone.pair + 1], GL_QUERY_RESULT, &end);
+        keep(TraceEvent{zone.name, start + gpuOffset, end + gpuOffset}, TRACE_GPU_THREAD);
+        freePairs.push_back(zone.pair);
+        pendingGpu.pop_front();
+    }
+}
+
+void Tracer::stopGpu() {
+    if (!gpu)
+        return;
+    resolveGpu(true);
+    glDeleteQueries((GLsizei)queries.size(), queries.data());
+    queries.clear();
+    freePairs.clear();
+    gpu = false;
+}
+
+void Tracer::keep(const TraceEvent& event, int thread) {
+    if (events.size() < TRACE_MAX_EVENTS)
+        events.push_back(Recorded{event, thread});
+    else
+        dropped++;
+}
+
+void Tracer::collect() {
+    if (!recording())
+        return;
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    for (const std::unique_ptr<TraceRing>& ring : rings)
+        ring->drain([&](const TraceEvent& event) { keep(event, ring->id); });
+    if (gpu)
+        resolveGpu(false);
+}
+
+bool Tracer::finish() {
+    if (!recording())
+        return true;
+    collect();
+    active.store(false, std::memory_order_relaxed);
+
+    std::FILE* file = std::fopen(path.c_str(), "w");
+    if (!file) {
+        std::cerr << "Failed to write " << path << std::endl;
+        return false;
+    }
+    std::fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    std::fprintf(file, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"shine\"}}");
+    for (const std::unique_ptr<TraceRing>& ring : rings) {
+        std::fprintf(file, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                           "\"args\": {\"name\": \"%s\"}}", ring->id, jsonEscape(ring->name).c_str());
+        dropped += ring->dropped.load();
+    }
+    std::fprintf(file, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                       "\"args\": {\"name\": \"GPU\"}}", TRACE_GPU_THREAD);
+    // Complete events in microseconds since start(); zones that began
+    // earlier, like the GPU's first, are clamped to it
+    for (const Recorded& recorded : events) {
+        int64_t start = std::max(recorded.event.start, epoch) - epoch;
+        int64_t end = std::max(recorded.event.end, epoch) - epoch;
+        std::fprintf(file, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                           "\"ts\": %.3f, \"dur\": %.3f}",
+                     recorded.event.name, recorded.thread == TRACE_GPU_THREAD ? "gpu" : "cpu", recorded.thread,
+                     start / 1000.0, std::max<int64_t>(end - start, 0) / 1000.0);
+    }
+    std::fprintf(file, "\n]}\n");
+    bool written = std::ferror(file) == 0;
+    written = std::fclose(file) == 0 && written;
+    if (!written)
+        std::cerr << "Failed to write " << path << std::endl;
+    else
+        std::cout << "Trace: " << events.size() << " zone(s) written to " << path << ", " << dropped << " dropped"
+                  << std::endl;
+    return written;
+}
+
+// Records the enclosing scope as a zone of the calling thread
+class TraceZone {
+public:
+    explicit TraceZone(const char* name) : name(name), start(tracer.recording() ? Tracer::now() : -1) {}
+    ~TraceZone() {
+        if (start >= 0)
+            tracer.record(name, start, Tracer::now());
+    }
+
+private:
+    const char* name;
+    int64_t start;
+};
+
+// Records the GPU work issued in the enclosing scope; GL thread only
+class GpuTraceZone {
+public:
+    explicit GpuTraceZone(const char* name) : name(name), pair(tracer.beginGpu()) {}
+    ~GpuTraceZone() {
+        if (pair >= 0)
+            tracer.endGpu(pair, name);
+    }
+
+private:
+    const char* name;
+    int pair;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_ZONE(name) TraceZone TRACE_CONCAT(traceZone, __LINE__)(name)
+#define TRACE_GPU_ZONE(name) GpuTraceZone TRACE_CONCAT(gpuTraceZone, __LINE__)(name)
+#define TRACE_THREAD(name) tracer.nameThread(name)
+#define TRACE_GPU_START() tracer.startGpu()
+#define TRACE_GPU_STOP() tracer.stopGpu()
+#define TRACE_COLLECT() tracer.collect()
+#else
+#define TRACE_ZONE(name) ((void)0)
+#define TRACE_GPU_ZONE(name) ((void)0)
+#define TRACE_THREAD(name) ((void)0)
+#define TRACE_GPU_START() ((void)0)
+#define TRACE_GPU_STOP() ((void)0)
+#define TRACE_COLLECT() ((void)0)
+#endif
+
+// Fixed set of worker threads for parallel loops. The calling thread takes
+// part in every loop, so a pool of size 1 has no workers and runs loops
+// inline. Loops are split by work stealing: every thread starts on its own
+// contiguous share of the indices, takes it a chunk at a time from the
+// front, and once it runs dry steals the back half of another thread's
+// remaining share.
+class ThreadPool {
+public:
+    explicit ThreadPool(int threads);
+    ~ThreadPool();
+
+    int size() const { return (int)workers.size() + 1; }
+
+    // Call job(index) for every index in [0, count), spread over all
+    // threads, and return once every call has finished
+    void parallelFor(int count, const std::function<void(int)>& job);
+    // Call job(begin, end) on chunks of at most grain indices covering
+    // [0, count), for loops over many small items
+    void parallelRanges(size_t count, size_t grain, const std::function<void(size_t, size_t)>& job);
+
+    // Shares taken from another thread, over the pool's lifetime
+    uint64_t getSteals() const { return steals; }
+
+private:
+    // A thread's remaining share, begin in the high half and end in the low
+    // half so that taking and stealing are single compare-and-swaps
+    struct alignas(64) Share {
+        std::atomic<uint64_t> range{0};
+    };
+
+    void workerLoop(int thread);
+    void runJobs(int thread);
+    bool steal(int thread);
+
+    std::vector<std::thread> workers;
+    std::unique_ptr<Share[]> shares;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    const std::function<void(size_t, size_t)>* job = nullptr;
+    size_t grain = 1;
+    int busyWorkers = 0;
+    unsigned generation = 0;
+    bool stopping = false;
+    std::atomic<uint64_t> steals{0};
+};
+
+ThreadPool::ThreadPool(int threads) {
+    shares.reset(new Share[std::max(threads, 1)]);
+    for (int i = 1; i < threads; i++)
+        workers.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& worker : workers)
+        worker.join();
+}
+
+void ThreadPool::parallelFor(int count, const std::function<void(int)>& function) {
+    parallelRanges(count, 1, [&](size_t begin, size_t end) {
+        for (size_t index = begin; index < end; index++)
+            function((int)index);
+    });
+}
+
+void ThreadPool::parallelRanges(size_t count, size_t chunk, const std::function<void(size_t, size_t)>& function) {
+    if (count == 0)
+        return;
+    if (workers.empty() || count <= chunk) {
+        function(0, count);
+        return;
+    }
+
+    // Indices are packed into 32 bits each
+    count = std::min<size_t>(count, UINT32_MAX);
+    int threads = size();
+    for (int thread = 0; thread < threads; thread++) {
+        uint64_t begin = count * thread / threads, end = count * (thread + 1) / threads;
+        shares[thread].range = begin << 32 | end;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &function;
+        grain = std::max<size_t>(chunk, 1);
+        busyWorkers = (int)workers.size();
+        generation++;
+    }
+    wake.notify_all();
+    runJobs(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [&] { return busyWorkers == 0; });
+    job = nullptr;
+}
+
+void ThreadPool::runJobs(int thread) {
+    TRACE_ZONE("Jobs");
+    std::atomic<uint64_t>& range = shares[thread].range;
+    do {
+        uint64_t current = range.load();
+        while (true) {
+            uint64_t begin = current >> 32, end = current & UINT32_MAX;
+            if (begin >= end)
+                break;
+            uint64_t next = std::min<uint64_t>(begin + grain, end);
+            if (range.compare_exchange_weak(current, next << 32 | end))
+                (*job)(begin, next);
+        }
+    } while (steal(thread));
+}
+
+// Move the back half of the first non-empty share found into this
+// thread's own, which is empty. False once every share is.
+bool ThreadPool::steal(int thread) {
+    int threads = size();
+    for (int offset = 1; offset < threads; offset++) {
+        std::atomic<uint64_t>& victim = shares[(thread + offset) % threads].range;
+        uint64_t current = victim.load();
+        while (true) {
+            uint64_t begin = current >> 32, end = current & UINT32_MAX;
+            if (begin >= end)
+                break;
+            uint64_t middle = begin + (end - begin) / 2;
+            if (victim.compare_exchange_weak(current, begin << 32 | middle)) {
+                shares[thread].range = middle << 32 | end;
+                steals++;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void ThreadPool::workerLoop(int thread) {
+    TRACE_THREAD("Worker " + std::to_string(thread));
+    unsigned seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping)
+                return;
+            seen = generation;
+        }
+        runJobs(thread);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--busyWorkers == 0)
+            finished.notify_one();
+    }
+}
+
+int workerThreadCount(const Options& options) {
+    if (options.threads > 0)
+        return options.threads;
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Scene defaults, those of the original 8-cube program
+const glm::vec3 CLEAR_COLOR(0.175f, 0.175f, 0.175f); // Light grey background
+const glm::vec3 LIGHT_COLOR(1.0f, 1.0f, 1.0f);
+const glm::vec3 OBJECT_COLOR(1.0f, 0.5f, 0.31f);
+
+// Initial camera rotation around the origin, in degrees
+const float CAMERA_ANGLE = -10.0f;
+
+// Camera orbiting target at distance, starting angle degrees around the
+// vertical axis from +z. Arrow keys orbit and zoom from there.
+struct SceneCamera {
+    glm::vec3 target = glm::vec3(0.0f);
+    float angle = CAMERA_ANGLE;
+    float distance = 10.0f;
+    float fov = 45.0f; // Vertical, in degrees
+    float nearPlane = 0.1f;
+    float farPlane = 100.0f;
+    // Specular highlights are lit for this eye position instead of the
+    // camera's when set
+    bool fixedEye = false;
+    glm::vec3 eye = glm::vec3(0.0f);
+};
+
+// Pull the camera back so larger grids stay in view
+float computeGridScale(const Options& options) {
+    return std::max({1.0f, options.gridColumns / 4.0f, options.gridRows / 2.0f});
+}
+
+// Layout of options.lights lights spread evenly over the cube grid,
+// columns wide and filled row by row. The last row may be partly empty.
+struct LightGrid {
+    int columns;
+    int rows;
+    float spacingX;
+    float spacingY;
+    float left;
+    float top;
+
+    glm::vec3 position(int column, int row) const {
+        return glm::vec3(left + (column + 0.5f) * spacingX, top - (row + 0.5f) * spacingY, 2.0f);
+    }
+};
+
+LightGrid computeLightGrid(const Options& options) {
+    int columns = options.gridColumns;
+    int rows = options.gridRows;
+
+    LightGrid grid;
+    grid.rows = std::max(1, (int)std::lround(std::sqrt((double)options.lights * rows / columns)));
+    grid.rows = std::min(grid.rows, std::max(1, options.lights));
+    grid.columns = std::max(1, (options.lights + grid.rows - 1) / grid.rows);
+    grid.spacingX = columns * 2.2f / grid.columns;
+    grid.spacingY = rows * 2.8f / grid.rows;
+    grid.left = -(float)((columns - 1) * 1.1) - 1.1f;
+    grid.top = (float)((rows - 1) * 1.4 + 0.3) + 1.4f;
+    return grid;
+}
+
+// Number of per-cube arrays in SceneData
+const int SCENE_ARRAY_COUNT = 16;
+
+// Everything drawn: the cubes in structure-of-arrays form, one array per
+// component, so the jobs that pose the cubes stream through only the data
+// they use, and the scene-wide lights, colours and camera. Generated from
+// the grid options or loaded from a scene file.
+struct SceneData {
+    std::vector<float> positionX, positionY, positionZ;
+    std::vector<float> axisX, axisY, axisZ, angle; // Rotation, degrees about the axis
+    std::vector<float> scaleX, scaleY, scaleZ;
+    std::vector<float> shininess;
+    std::vector<float> lightX, lightY, lightZ;
+    // With --animate, spin in degrees and light orbit in radians per second
+    std::vector<float> spinRate, orbitRate;
+
+    // Forward+ lights, xyz position and w radius. Empty uses every cube's
+    // own light with cubeLightRadius.
+    std::vector<glm::vec4> pointLights;
+    float cubeLightRadius = 0.0f;
+
+    glm::vec3 clearColor = CLEAR_COLOR;
+    glm::vec3 lightColor = LIGHT_COLOR;
+    glm::vec3 objectColor = OBJECT_COLOR;
+    SceneCamera camera;
+
+    size_t size() const { return positionX.size(); }
+    void resize(size_t count);
+    // Move entry order[i] to i in every array
+    void reorder(const std::vector<uint32_t>& order);
+
+    // Every per-cube array, in scene file order
+    std::array<std::vector<float>*, SCENE_ARRAY_COUNT> arrays() {
+        return {&positionX, &positionY, &positionZ, &axisX, &axisY, &axisZ, &angle, &scaleX, &scaleY, &scaleZ,
+                &shininess, &lightX, &lightY, &lightZ, &spinRate, &orbitRate};
+    }
+    std::array<const std::vector<float>*, SCENE_ARRAY_COUNT> arrays() const {
+        return {&positionX, &positionY, &positionZ, &axisX, &axisY, &axisZ, &angle, &scaleX, &scaleY, &scaleZ,
+                &shininess, &lightX, &lightY, &lightZ, &spinRate, &orbitRate};
+    }
+};
+
+void SceneData::resize(size_t count) {
+    for (std::vector<float>* array : arrays())
+        array->resize(count);
+}
+
+void SceneData::reorder(const std::vector<uint32_t>& order) {
+    std::vector<float> sorted(order.size());
+    for (std::vector<float>* array : arrays()) {
+        for (size_t i = 0; i < order.size(); i++)
+            sorted[i] = (*array)[order[i]];
+        array->swap(sorted);
+    }
+}
+
+// Cubes handed to one job at a time by the scene loops
+const size_t SCENE_JOB_GRAIN = 1024;
+
+// Lay out the cube grid. The default 4x2 grid reproduces the original
+// 8-cube row exactly; larger grids extend it and cycle the shininess values.
+// With options.lights set, that many lights are spread evenly over the grid
+// and each cube is lit by the one whose cell it falls in.
+SceneData buildScene(const Options& options, ThreadPool& pool) {
+    int columns = options.gridColumns;
+    int rows = options.gridRows;
+
+    // Offsets are worked out in double so the default grid hits the
+    // original constants (3.3, 2.3, 1.7) exactly
+    float originX = (float)((columns - 1) * 1.1);
+    float lightOriginX = (float)((columns - 1) * 1.1 - 1.0);
+    float originY = (float)((rows - 1) * 1.4 + 0.3);
+    LightGrid lightGrid = computeLightGrid(options);
+
+    SceneData scene;
+    scene.resize((size_t)columns * rows);
+    pool.parallelRanges(scene.size(), SCENE_JOB_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t index = begin; index < end; index++) {
+            int i = (int)index;
+
+            // Calculate cube position
+            float x = (i % columns) * 2.2f - originX;
+            float y = (i / columns) * -2.8f + originY;
+            scene.positionX[i] = x;
+            scene.positionY[i] = y;
+            scene.positionZ[i] = 0.0f;
+            scene.axisX[i] = 0.0f;
+            scene.axisY[i] = 1.0f;
+            scene.axisZ[i] = 0.0f;
+            scene.angle[i] = 9.0f;
+            scene.scaleX[i] = scene.scaleY[i] = scene.scaleZ[i] = 1.5f;
+            scene.shininess[i] = options.shininess[i % options.shininess.size()];
+
+            glm::vec3 lightPos;
+            if (options.lights == 0) {
+                // Light sits in front of the cube, shifted left by j * 0.35
+                // where j counts down 3, 2, 1, 0 and repeats
+                int j = 3 - (i % 4);
+                float lightX = (i % columns) * 2.2f - lightOriginX - (j * 0.35);
+                lightPos = glm::vec3(lightX, y, 2.0f); // Position lights in front of cubes
+            } else {
+                int lightColumn = std::min(lightGrid.columns - 1, (int)((i % columns) * 2.2f / lightGrid.spacingX));
+                int lightRow = std::min(lightGrid.rows - 1, (int)((i / columns) * 2.8f / lightGrid.spacingY));
+                while (lightRow > 0 && lightRow * lightGrid.columns + lightColumn >= options.lights)
+                    lightRow--;
+                lightColumn = std::min(lightColumn, options.lights - 1 - lightRow * lightGrid.columns);
+                lightPos = lightGrid.position(lightColumn, lightRow);
+            }
+            scene.lightX[i] = lightPos.x;
+            scene.lightY[i] = lightPos.y;
+            scene.lightZ[i] = lightPos.z;
+
+            // Each cube spins and moves its light at its own rate, from a
+            // hash of its position
+            float hash = std::sin(x * 12.9898f + y * 78.233f) * 43758.5453f;
+            hash -= std::floor(hash);
+            scene.spinRate[i] = 30.0f + 60.0f * hash;
+            scene.orbitRate[i] = (1.0f + hash) * 2.0f;
+        }
+    });
+
+    // By default the light radius reaches from the light plane down to the
+    // cubes and 1.5 light spacings across, so each cube face sees a handful
+    // of lights at any density
+    auto defaultRadius = [](float spacing) { return std::sqrt(2.0f * 2.0f + 1.5f * spacing * 1.5f * spacing); };
+    if (options.lights == 0) {
+        scene.cubeLightRadius = defaultRadius(2.8f);
+    } else {
+        float radius = defaultRadius(std::max(lightGrid.spacingX, lightGrid.spacingY));
+        for (int i = 0; i < options.lights; i++)
+            scene.pointLights.push_back(
+                glm::vec4(lightGrid.position(i % lightGrid.columns, i / lightGrid.columns), radius));
+    }
+
+    float gridScale = computeGridScale(options);
+    scene.camera.distance = 10.0f * gridScale;
+    scene.camera.farPlane = 100.0f * gridScale;
+    return scene;
+}
+
+// Write count cubes, scene entry indices[i] (or i without indices) posed
+// at time seconds, to out: which may be mapped GPU memory, so nothing is
+// read back. Animated cubes spin about the vertical axis through their
+// centre with their light circling in front of them; time zero and
+// !animate give the rest pose.
+void poseCubes(const SceneData& scene, const uint32_t* indices, size_t count, bool animate, float seconds,
+               CubeInstance* out, ThreadPool& pool) {
+    pool.parallelRanges(count, SCENE_JOB_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t k = begin; k < end; k++) {
+            size_t i = indices ? indices[k] : k;
+            // Rotation from axis and angle term for term as glm::rotate
+            // builds it, then scaled, without the 4x4 products
+            glm::vec3 axis = glm::normalize(glm::vec3(scene.axisX[i], scene.axisY[i], scene.axisZ[i]));
+            float angle = glm::radians(scene.angle[i]);
+            float c = std::cos(angle);
+            float s = std::sin(angle);
+            glm::vec3 t = (1.0f - c) * axis;
+            glm::mat3 rotation(glm::vec3(c + t.x * axis.x, t.x * axis.y + s * axis.z, t.x * axis.z - s * axis.y),
+                               glm::vec3(t.y * axis.x - s * axis.z, c + t.y * axis.y, t.y * axis.z + s * axis.x),
+                               glm::vec3(t.z * axis.x + s * axis.y, t.z * axis.y - s * axis.x, c + t.z * axis.z));
+            glm::vec3 scale(scene.scaleX[i], scene.scaleY[i], scene.scaleZ[i]);
+            glm::mat3 linear(rotation[0] * scale.x, rotation[1] * scale.y, rotation[2] * scale.z);
+            glm::mat4 model(glm::vec4(linear[0], 0.0f), glm::vec4(linear[1], 0.0f), glm::vec4(linear[2], 0.0f),
+                            glm::vec4(scene.positionX[i], scene.positionY[i], scene.positionZ[i], 1.0f));
+            // The inverse transpose of R * S is R / S
+            glm::mat3 normalMatrix;
+            if (scale.x == scale.y && scale.x == scale.z)
+                normalMatrix = linear * (1.0f / glm::dot(linear[0], linear[0]));
+            else
+                normalMatrix = glm::mat3(rotation[0] / scale.x, rotation[1] / scale.y, rotation[2] / scale.z);
+            glm::vec3 lightPos(scene.lightX[i], scene.lightY[i], scene.lightZ[i]);
+
+            if (animate) {
+                // Spin about the vertical axis, which leaves y alone. A
+                // rotation commutes with the inverse transpose.
+                float spinAngle = seconds * glm::radians(scene.spinRate[i]);
+                float spinCos = std::cos(spinAngle);
+                float spinSin = std::sin(spinAngle);
+                auto spin = [&](glm::vec3 v) {
+                    return glm::vec3(spinCos * v.x + spinSin * v.z, v.y, spinCos * v.z - spinSin * v.x);
+                };
+                for (int column = 0; column < 3; column++) {
+                    model[column] = glm::vec4(spin(linear[column]), 0.0f);
+                    normalMatrix[column] = spin(normalMatrix[column]);
+                }
+
+                float orbit = seconds * scene.orbitRate[i];
+                lightPos += 0.5f * glm::vec3(std::sin(orbit), std::cos(orbit) - 1.0f, 0.0f);
+            }
+
+            CubeInstance& cube = out[k];
+            cube.model = model;
+            cube.lightPos = lightPos;
+            cube.shininess = scene.shininess[i];
+            cube.normalMatrix = normalMatrix;
+        }
+    });
+}
+
+// Every cube of the scene at rest
+std::vector<CubeInstance> poseAtRest(const SceneData& scene, ThreadPool& pool) {
+    std::vector<CubeInstance> cubes(scene.size());
+    poseCubes(scene, nullptr, cubes.size(), false, 0.0f, cubes.data(), pool);
+    return cubes;
+}
+
+// Read-only view of a whole file, memory-mapped where possible and read
+// into memory otherwise
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    bool open(const std::string& path);
+    void close();
+
+    const uint8_t* data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    const uint8_t* bytes = nullptr;
+    size_t length = 0;
+    bool mapped = false;
+    std::vector<uint8_t> contents;
+};
+
+bool MappedFile::open(const std::string& path) {
+    close();
+#ifdef SHINE_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        void* address = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address != MAP_FAILED) {
+            // Scene arrays are read front to back, once
+            madvise(address, (size_t)info.st_size, MADV_SEQUENTIAL);
+            bytes = (const uint8_t*)address;
+            length = (size_t)info.st_size;
+            mapped = true;
+        }
+    }
+    ::close(fd);
+    if (mapped)
+        return true;
+#endif
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return false;
+    contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    bytes = contents.data();
+    length = contents.size();
+    return true;
+}
+
+void MappedFile::close() {
+#ifdef SHINE_MMAP
+    if (mapped)
+        munmap((void*)bytes, length);
+#endif
+    bytes = nullptr;
+    length = 0;
+    mapped = false;
+    contents.clear();
+}
+
+// Binary scene file: this header, then the SceneData::arrays() in order,
+// cubeCount floats each, then pointLightCount lights of four floats. Every
+// array starts on a 64-byte boundary and is copied out of the mapping as
+// is. Native byte order: files from the other byte order fail the version
+// check.
+struct SceneFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t arrayCount;
+    uint64_t cubeCount;
+    uint64_t pointLightCount;
+    float cubeLightRadius;
+    float clearColor[3];
+    float lightColor[3];
+    float objectColor[3];
+    float cameraTarget[3];
+    float cameraAngle;
+    float cameraDistance;
+    float cameraFov;
+    float cameraNear;
+    float cameraFar;
+    uint32_t cameraFixedEye;
+    float cameraEye[3];
+};
+
+const char SCENE_FILE_MAGIC[8] = {'S', 'H', 'I', 'N', 'E', 'S', 'C', 'N'};
+const uint32_t SCENE_FILE_VERSION = 1;
+
+// Offset of per-cube array index in a binary scene of cubeCount cubes; the
+// point lights follow at index SCENE_ARRAY_COUNT
+uint64_t sceneFileOffset(uint64_t cubeCount, int index) {
+    auto align = [](uint64_t offset) { return (offset + 63) & ~(uint64_t)63; };
+    return align(sizeof(SceneFileHeader)) + index * align(cubeCount * sizeof(float));
+}
+
+bool loadBinaryScene(const std::string& path, const MappedFile& file, SceneData& scene, ThreadPool& pool) {
+    SceneFileHeader header;
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (header.version != SCENE_FILE_VERSION || header.arrayCount != SCENE_ARRAY_COUNT) {
+        std::cerr << path << ": unsupported binary scene version" << std::endl;
+        return false;
+    }
+    if (header.cubeCount > UINT32_MAX || header.pointLightCount > UINT32_MAX ||
+        file.size() != sceneFileOffset(header.cubeCount, SCENE_ARRAY_COUNT) +
+                       header.pointLightCount * sizeof(glm::vec4)) {
+        std::cerr << path << ": binary scene is truncated or corrupt" << std::endl;
+        return false;
+    }
+
+    // No parsing: each array is one copy out of the mapping, in parallel so
+    // the page faults overlap
+    size_t count = (size_t)header.cubeCount;
+    auto arrays = scene.arrays();
+    pool.parallelFor(SCENE_ARRAY_COUNT, [&](int index) {
+        const float* source = (const float*)(file.data() + sceneFileOffset(count, index));
+        arrays[index]->assign(source, source + count);
+    });
+    const glm::vec4* lights = (const glm::vec4*)(file.data() + sceneFileOffset(count, SCENE_ARRAY_COUNT));
+    scene.pointLights.assign(lights, lights + header.pointLightCount);
+
+    auto vector = [](const float* value) { return glm::vec3(value[0], value[1], value[2]); };
+    scene.cubeLightRadius = header.cubeLightRadius;
+    scene.clearColor = vector(header.clearColor);
+    scene.lightColor = vector(header.lightColor);
+    scene.objectColor = vector(header.objectColor);
+    scene.camera.target = vector(header.cameraTarget);
+    scene.camera.angle = header.cameraAngle;
+    scene.camera.distance = header.cameraDistance;
+    scene.camera.fov = header.cameraFov;
+    scene.camera.nearPlane = header.cameraNear;
+    scene.camera.farPlane = header.cameraFar;
+    scene.camera.fixedEye = header.cameraFixedEye != 0;
+    scene.camera.eye = vector(header.cameraEye);
+    return true;
+}
+
+bool saveBinaryScene(const std::string& path, const SceneData& scene) {
+    SceneFileHeader header = {};
+    std::memcpy(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic));
+    header.version = SCENE_FILE_VERSION;
+    header.arrayCount = SCENE_ARRAY_COUNT;
+    header.cubeCount = scene.size();
+    header.pointLightCount = scene.pointLights.size();
+    header.cubeLightRadius = scene.cubeLightRadius;
+    for (int i = 0; i < 3; i++) {
+        header.clearColor[i] = scene.clearColor[i];
+        header.lightColor[i] = scene.lightColor[i];
+        header.objectColor[i] = scene.objectColor[i];
+        header.cameraTarget[i] = scene.camera.target[i];
+        header.cameraEye[i] = scene.camera.eye[i];
+    }
+    header.cameraAngle = scene.camera.angle;
+    header.cameraDistance = scene.camera.distance;
+    header.cameraFov = scene.camera.fov;
+    header.cameraNear = scene.camera.nearPlane;
+    header.cameraFar = scene.camera.farPlane;
+    header.cameraFixedEye = scene.camera.fixedEye;
+
+    std::ofstream file(path, std::ios::binary);
+    auto pad = [&](uint64_t offset) {
+        static const char zeros[64] = {};
+        file.write(zeros, (std::streamsize)(offset - (uint64_t)file.tellp()));
+    };
+    file.write((const char*)&header, sizeof(header));
+    auto arrays = scene.arrays();
+    for (int index = 0; index < SCENE_ARRAY_COUNT; index++) {
+        pad(sceneFileOffset(scene.size(), index));
+        file.write((const char*)arrays[index]->data(), (std::streamsize)(scene.size() * sizeof(float)));
+    }
+    pad(sceneFileOffset(scene.size(), SCENE_ARRAY_COUNT));
+    file.write((const char*)scene.pointLights.data(), (std::streamsize)(scene.pointLights.size() * sizeof(glm::vec4)));
+    if (!file) {
+        std::cerr << "Failed to write " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Text scene file, for authoring. One statement per line, # starts a
+// comment:
+//   shine-scene 1                    required first statement
+//   clear-color R G B
+//   light-color R G B
+//   object-color R G B
+//   camera X Y Z ANGLE DISTANCE      orbit target, start angle, distance
+//   projection FOV NEAR FAR
+//   eye X Y Z                        light highlights for this eye instead
+//   cube-light-radius R              forward+ radius of the cubes' lights
+//   material NAME SHININESS
+//   cube X Y Z  AXISX AXISY AXISZ ANGLE  SCALEX SCALEY SCALEZ  MATERIAL
+//        LIGHTX LIGHTY LIGHTZ  [SPIN ORBIT]
+//   point-light X Y Z RADIUS
+// Angles are in degrees, SPIN in degrees and ORBIT in radians per second.
+// Materials are declared before the cubes using them. Settings left out
+// keep the defaults of the original program.
+bool loadTextScene(const std::string& path, const MappedFile& file, SceneData& scene) {
+    const char* text = (const char*)file.data();
+    const char* end = text + file.size();
+    std::map<std::string, float, std::less<>> materials;
+    std::vector<std::string_view> tokens;
+    std::vector<float> values;
+    bool versioned = false;
+    int lineNumber = 0;
+
+    auto fail = [&](const std::string& message) {
+        std::cerr << path << ":" << lineNumber << ": " << message << std::endl;
+        return false;
+    };
+    // Parse tokens[first, first + count) as finite floats into values
+    auto numbers = [&](size_t first, size_t count) {
+        values.clear();
+        for (size_t i = first; i < first + count; i++) {
+            // strtof needs a terminated string; no token is longer than a line
+            char number[64];
+            if (tokens[i].size() >= sizeof(number))
+                return false;
+            std::memcpy(number, tokens[i].data(), tokens[i].size());
+            number[tokens[i].size()] = '\0';
+            char* numberEnd;
+            float value = std::strtof(number, &numberEnd);
+            if (numberEnd != number + tokens[i].size() || !std::isfinite(value))
+                return false;
+            values.push_back(value);
+        }
+        return true;
+    };
+
+    for (const char* line = text; line < end;) {
+        const char* lineEnd = (const char*)std::memchr(line, '\n', end - line);
+        if (!lineEnd)
+            lineEnd = end;
+        lineNumber++;
+
+        tokens.clear();
+        for (const char* c = line; c < lineEnd && *c != '#';) {
+            if (std::isspace((unsigned char)*c)) {
+                c++;
+                continue;
+            }
+            const char* start = c;
+            while (c < lineEnd && *c != '#' && !std::isspace((unsigned char)*c))
+                c++;
+            tokens.emplace_back(start, c - start);
+        }
+        line = lineEnd + 1;
+        if (tokens.empty())
+            continue;
+
+        std::string_view keyword = tokens[0];
+        size_t arguments = tokens.size() - 1;
+        if (!versioned) {
+            if (keyword != "shine-scene" || arguments != 1 || tokens[1] != "1")
+                return fail("not a shine scene, expected 'shine-scene 1'");
+            versioned = true;
+        } else if (keyword == "cube") {
+            if (arguments != 14 && arguments != 16)
+                return fail("cube takes 14 or 16 values");
+            auto material = materials.find(tokens[11]);
+            if (material == materials.end())
+                return fail("unknown material '" + std::string(tokens[11]) + "'");
+            if (!numbers(1, 10))
+                return fail("invalid cube transform");
+            float position[3] = {values[0], values[1], values[2]};
+            float axis[3] = {values[3], values[4], values[5]};
+            float angle = values[6];
+            float scale[3] = {values[7], values[8], values[9]};
+            if (!numbers(12, arguments - 11))
+                return fail("invalid cube light or animation");
+            if (axis[0] == 0.0f && axis[1] == 0.0f && axis[2] == 0.0f)
+                return fail("cube rotation axis is zero");
+            if (scale[0] == 0.0f || scale[1] == 0.0f || scale[2] == 0.0f)
+                return fail("cube scale is zero");
+            float cube[SCENE_ARRAY_COUNT] = {position[0], position[1], position[2], axis[0], axis[1], axis[2],
+                                             angle, scale[0], scale[1], scale[2], material->second,
+                                             values[0], values[1], values[2],
+                                             values.size() > 3 ? values[3] : 0.0f,
+                                             values.size() > 3 ? values[4] : 0.0f};
+            auto arrays = scene.arrays();
+            for (int index = 0; index < SCENE_ARRAY_COUNT; index++)
+                arrays[index]->push_back(cube[index]);
+        } else if (keyword == "material") {
+            if (arguments != 2 || !numbers(2, 1) || values[0] <= 0.0f)
+                return fail("material takes a name and a positive shininess");
+            materials[std::string(tokens[1])] = values[0];
+        } else if (keyword == "point-light") {
+            if (arguments != 4 || !numbers(1, 4) || values[3] <= 0.0f)
+                return fail("point-light takes a position and a positive radius");
+            scene.pointLights.push_back(glm::vec4(values[0], values[1], values[2], values[3]));
+        } else if (keyword == "clear-color" || keyword == "light-color" || keyword == "object-color" ||
+                   keyword == "eye") {
+            if (arguments != 3 || !numbers(1, 3))
+                return fail(std::string(keyword) + " takes three values");
+            glm::vec3 value(values[0], values[1], values[2]);
+            if (keyword == "clear-color") {
+                scene.clearColor = value;
+            } else if (keyword == "light-color") {
+                scene.lightColor = value;
+            } else if (keyword == "object-color") {
+                scene.objectColor = value;
+            } else {
+                scene.camera.fixedEye = true;
+                scene.camera.eye = value;
+            }
+        } else if (keyword == "camera") {
+            if (arguments != 5 || !numbers(1, 5) || values[4] <= 0.0f)
+                return fail("camera takes a target, an angle and a positive distance");
+            scene.camera.target = glm::vec3(values[0], values[1], values[2]);
+            scene.camera.angle = values[3];
+            scene.camera.distance = values[4];
+        } else if (keyword == "projection") {
+            if (arguments != 3 || !numbers(1, 3) || values[0] <= 0.0f || values[0] >= 180.0f ||
+                values[1] <= 0.0f || values[2] <= values[1])
+                return fail("projection takes a field of view and near and far planes");
+            scene.camera.fov = values[0];
+            scene.camera.nearPlane = values[1];
+            scene.camera.farPlane = values[2];
+        } else if (keyword == "cube-light-radius") {
+            if (arguments != 1 || !numbers(1, 1) || values[0] <= 0.0f)
+                return fail("cube-light-radius takes a positive radius");
+            scene.cubeLightRadius = values[0];
+        } else {
+            return fail("unknown statement '" + std::string(keyword) + "'");
+        }
+    }
+    if (!versioned)
+        return fail("not a shine scene, expected 'shine-scene 1'");
+    return true;
+}
+
+// Shortest decimal form that reads back as exactly value
+std::string formatFloat(float value) {
+    char text[32];
+    for (int precision = 6; precision < 9; precision++) {
+        std::snprintf(text, sizeof(text), "%.*g", precision, value);
+        if (std::strtof(text, nullptr) == value)
+            return text;
+    }
+    std::snprintf(text, sizeof(text), "%.9g", value);
+    return text;
+}
+
+bool saveTextScene(const std::string& path, const SceneData& scene, ThreadPool& pool) {
+    std::ofstream file(path);
+    auto vector = [](const glm::vec3& value) {
+        return formatFloat(value.x) + " " + formatFloat(value.y) + " " + formatFloat(value.z);
+    };
+    file << "shine-scene 1\n"
+         << "clear-color " << vector(scene.clearColor) << "\n"
+         << "light-color " << vector(scene.lightColor) << "\n"
+         << "object-color " << vector(scene.objectColor) << "\n"
+         << "camera " << vector(scene.camera.target) << " " << formatFloat(scene.camera.angle) << " "
+         << formatFloat(scene.camera.distance) << "\n"
+         << "projection " << formatFloat(scene.camera.fov) << " " << formatFloat(scene.camera.nearPlane) << " "
+         << formatFloat(scene.camera.farPlane) << "\n";
+    if (scene.camera.fixedEye)
+        file << "eye " << vector(scene.camera.eye) << "\n";
+    if (scene.cubeLightRadius > 0.0f)
+        file << "cube-light-radius " << formatFloat(scene.cubeLightRadius) << "\n";
+
+    // One material per distinct shininess, named after it
+    std::vector<float> shininess = scene.shininess;
+    std::sort(shininess.begin(), shininess.end());
+    shininess.erase(std::unique(shininess.begin(), shininess.end()), shininess.end());
+    for (float value : shininess)
+        file << "material s" << formatFloat(value) << " " << formatFloat(value) << "\n";
+
+    // Cube lines are formatted in parallel, a chunk of cubes per job
+    auto arrays = scene.arrays();
+    std::vector<std::string> chunks((scene.size() + SCENE_JOB_GRAIN - 1) / SCENE_JOB_GRAIN);
+    pool.parallelFor((int)chunks.size(), [&](int chunk) {
+        std::string& text = chunks[chunk];
+        for (size_t i = chunk * SCENE_JOB_GRAIN; i < std::min(scene.size(), (chunk + 1) * SCENE_JOB_GRAIN); i++) {
+            text += "cube";
+            for (int index = 0; index < SCENE_ARRAY_COUNT; index++) {
+                const std::vector<float>& array = *arrays[index];
+                if (&array == &scene.shininess)
+                    text += " s";
+                else if ((&array == &scene.spinRate || &array == &scene.orbitRate) &&
+                         scene.spinRate[i] == 0.0f && scene.orbitRate[i] == 0.0f)
+                    continue;
+                else
+                    text += " ";
+                text += formatFloat(array[i]);
+            }
+            text += "\n";
+        }
+    });
+    for (const std::string& text : chunks)
+        file << text;
+    for (const glm::vec4& light : scene.pointLights)
+        file << "point-light " << vector(glm::vec3(light)) << " " << formatFloat(light.w) << "\n";
+    if (!file) {
+        std::cerr << "Failed to write " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Load a text or binary scene file, told apart by the binary magic
+bool loadScene(const std::string& path, SceneData& scene, ThreadPool& pool) {
+    MappedFile file;
+    if (!file.open(path)) {
+        std::cerr << "Failed to open scene " << path << std::endl;
+        return false;
+    }
+    scene = SceneData();
+    bool binary = file.size() >= sizeof(SceneFileHeader) &&
+                  std::memcmp(file.data(), SCENE_FILE_MAGIC, sizeof(SCENE_FILE_MAGIC)) == 0;
+    if (!(binary ? loadBinaryScene(path, file, scene, pool) : loadTextScene(path, file, scene)))
+        return false;
+    if (scene.size() == 0 || scene.size() > UINT32_MAX) {
+        std::cerr << path << ": a scene needs between 1 and 2^32 - 1 cubes" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Binary for .bin paths, text otherwise
+bool saveScene(const std::string& path, const SceneData& scene, ThreadPool& pool) {
+    bool binary = path.size() >= 4 && path.compare(path.size() - 4, 4, ".bin") == 0;
+    return binary ? saveBinaryScene(path, scene) : saveTextScene(path, scene, pool);
+}
+
+// The scene options.sceneFile describes, or else the generated grid
+bool createScene(const Options& options, SceneData& scene, ThreadPool& pool) {
+    if (!options.sceneFile.empty())
+        return loadScene(options.sceneFile, scene, pool);
+    scene = buildScene(options, pool);
+    return true;
+}
+
+// Point lights for the forward+ path, xyz position and w radius: the
+// scene's lights, or every cube's own light at rest when it has none.
+// options.lightRadius, when set, replaces every radius.
+std::vector<glm::vec4> buildPointLights(const Options& options, const SceneData& scene) {
+    std::vector<glm::vec4> lights = scene.pointLights;
+    if (lights.empty()) {
+        for (size_t i = 0; i < scene.size(); i++)
+            lights.push_back(glm::vec4(scene.lightX[i], scene.lightY[i], scene.lightZ[i], scene.cubeLightRadius));
+    }
+    if (options.lightRadius > 0.0f) {
+        for (glm::vec4& light : lights)
+            light.w = options.lightRadius;
+    }
+    return lights;
+}
+
+// Bounding volume hierarchy over the cubes, for frustum culling. Nodes are
+// stored in depth-first order with the index of the node after their
+// subtree, so traversal is a single forward walk over the arrays, and node
+// bounds are kept per axis (SoA) so the plane tests read only packed
+// floats. build() reorders the cubes so every node covers a contiguous
+// range of them.
+class CubeBVH {
+public:
+    // Range of cubes [first, first + count)
+    struct Range {
+        uint32_t first;
+        uint32_t count;
+    };
+
+    // spinning bounds each cube by every orientation about its centre.
+    // cubeOrder, if given, receives each reordered cube's original index.
+    void build(std::vector<CubeInstance>& cubes, bool spinning = false, std::vector<uint32_t>* cubeOrder = nullptr);
+
+    // Ranges of cubes whose bounds intersect the frustum of viewProjection,
+    // in cube order with neighbouring ranges merged
+    void cull(const glm::mat4& viewProjection, std::vector<Range>& visible) const;
+
+private:
+    uint32_t buildNode(std::vector<uint32_t>& order, const std::vector<glm::vec3>& centers,
+                       const std::vector<glm::vec3>& extents, uint32_t begin, uint32_t end);
+
+    // Node bounds
+    std::vector<float> minX, minY, minZ;
+    std::vector<float> maxX, maxY, maxZ;
+    // Cube bounds, in the reordered cube order, for partly visible leaves
+    std::vector<float> cubeMinX, cubeMinY, cubeMinZ;
+    std::vector<float> cubeMaxX, cubeMaxY, cubeMaxZ;
+    std::vector<uint32_t> first;
+    std::vector<uint32_t> count;
+    std::vector<uint32_t> next; // Node after this one's subtree
+    std::vector<uint8_t> leaf;
+};
+
+// Leaves hold at most this many cubes
+const uint32_t BVH_LEAF_SIZE = 16;
+
+void CubeBVH::build(std::vector<CubeInstance>& cubes, bool spinning, std::vector<uint32_t>* cubeOrder) {
+    for (std::vector<float>* array : {&minX, &minY, &minZ, &maxX, &maxY, &maxZ,
+                                      &cubeMinX, &cubeMinY, &cubeMinZ, &cubeMaxX, &cubeMaxY, &cubeMaxZ})
+        array->clear();
+    first.clear();
+    count.clear();
+    next.clear();
+    leaf.clear();
+    if (cubes.empty())
+        return;
+
+    // World-space box of each unit cube: the centre is the translation and
+    // the half extent along each axis is half the absolute row sum
+    std::vector<glm::vec3> centers(cubes.size()), extents(cubes.size());
+    for (size_t i = 0; i < cubes.size(); i++) {
+        const glm::mat4& model = cubes[i].model;
+        centers[i] = glm::vec3(model[3]);
+        extents[i] = 0.5f * (glm::abs(glm::vec3(model[0])) + glm::abs(glm::vec3(model[1])) +
+                             glm::abs(glm::vec3(model[2])));
+        // No corner is further from the centre than half the column lengths summed
+        if (spinning)
+            extents[i] = glm::vec3(0.5f * (glm::length(glm::vec3(model[0])) + glm::length(glm::vec3(model[1])) +
+                                           glm::length(glm::vec3(model[2]))));
+    }
+
+    std::vector<uint32_t> order(cubes.size());
+    for (uint32_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    buildNode(order, centers, extents, 0, (uint32_t)order.size());
+
+    std::vector<CubeInstance> sorted;
+    sorted.reserve(cubes.size());
+    for (uint32_t index : order) {
+        sorted.push_back(cubes[index]);
+        glm::vec3 boxMin = centers[index] - extents[index], boxMax = centers[index] + extents[index];
+        cubeMinX.push_back(boxMin.x);
+        cubeMinY.push_back(boxMin.y);
+        cubeMinZ.push_back(boxMin.z);
+        cubeMaxX.push_back(boxMax.x);
+        cubeMaxY.push_back(boxMax.y);
+        cubeMaxZ.push_back(boxMax.z);
+    }
+    cubes.swap(sorted);
+    if (cubeOrder)
+        cubeOrder->swap(order);
+}
+
+// Median split along the longest axis of the centres' bounds
+uint32_t CubeBVH::buildNode(std::vector<uint32_t>& order, const std::vector<glm::vec3>& centers,
+                            const std::vector<glm::vec3>& extents, uint32_t begin, uint32_t end) {
+    glm::vec3 boundsMin(1e30f), boundsMax(-1e30f), centerMin(1e30f), centerMax(-1e30f);
+    for (uint32_t i = begin; i < end; i++) {
+        const glm::vec3& center = centers[order[i]];
+        boundsMin = glm::min(boundsMin, center - extents[order[i]]);
+        boundsMax = glm::max(boundsMax, center + extents[order[i]]);
+        centerMin = glm::min(centerMin, center);
+        centerMax = glm::max(centerMax, center);
+    }
+
+    uint32_t node = (uint32_t)first.size();
+    minX.push_back(boundsMin.x);
+    minY.push_back(boundsMin.y);
+    minZ.push_back(boundsMin.z);
+    maxX.push_back(boundsMax.x);
+    maxY.push_back(boundsMax.y);
+    maxZ.push_back(boundsMax.z);
+    first.push_back(begin);
+    count.push_back(end - begin);
+    next.push_back(0);
+    leaf.push_back(end - begin <= BVH_LEAF_SIZE);
+
+    if (!leaf[node]) {
+        glm::vec3 size = centerMax - centerMin;
+        int axis = size.x >= size.y && size.x >= size.z ? 0 : size.y >= size.z ? 1 : 2;
+        uint32_t middle = begin + (end - begin) / 2;
+        std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end,
+                         [&](uint32_t a, uint32_t b) { return centers[a][axis] < centers[b][axis]; });
+        buildNode(order, centers, extents, begin, middle);
+        buildNode(order, centers, extents, middle, end);
+    }
+    next[node] = (uint32_t)first.size();
+    return node;
+}
+
+void CubeBVH::cull(const glm::mat4& viewProjection, std::vector<Range>& visible) const {
+    visible.clear();
+
+    // Frustum planes from the rows of the matrix, normals pointing inwards
+    glm::vec4 planes[6];
+    for (int i = 0; i < 3; i++) {
+        glm::vec4 row(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+        glm::vec4 w(viewProjection[0][3], viewProjection[1][3], viewProjection[2][3], viewProjection[3][3]);
+        planes[i * 2] = w + row;
+        planes[i * 2 + 1] = w - row;
+    }
+
+    auto emit = [&](uint32_t begin, uint32_t size) {
+        if (!visible.empty() && visible.back().first + visible.back().count == begin)
+            visible.back().count += size;
+        else
+            visible.push_back(Range{begin, size});
+    };
+
+    // Classify a box against the planes: -1 outside, 1 inside, 0 crossing.
+    // The corner furthest along a plane's normal decides whether the box is
+    // outside it, the nearest one whether it is inside.
+    auto classify = [&](float x0, float y0, float z0, float x1, float y1, float z1) {
+        int result = 1;
+        for (const glm::vec4& plane : planes) {
+            float farthest = plane.w + plane.x * (plane.x > 0.0f ? x1 : x0) + plane.y * (plane.y > 0.0f ? y1 : y0) +
+                             plane.z * (plane.z > 0.0f ? z1 : z0);
+            if (farthest < 0.0f)
+                return -1;
+            float nearest = plane.w + plane.x * (plane.x > 0.0f ? x0 : x1) + plane.y * (plane.y > 0.0f ? y0 : y1) +
+                            plane.z * (plane.z > 0.0f ? z0 : z1);
+            if (nearest < 0.0f)
+                result = 0;
+        }
+        return result;
+    };
+
+    uint32_t node = 0;
+    while (node < first.size()) {
+        int side = classify(minX[node], minY[node], minZ[node], maxX[node], maxY[node], maxZ[node]);
+        if (side < 0) {
+            node = next[node];
+        } else if (side > 0) {
+            // Whole subtree visible
+            emit(first[node], count[node]);
+            node = next[node];
+        } else if (leaf[node]) {
+            for (uint32_t i = first[node]; i < first[node] + count[node]; i++) {
+                if (classify(cubeMinX[i], cubeMinY[i], cubeMinZ[i], cubeMaxX[i], cubeMaxY[i], cubeMaxZ[i]) >= 0)
+                    emit(i, 1);
+            }
+            node = next[node];
+        } else {
+            node++;
+        }
+    }
+}
+
+// Camera orbiting target in the horizontal plane, angle in degrees
+glm::vec3 computeCameraPos(const SceneCamera& camera, float angle, float zoom = 1.0f) {
+    float radius = camera.distance / zoom;
+    float radians = glm::radians(angle);
+    return camera.target + glm::vec3(radius * sin(radians), 0.0f, radius * cos(radians));
+}
+
+glm::mat4 computeView(const SceneCamera& camera, const glm::vec3& cameraPos) {
+    return glm::lookAt(cameraPos, camera.target,
+                       glm::vec3(0.0f, 1.0f, 0.0f)); // Up vector
+}
+
+glm::mat4 computeProjection(const SceneCamera& camera, int width, int height) {
+    return glm::perspective(glm::radians(camera.fov), (float)width / (float)height, camera.nearPlane, camera.farPlane);
+}
+
+// OpenGL 3.3 core context without a window, for render boxes with no display
+class HeadlessContext {
+public:
+    bool create();
+    void destroy();
+
+private:
+#ifdef SHINE_EGL
+    EGLDisplay display = EGL_NO_DISPLAY;
+    EGLContext context = EGL_NO_CONTEXT;
+    EGLSurface surface = EGL_NO_SURFACE;
+#else
+    GLFWwindow* window = nullptr;
+#endif
+};
+
+#ifdef SHINE_EGL
+bool HeadlessContext::create() {
+    // Prefer Mesa's surfaceless platform, which needs no display server or
+    // GPU and runs on llvmpipe; fall back to the default display
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay)
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr)) {
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+        if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr)) {
+            std::cerr << "Failed to initialize EGL" << std::endl;
+            return false;
+        }
+    }
+    if (!eglBindAPI(EGL_OPENGL_API)) {
+        std::cerr << "EGL does not support desktop OpenGL" << std::endl;
+        eglTerminate(display);
+        return false;
+    }
+
+    const char* extensions = eglQueryString(display, EGL_EXTENSIONS);
+    bool surfaceless = extensions && std::strstr(extensions, "EGL_KHR_surfaceless_context");
+
+    const EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    EGLConfig config = nullptr;
+    EGLint configCount = 0;
+    eglChooseConfig(display, configAttribs, &config, 1, &configCount);
+    if (configCount == 0 && !(surfaceless && std::strstr(extensions, "EGL_KHR_no_config_context"))) {
+        std::cerr << "Failed to find an EGL config" << std::endl;
+        eglTerminate(display);
+        return false;
+    }
+
+    const EGLint contextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    context = eglCreateContext(display, configCount ? config : (EGLConfig)nullptr,
+                               EGL_NO_CONTEXT, contextAttribs);
+    if (context == EGL_NO_CONTEXT) {
+        std::cerr << "Failed to create EGL context" << std::endl;
+        eglTerminate(display);
+        return false;
+    }
+
+    // Everything is drawn into a framebuffer object, so the context only
+    // needs a surface when surfaceless contexts are not supported
+    if (!surfaceless) {
+        const EGLint pbufferAttribs[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+        surface = eglCreatePbufferSurface(display, config, pbufferAttribs);
+    }
+    if (!eglMakeCurrent(display, surface, surface, context)) {
+        std::cerr << "Failed to make EGL context current" << std::endl;
+        destroy();
+        return false;
+    }
+    return true;
+}
+
+void HeadlessContext::destroy() {
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (surface != EGL_NO_SURFACE)
+        eglDestroySurface(display, surface);
+    if (context != EGL_NO_CONTEXT)
+        eglDestroyContext(display, context);
+    eglTerminate(display);
+    display = EGL_NO_DISPLAY;
+    context = EGL_NO_CONTEXT;
+    surface = EGL_NO_SURFACE;
+}
+#else
+bool HeadlessContext::create() {
+    if (!glfwInit()) {
+        std::cerr << "Failed to initialize GLFW" << std::endl;
+        return false;
+    }
+
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+#ifdef __APPLE__
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+#endif
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
+    window = glfwCreateWindow(1, 1, "Specular Lighting Demo", NULL, NULL);
+    if (!window) {
+        std::cerr << "Failed to create hidden GLFW window" << std::endl;
+        glfwTerminate();
+        return false;
+    }
+    glfwMakeContextCurrent(window);
+    return true;
+}
+
+void HeadlessContext::destroy() {
+    glfwTerminate();
+    window = nullptr;
+}
+#endif
+
+// Offscreen color + depth render target
+class Framebuffer {
+public:
+    bool create(int width, int height);
+    void bind() const;
+    void destroy();
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+
+    // Copy the color buffer into the default framebuffer
+    void blitToScreen() const;
+    // Stretch the bottom-left width x height pixels over all of target,
+    // filtered
+    void upscaleTo(const Framebuffer& target, int width, int height) const;
+
+    // Make the color buffer the source of glReadPixels
+    void bindRead() const;
+    // Read back the color buffer as tightly packed RGB rows, top row first
+    std::vector<uint8_t> readPixels() const;
+
+private:
+    unsigned int fbo = 0;
+    unsigned int colorBuffer = 0;
+    unsigned int depthBuffer = 0;
+    int width = 0;
+    int height = 0;
+};
+
+bool Framebuffer::create(int targetWidth, int targetHeight) {
+    width = targetWidth;
+    height = targetHeight;
+
+    glGenRenderbuffers(1, &colorBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+    glGenRenderbuffers(1, &depthBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cerr << "ERROR::FRAMEBUFFER::INCOMPLETE" << std::endl;
+        destroy();
+        return false;
+    }
+    return true;
+}
+
+void Framebuffer::bind() const {
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+}
+
+void Framebuffer::bindRead() const {
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+}
+
+void Framebuffer::blitToScreen() const {
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+}
+
+void Framebuffer::upscaleTo(const Framebuffer& target, int sourceWidth, int sourceHeight) const {
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target.fbo);
+    glBlitFramebuffer(0, 0, sourceWidth, sourceHeight, 0, 0, target.width, target.height, GL_COLOR_BUFFER_BIT,
+                      GL_LINEAR);
+}
+
+void Framebuffer::destroy() {
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteRenderbuffers(1, &colorBuffer);
+    glDeleteRenderbuffers(1, &depthBuffer);
+    fbo = colorBuffer = depthBuffer = 0;
+}
+
+std::vector<uint8_t> Framebuffer::readPixels() const {
+    std::vector<uint8_t> pixels((size_t)width * height * 3);
+    bindRead();
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+
+    // GL returns the bottom row first
+    size_t stride = (size_t)width * 3;
+    for (int y = 0; y < height / 2; y++)
+        std::swap_ranges(pixels.begin() + y * stride, pixels.begin() + (y + 1) * stride,
+                         pixels.begin() + (height - 1 - y) * stride);
+    return pixels;
+}
+
+// Deferred shading G-buffer: octahedral normal (RG16), shininess (R16F)
+// and linear view depth (R32F), from which the lighting pass rebuilds the
+// position, plus a depth buffer for the geometry pass's depth test. The
+// object color is the same for every cube and stays a uniform.
+class GBuffer {
+public:
+    bool create(int width, int height);
+    // Bind as the draw target of the geometry pass
+    void bind() const;
+    // Start a geometry pass: clear the depth buffer and the view depth,
+    // which stays 0 where no cube is drawn
+    void clear() const;
+    // Normal on texture unit 3, shininess on unit 4, view depth on unit 5
+    void bindTextures() const;
+    void destroy();
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    size_t getBytes() const { return (size_t)width * height * BYTES_PER_PIXEL; }
+
+    static const int BYTES_PER_PIXEL = 4 + 2 + 4 + 4;
+
+private:
+    unsigned int fbo = 0;
+    unsigned int normalTexture = 0;
+    unsigned int shininessTexture = 0;
+    unsigned int depthTexture = 0;
+    unsigned int depthBuffer = 0;
+    int width = 0;
+    int height = 0;
+};
+
+bool GBuffer::create(int targetWidth, int targetHeight) {
+    width = targetWidth;
+    height = targetHeight;
+
+    // Read with texelFetch only, so no filtering or mipmaps
+    auto createTexture = [&](unsigned int& texture, GLenum internalFormat, GLenum format, GLenum type) {
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    };
+    createTexture(normalTexture, GL_RG16, GL_RG, GL_UNSIGNED_SHORT);
+    createTexture(shininessTexture, GL_R16F, GL_RED, GL_HALF_FLOAT);
+    createTexture(depthTexture, GL_R32F, GL_RED, GL_FLOAT);
+
+    glGenRenderbuffers(1, &depthBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, normalTexture, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, shininessTexture, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, depthTexture, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+    const GLenum drawBuffers[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2};
+    glDrawBuffers(3, drawBuffers);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cerr << "ERROR::GBUFFER::INCOMPLETE" << std::endl;
+        destroy();
+        return false;
+    }
+    return true;
+}
+
+void GBuffer::bind() const {
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+}
+
+void GBuffer::clear() const {
+    const float zero[4] = {};
+    glClearBufferfv(GL_COLOR, 2, zero);
+    glClear(GL_DEPTH_BUFFER_BIT);
+}
+
+void GBuffer::bindTextures() const {
+    glActiveTexture(GL_TEXTURE3);
+    glBindTexture(GL_TEXTURE_2D, normalTexture);
+    glActiveTexture(GL_TEXTURE4);
+    glBindTexture(GL_TEXTURE_2D, shininessTexture);
+    glActiveTexture(GL_TEXTURE5);
+    glBindTexture(GL_TEXTURE_2D, depthTexture);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+void GBuffer::destroy() {
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteTextures(1, &normalTexture);
+    glDeleteTextures(1, &shininessTexture);
+    glDeleteTextures(1, &depthTexture);
+    glDeleteRenderbuffers(1, &depthBuffer);
+    fbo = normalTexture = shininessTexture = depthTexture = depthBuffer = 0;
+    width = height = 0;
+}
+
+// Largest lightmap face, in texels a side, and the largest atlas side.
+// Faces smaller than LIGHTMAP_OVERSAMPLE_BELOW pixels get twice as many
+// texels as pixels across: filtering flattens highlights narrower than a
+// texel, and on small faces those are a large share of the pixels.
+const int LIGHTMAP_MAX_FACE_SIZE = 256;
+const float LIGHTMAP_OVERSAMPLE_BELOW = 32.0f;
+const int LIGHTMAP_MAX_ATLAS_SIZE = 8192;
+
+// Shelf-pack one tile of 3x2 faces per cube into a lightmap atlas at most
+// maxSize texels a side. faceSizes are powers of two; while the tiles do
+// not fit they are all halved, down to one texel. Returns every cube's
+// (x, y, face size), or nothing if even one-texel faces do not fit.
+std::vector<glm::vec3> packLightmapTiles(std::vector<int> faceSizes, int maxSize, int& width, int& height) {
+    std::vector<uint32_t> order(faceSizes.size());
+    for (uint32_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(),
+                     [&](uint32_t a, uint32_t b) { return faceSizes[a] > faceSizes[b]; });
+
+    std::vector<glm::vec3> tiles(faceSizes.size());
+    for (;;) {
+        // Square-ish atlas, a power of two wide
+        double area = 0.0;
+        for (int size : faceSizes)
+            area += 6.0 * size * size;
+        int largest = order.empty() ? 1 : faceSizes[order[0]];
+        width = 1;
+        while (width < 3 * largest || (double)width * width < area)
+            width *= 2;
+        width = std::min(width, maxSize);
+
+        // Sizes only shrink along the order, so each shelf is as tall as its first tile
+        int x = 0, y = 0, shelfHeight = 0;
+        for (uint32_t i : order) {
+            int size = faceSizes[i];
+            if (x + 3 * size > width) {
+                x = 0;
+                y += shelfHeight;
+                shelfHeight = 0;
+            }
+            shelfHeight = std::max(shelfHeight, 2 * size);
+            tiles[i] = glm::vec3((float)x, (float)y, (float)size);
+            x += 3 * size;
+        }
+        height = std::max(y + shelfHeight, 1);
+        if (height <= maxSize)
+            return tiles;
+        if (largest == 1)
+            return {};
+        for (int& size : faceSizes)
+            size = std::max(size / 2, 1);
+    }
+}
+
+// RGBA8 lightmap atlas of baked cube faces, rendered into by the bake pass
+// and sampled with bilinear filtering
+class LightmapAtlas {
+public:
+    bool create(int width, int height);
+    // Bind as the draw target of the bake pass
+    void bind() const;
+    void bindTexture(int unit) const;
+    void destroy();
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    size_t getBytes() const { return (size_t)width * height * 4; }
+
+private:
+    unsigned int fbo = 0;
+    unsigned int texture = 0;
+    int width = 0;
+    int height = 0;
+};
+
+bool LightmapAtlas::create(int atlasWidth, int atlasHeight) {
+    width = atlasWidth;
+    height = atlasHeight;
+
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cerr << "ERROR::LIGHTMAP::INCOMPLETE" << std::endl;
+        destroy();
+        return false;
+    }
+    return true;
+}
+
+void LightmapAtlas::bind() const {
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+}
+
+void LightmapAtlas::bindTexture(int unit) const {
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+void LightmapAtlas::destroy() {
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteTextures(1, &texture);
+    fbo = texture = 0;
+    width = height = 0;
+}
+
+// Widest base of the hi-Z pyramid, in texels
+const int HIZ_MAX_BASE_WIDTH = 256;
+
+// Hierarchical depth of a rendered frame, for occlusion culling in the
+// frames after it. The depth buffer is copied into a texture and reduced on
+// the GPU into the pyramid's base, each texel the farthest depth of a
+// square block of pixels. The base is read back without waiting for the
+// GPU, and the coarser levels, each texel the farthest of the 2x2 below
+// it, are built on the CPU. A sphere whose nearest point is behind every
+// texel its screen rectangle touches was hidden in that frame.
+class HiZPyramid {
+public:
+    void create();
+    // Reduce the depth buffer of the bound framebuffer, width x height
+    // pixels drawn with projection, and start reading it back; version
+    // names the view. Does nothing while a readback is in flight.
+    void build(int width, int height, const glm::mat4& projection, uint64_t version);
+    // Take a finished readback without waiting. True if it replaced the pyramid.
+    bool update();
+    // True if a sphere, in view space, is hidden behind the pyramid's depth
+    bool isOccluded(const glm::vec3& center, float radius) const;
+    void destroy();
+
+    bool isPending() const { return fence != nullptr; }
+    bool isReady() const { return !levels.empty(); }
+    uint64_t getVersion() const { return version; }
+    int getBaseWidth() const { return levels.empty() ? 0 : levels[0].width; }
+    int getBaseHeight() const { return levels.empty() ? 0 : levels[0].height; }
+
+private:
+    struct Level {
+        int width;
+        int height;
+        std::vector<float> depth; // Window-space, rows bottom first
+    };
+
+    ShaderProgram reduceProgram;
+    int depthBufferUniform = -1;
+    int blockSizeUniform = -1;
+    int viewportSizeUniform = -1;
+    unsigned int vao = 0;
+    unsigned int depthTexture = 0;
+    unsigned int depthFbo = 0;
+    unsigned int baseTexture = 0;
+    unsigned int baseFbo = 0;
+    unsigned int pbo = 0;
+    int textureWidth = 0;
+    int textureHeight = 0;
+
+    // The readback in flight
+    GLsync fence = nullptr;
+    int pendingWidth = 0;
+    int pendingHeight = 0;
+    int pendingBlockSize = 1;
+    glm::mat4 pendingProjection = glm::mat4(1.0f);
+    uint64_t pendingVersion = 0;
+
+    // The pyramid, finest level first
+    std::vector<Level> levels;
+    int width = 0;
+    int height = 0;
+    int blockSize = 1;
+    glm::mat4 projection = glm::mat4(1.0f);
+    uint64_t version = 0;
+};
+
+void HiZPyramid::create() {
+    reduceProgram = ShaderProgram(fullscreenVertexShaderSource, hiZReduceFragmentShaderSource);
+    depthBufferUniform = reduceProgram.uniform("depthBuffer");
+    blockSizeUniform = reduceProgram.uniform("blockSize");
+    viewportSizeUniform = reduceProgram.uniform("viewportSize");
+    glGenVertexArrays(1, &vao);
+    glGenBuffers(1, &pbo);
+}
+
+void HiZPyramid::build(int viewportWidth, int viewportHeight, const glm::mat4& frameProjection, uint64_t viewVersion) {
+    if (fence)
+        return;
+    int target;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target);
+
+    // Grown to the largest viewport so far, like the G-buffer
+    if (viewportWidth > textureWidth || viewportHeight > textureHeight) {
+        textureWidth = std::max(viewportWidth, textureWidth);
+        textureHeight = std::max(viewportHeight, textureHeight);
+        glDeleteFramebuffers(1, &depthFbo);
+        glDeleteFramebuffers(1, &baseFbo);
+        glDeleteTextures(1, &depthTexture);
+        glDeleteTextures(1, &baseTexture);
+
+        auto createTexture = [](unsigned int& texture, GLenum internalFormat, GLenum format, GLenum type, int w,
+                                int h) {
+            glGenTextures(1, &texture);
+            glBindTexture(GL_TEXTURE_2D, texture);
+            glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, w, h, 0, format, type, nullptr);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        };
+        // Same format as the framebuffers' depth buffers, which blitting needs
+        createTexture(depthTexture, GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, textureWidth,
+                      textureHeight);
+        createTexture(baseTexture, GL_R32F, GL_RED, GL_FLOAT, textureWidth, textureHeight);
+
+        glGenFramebuffers(1, &depthFbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, depthFbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+        glGenFramebuffers(1, &baseFbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, baseFbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, baseTexture, 0);
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+        glBufferData(GL_PIXEL_PACK_BUFFER, (size_t)textureWidth * textureHeight * sizeof(float), nullptr,
+                     GL_STREAM_READ);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    pendingBlockSize = 1;
+    while ((viewportWidth + pendingBlockSize - 1) / pendingBlockSize > HIZ_MAX_BASE_WIDTH)
+        pendingBlockSize *= 2;
+    int baseWidth = (viewportWidth + pendingBlockSize - 1) / pendingBlockSize;
+    int baseHeight = (viewportHeight + pendingBlockSize - 1) / pendingBlockSize;
+
+    // Depth into a texture the reduction can read
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, target);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, depthFbo);
+    glBlitFramebuffer(0, 0, viewportWidth, viewportHeight, 0, 0, viewportWidth, viewportHeight, GL_DEPTH_BUFFER_BIT,
+                      GL_NEAREST);
+
+    // One fragment per base texel
+    glBindFramebuffer(GL_FRAMEBUFFER, baseFbo);
+    glViewport(0, 0, baseWidth, baseHeight);
+    glDisable(GL_DEPTH_TEST);
+    reduceProgram.use();
+    reduceProgram.set(depthBufferUniform, 7);
+    reduceProgram.set(blockSizeUniform, pendingBlockSize);
+    reduceProgram.set(viewportSizeUniform, glm::ivec2(viewportWidth, viewportHeight));
+    glActiveTexture(GL_TEXTURE7);
+    glBindTexture(GL_TEXTURE_2D, depthTexture);
+    glActiveTexture(GL_TEXTURE0);
+    glBindVertexArray(vao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glEnable(GL_DEPTH_TEST);
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, baseWidth, baseHeight, GL_RED, GL_FLOAT, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    pendingWidth = viewportWidth;
+    pendingHeight = viewportHeight;
+    pendingProjection = frameProjection;
+    pendingVersion = viewVersion;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, target);
+    glViewport(0, 0, viewportWidth, viewportHeight);
+}
+
+bool HiZPyramid::update() {
+    if (!fence || glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED)
+        return false;
+    glDeleteSync(fence);
+    fence = nullptr;
+
+    int baseWidth = (pendingWidth + pendingBlockSize - 1) / pendingBlockSize;
+    int baseHeight = (pendingHeight + pendingBlockSize - 1) / pendingBlockSize;
+    std::vector<float> base((size_t)baseWidth * baseHeight);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+    const void* texels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, base.size() * sizeof(float), GL_MAP_READ_BIT);
+    if (texels)
+        std::memcpy(base.data(), texels, base.size() * sizeof(float));
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    if (!texels)
+        return false;
+
+    // Each level halves the one below, rounding up, so texel x covers
+    // texels 2x and 2x + 1 below it, or just 2x at an odd edge
+    levels.clear();
+    levels.push_back(Level{baseWidth, baseHeight, std::move(base)});
+    while (levels.back().width > 1 || levels.back().height > 1) {
+        const Level& below = levels.back();
+        Level level{(below.width + 1) / 2, (below.height + 1) / 2, {}};
+        level.depth.resize((size_t)level.width * level.height);
+        for (int y = 0; y < level.height; y++) {
+            int y1 = std::min(2 * y + 1, below.height - 1);
+            for (int x = 0; x < level.width; x++) {
+                int x1 = std::min(2 * x + 1, below.width - 1);
+                level.depth[(size_t)y * level.width + x] =
+                    std::max({below.depth[(size_t)2 * y * below.width + 2 * x],
+                              below.depth[(size_t)2 * y * below.width + x1],
+                              below.depth[(size_t)y1 * below.width + 2 * x],
+                              below.depth[(size_t)y1 * below.width + x1]});
+            }
+        }
+        levels.push_back(std::move(level));
+    }
+    width = pendingWidth;
+    height = pendingHeight;
+    blockSize = pendingBlockSize;
+    projection = pendingProjection;
+    version = pendingVersion;
+    return true;
+}
+
+bool HiZPyramid::isOccluded(const glm::vec3& center, float radius) const {
+    float nearPlane = projection[3][2] / (projection[2][2] - 1.0f);
+    float nearest = -center.z - radius;
+    float farthest = -center.z + radius;
+    if (levels.empty() || nearest <= nearPlane)
+        return false;
+
+    // Screen rectangle of the sphere's bounding box: the extremes of x and y
+    // over depth, on the box's near or far face depending on the side
+    auto texelRange = [&](float c, float scale, int pixels, int texels, int& first, int& last) {
+        float low = (c - radius) / (c - radius >= 0.0f ? farthest : nearest);
+        float high = (c + radius) / (c + radius >= 0.0f ? nearest : farthest);
+        float lowPixel = (scale * low * 0.5f + 0.5f) * pixels;
+        float highPixel = (scale * high * 0.5f + 0.5f) * pixels;
+        first = (int)std::floor(std::max(lowPixel, 0.0f)) / blockSize;
+        last = (int)std::floor(std::min(highPixel, pixels - 1.0f)) / blockSize;
+        first = std::min(first, texels - 1);
+        last = std::max(last, first);
+    };
+    int x0, x1, y0, y1;
+    texelRange(center.x, projection[0][0], width, levels[0].width, x0, x1);
+    texelRange(center.y, projection[1][1], height, levels[0].height, y0, y1);
+
+    // The finest level where the rectangle spans at most 2x2 texels
+    int level = 0;
+    while (level + 1 < (int)levels.size() && ((x1 >> level) - (x0 >> level) > 1 || (y1 >> level) - (y0 >> level) > 1))
+        level++;
+    const Level& texels = levels[level];
+    float farthestDepth = 0.0f;
+    for (int y = y0 >> level; y <= std::min(y1 >> level, texels.height - 1); y++)
+        for (int x = x0 >> level; x <= std::min(x1 >> level, texels.width - 1); x++)
+            farthestDepth = std::max(farthestDepth, texels.depth[(size_t)y * texels.width + x]);
+
+    // Window depth of the sphere's nearest point
+    float ndc = -projection[2][2] + projection[3][2] / nearest;
+    return ndc * 0.5f + 0.5f > farthestDepth;
+}
+
+void HiZPyramid::destroy() {
+    if (fence)
+        glDeleteSync(fence);
+    fence = nullptr;
+    reduceProgram.destroy();
+    glDeleteVertexArrays(1, &vao);
+    glDeleteFramebuffers(1, &depthFbo);
+    glDeleteFramebuffers(1, &baseFbo);
+    glDeleteTextures(1, &depthTexture);
+    glDeleteTextures(1, &baseTexture);
+    glDeleteBuffers(1, &pbo);
+    vao = depthFbo = baseFbo = depthTexture = baseTexture = pbo = 0;
+    textureWidth = textureHeight = 0;
+    levels.clear();
+}
+
+// Binary PPM (P6)
+bool writePPM(const char* path, int width, int height, const std::vector<uint8_t>& rgb) {
+    std::ofstream file(path, std::ios::binary);
+    file << "P6\n" << width << " " << height << "\n255\n";
+    file.write((const char*)rgb.data(), rgb.size());
+    return (bool)file;
+}
+
+uint32_t crc32(uint32_t crc, const uint8_t* data, size_t size) {
+    static uint32_t table[256];
+    if (table[1] == 0) {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+// 8-bit RGB PNG. The image data goes into stored (uncompressed) deflate
+// blocks so no zlib is needed; files are the size of a PPM.
+bool writePNG(const char* path, int width, int height, const std::vector<uint8_t>& rgb) {
+    auto put32 = [](std::vector<uint8_t>& out, uint32_t value) {
+        for (int shift = 24; shift >= 0; shift -= 8)
+            out.push_back((uint8_t)(value >> shift));
+    };
+
+    // Each row is prefixed with filter type 0 (none)
+    size_t stride = (size_t)width * 3;
+    std::vector<uint8_t> raw;
+    raw.reserve((stride + 1) * height);
+    for (int y = 0; y < height; y++) {
+        raw.push_back(0);
+        raw.insert(raw.end(), rgb.begin() + y * stride, rgb.begin() + (y + 1) * stride);
+    }
+
+    // zlib stream of stored blocks with an Adler-32 trailer
+    std::vector<uint8_t> zlib = {0x78, 0x01};
+    uint32_t a = 1, b = 0;
+    for (size_t offset = 0; offset < raw.size(); offset += 65535) {
+        size_t size = std::min<size_t>(65535, raw.size() - offset);
+        zlib.push_back(offset + size >= raw.size() ? 1 : 0);
+        zlib.push_back((uint8_t)(size & 0xff));
+        zlib.push_back((uint8_t)(size >> 8));
+        zlib.push_back((uint8_t)(~size & 0xff));
+        zlib.push_back((uint8_t)((~size >> 8) & 0xff));
+        for (size_t i = offset; i < offset + size; i++) {
+            a = (a + raw[i]) % 65521;
+            b = (b + a) % 65521;
+        }
+        zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + size);
+    }
+    put32(zlib, (b << 16) | a);
+
+    std::ofstream file(path, std::ios::binary);
+    auto writeChunk = [&](const char* type, const std::vector<uint8_t>& data) {
+        std::vector<uint8_t> chunk;
+        put32(chunk, (uint32_t)data.size());
+        chunk.insert(chunk.end(), type, type + 4);
+        chunk.insert(chunk.end(), data.begin(), data.end());
+        put32(chunk, crc32(0, chunk.data() + 4, chunk.size() - 4));
+        file.write((const char*)chunk.data(), chunk.size());
+    };
+
+    const uint8_t signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    file.write((const char*)signature, sizeof(signature));
+
+    std::vector<uint8_t> header;
+    put32(header, (uint32_t)width);
+    put32(header, (uint32_t)height);
+    header.insert(header.end(), {8, 2, 0, 0, 0}); // 8-bit RGB, no interlace
+    writeChunk("IHDR", header);
+    writeChunk("IDAT", zlib);
+    writeChunk("IEND", {});
+    return (bool)file;
+}
+
+// Write a .png or .ppm depending on the file extension
+bool writeImage(const char* path, int width, int height, const std::vector<uint8_t>& rgb) {
+    size_t length = std::strlen(path);
+    bool png = length >= 4 && std::strcmp(path + length - 4, ".png") == 0;
+    bool written = png ? writePNG(path, width, height, rgb) : writePPM(path, width, height, rgb);
+    if (!written)
+        std::cerr << "Failed to write " << path << std::endl;
+    return written;
+}
+
+// Frame capture keeps this many frames in flight: frame N is read into a
+// pixel buffer object while frame N - 2 is mapped
+const int CAPTURE_RING_SIZE = 3;
+// Frames that may wait for the writer thread before new ones are dropped
+const int CAPTURE_QUEUE_FRAMES = 8;
+
+// Streams rendered frames to disk as a Y4M video (.y4m), a sequence of
+// concatenated PPM images (anything else), or one image per frame when the
+// name holds a run of #s, which becomes the zero-padded frame number, e.g.
+// frame####.png. None of these stall the renderer: glReadPixels goes into a
+// ring of pixel buffer objects guarded by fences; each is mapped two frames
+// later and copied into a buffer for the writer thread, which converts and
+// writes it. A frame whose fence has not signalled by then is late and
+// waited for; one that finds every writer buffer in use is dropped, so the
+// render thread never waits on I/O. A lossless capture waits for the writer
+// instead of dropping frames.
+class FrameCapture {
+public:
+    bool create(const std::string& path, int width, int height, int fps, bool lossless = false);
+    // Queue source's color buffer; call once the frame's draws are issued
+    void capture(const Framebuffer& source);
+    // Collect the frames still in flight and wait for the writer to finish
+    void destroy();
+
+    int getWritten() const { return written; }
+    int getDropped() const { return dropped; }
+    int getLate() const { return late; }
+    // Lossless only: frames that waited for a writer buffer
+    int getStalls() const { return stalls; }
+
+private:
+    struct Frame {
+        std::vector<uint8_t> rgba; // Bottom row first, as GL reads it
+    };
+
+    void collect(unsigned int slot);
+    void writerLoop();
+    bool writeFrame(const Frame& frame);
+
+    std::string path;
+    bool y4m = false;
+    bool sequence = false;
+    bool lossless = false;
+    int width = 0;
+    int height = 0;
+    std::ofstream file;
+
+    unsigned int pbos[CAPTURE_RING_SIZE] = {};
+    GLsync fences[CAPTURE_RING_SIZE] = {};
+    uint64_t frameCount = 0;
+
+    // Frames cycle from freeFrames to the render thread, into queue and
+    // back once the writer is done with them
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable returned; // A frame went back to freeFrames
+    std::vector<Frame> freeFrames;
+    std::deque<Frame> queue;
+    bool stopping = false;
+    std::vector<uint8_t> converted; // Writer thread only
+    int sequenceNumber = 0;         // Writer thread only
+
+    std::atomic<int> written{0};
+    int dropped = 0;
+    int late = 0;
+    int stalls = 0;
+};
+
+// Replace the first run of #s in pattern with number, zero-padded to the
+// run's length
+std::string formatSequencePath(const std::string& pattern, int number) {
+    size_t first = pattern.find('#');
+    if (first == std::string::npos)
+        return pattern;
+    size_t last = pattern.find_first_not_of('#', first);
+    size_t digits = (last == std::string::npos ? pattern.size() : last) - first;
+    std::string text = std::to_string(number);
+    if (text.size() < digits)
+        text.insert(0, digits - text.size(), '0');
+    return pattern.substr(0, first) + text + pattern.substr(first + digits);
+}
+
+bool FrameCapture::create(const std::string& capturePath, int captureWidth, int captureHeight, int fps,
+                          bool losslessCapture) {
+    path = capturePath;
+    width = captureWidth;
+    height = captureHeight;
+    sequence = path.find('#') != std::string::npos;
+    y4m = !sequence && path.size() >= 4 && path.compare(path.size() - 4, 4, ".y4m") == 0;
+    lossless = losslessCapture;
+    sequenceNumber = 0;
+
+    if (!sequence) {
+        file.open(path, std::ios::binary);
+        if (!file) {
+            std::cerr << "Failed to open " << path << std::endl;
+            return false;
+        }
+    }
+    if (y4m)
+        file << "YUV4MPEG2 W" << width << " H" << height << " F" << fps << ":1 Ip A1:1 C420jpeg XCOLORRANGE=FULL\n";
+
+    size_t frameSize = (size_t)width * height * 4;
+    glGenBuffers(CAPTURE_RING_SIZE, pbos);
+    for (unsigned int pbo : pbos) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+        glBufferData(GL_PIXEL_PACK_BUFFER, frameSize, nullptr, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    // Waiting for the writer anyway, a lossless capture only needs enough
+    // buffers to keep it busy
+    freeFrames.resize(lossless ? CAPTURE_RING_SIZE : CAPTURE_QUEUE_FRAMES);
+    for (Frame& frame : freeFrames)
+        frame.rgba.resize(frameSize);
+    stopping = false;
+    writer = std::thread(&FrameCapture::writerLoop, this);
+    return true;
+}
+
+void FrameCapture::capture(const Framebuffer& source) {
+    TRACE_ZONE("Capture");
+    if (source.getWidth() != width || source.getHeight() != height) {
+        // The stream has a fixed size; skip frames from a resized window
+        dropped++;
+        return;
+    }
+
+    // Start the asynchronous read of this frame
+    unsigned int slot = frameCount % CAPTURE_RING_SIZE;
+    source.bindRead();
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[slot]);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    frameCount++;
+
+    // Hand over the frame read two frames ago
+    if (frameCount >= CAPTURE_RING_SIZE)
+        collect(frameCount % CAPTURE_RING_SIZE);
+}
+
+void FrameCapture::collect(unsigned int slot) {
+    GLsync fence = fences[slot];
+    if (!fence)
+        return;
+    fences[slot] = nullptr;
+    if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+        late++;
+        glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, UINT64_MAX);
+    }
+    glDeleteSync(fence);
+
+    Frame frame;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (freeFrames.empty() && lossless) {
+            stalls++;
+            returned.wait(lock, [this] { return !freeFrames.empty(); });
+        }
+        if (freeFrames.empty()) {
+            // The writer is behind; losing a frame beats waiting for the disk
+            dropped++;
+            return;
+        }
+        frame = std::move(freeFrames.back());
+        freeFrames.pop_back();
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[slot]);
+    const void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, frame.rgba.size(), GL_MAP_READ_BIT);
+    if (pixels)
+        std::memcpy(frame.rgba.data(), pixels, frame.rgba.size());
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (pixels)
+        queue.push_back(std::move(frame));
+    else {
+        dropped++;
+        freeFrames.push_back(std::move(frame));
+    }
+    wake.notify_one();
+}
+
+void FrameCapture::destroy() {
+    if (writer.joinable()) {
+        // Everything is done now, so none of these count as late. Oldest
+        // first, so the stream stays in order.
+        glFinish();
+        uint64_t first = frameCount >= CAPTURE_RING_SIZE - 1 ? frameCount - (CAPTURE_RING_SIZE - 1) : 0;
+        for (uint64_t frame = first; frame < frameCount; frame++)
+            collect(frame % CAPTURE_RING_SIZE);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        writer.join();
+    }
+
+    for (GLsync& fence : fences) {
+        if (fence)
+            glDeleteSync(fence);
+        fence = nullptr;
+    }
+    glDeleteBuffers(CAPTURE_RING_SIZE, pbos);
+    std::fill(std::begin(pbos), std::end(pbos), 0u);
+    freeFrames.clear();
+    file.close();
+}
+
+void FrameCapture::writerLoop() {
+    TRACE_THREAD("Capture writer");
+    bool failed = false;
+    while (true) {
+        Frame frame;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty())
+                return;
+            frame = std::move(queue.front());
+            queue.pop_front();
+        }
+
+        TRACE_ZONE("Write frame");
+        if (!failed && !writeFrame(frame)) {
+            std::cerr << "Failed to write " << path << std::endl;
+            failed = true;
+        }
+        if (!failed)
+            written++;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        freeFrames.push_back(std::move(frame));
+        returned.notify_one();
+    }
+}
+
+// Y4M frames are 4:2:0 full-range BT.601 (JPEG) YCbCr, PPM and sequence
+// frames RGB
+bool FrameCapture::writeFrame(const Frame& frame) {
+    size_t stride = (size_t)width * 4;
+    if (!y4m) {
+        converted.resize((size_t)width * height * 3);
+        for (int y = 0; y < height; y++) {
+            const uint8_t* row = &frame.rgba[(height - 1 - y) * stride];
+            uint8_t* out = &converted[(size_t)y * width * 3];
+            for (int x = 0; x < width; x++) {
+                out[x * 3 + 0] = row[x * 4 + 0];
+                out[x * 3 + 1] = row[x * 4 + 1];
+                out[x * 3 + 2] = row[x * 4 + 2];
+            }
+        }
+        if (sequence)
+            return writeImage(formatSequencePath(path, sequenceNumber++).c_str(), width, height, converted);
+        file << "P6\n" << width << " " << height << "\n255\n";
+        file.write((const char*)converted.data(), converted.size());
+        return (bool)file;
+    }
+
+    int chromaWidth = (width + 1) / 2;
+    int chromaHeight = (height + 1) / 2;
+    size_t lumaSize = (size_t)width * height;
+    size_t chromaSize = (size_t)chromaWidth * chromaHeight;
+    converted.resize(lumaSize + 2 * chromaSize);
+    uint8_t* lumaPlane = converted.data();
+    uint8_t* cbPlane = lumaPlane + lumaSize;
+    uint8_t* crPlane = cbPlane + chromaSize;
+
+    // 16.16 fixed point coefficients
+    for (int y = 0; y < height; y++) {
+        const uint8_t* row = &frame.rgba[(height - 1 - y) * stride];
+        for (int x = 0; x < width; x++) {
+            int r = row[x * 4 + 0], g = row[x * 4 + 1], b = row[x * 4 + 2];
+            lumaPlane[(size_t)y * width + x] = (uint8_t)((19595 * r + 38470 * g + 7471 * b + 32768) >> 16);
+        }
+    }
+    // Chroma from the average of each 2x2 block
+    for (int cy = 0; cy < chromaHeight; cy++) {
+        for (int cx = 0; cx < chromaWidth; cx++) {
+            int r = 0, g = 0, b = 0, count = 0;
+            for (int y = cy * 2; y < std::min(cy * 2 + 2, height); y++) {
+                const uint8_t* row = &frame.rgba[(height - 1 - y) * stride];
+                for (int x = cx * 2; x < std::min(cx * 2 + 2, width); x++) {
+                    r += row[x * 4 + 0];
+                    g += row[x * 4 + 1];
+                    b += row[x * 4 + 2];
+                    count++;
+                }
+            }
+            int cb = (-11059 * r - 21709 * g + 32768 * b) / count;
+            int cr = (32768 * r - 27439 * g - 5329 * b) / count;
+            cbPlane[(size_t)cy * chromaWidth + cx] = (uint8_t)std::clamp((cb + (128 << 16) + 32768) >> 16, 0, 255);
+            crPlane[(size_t)cy * chromaWidth + cx] = (uint8_t)std::clamp((cr + (128 << 16) + 32768) >> 16, 0, 255);
+        }
+    }
+    file << "FRAME\n";
+    file.write((const char*)converted.data(), converted.size());
+    return (bool)file;
+}
+
+// GPU culling needs compute shaders and SSBOs; everything else falls back
+// to binning on the CPU
+LightCulling resolveLightCulling(LightCulling requested) {
+    bool computeSupported = GLEW_VERSION_4_3 || (GLEW_ARB_compute_shader && GLEW_ARB_shader_storage_buffer_object);
+    if (requested == LightCulling::Auto)
+        return computeSupported ? LightCulling::Gpu : LightCulling::Cpu;
+    if (requested == LightCulling::Gpu && !computeSupported) {
+        std::cerr << "Compute shaders are not supported, culling lights on the CPU" << std::endl;
+        return LightCulling::Cpu;
+    }
+    return requested;
+}
+
+// Persistent mapping needs buffer storage (OpenGL 4.4); orphaning works
+// everywhere
+StreamUpload resolveStreamUpload(StreamUpload requested) {
+    bool storageSupported = GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+    if (requested == StreamUpload::Auto)
+        return storageSupported ? StreamUpload::Persistent : StreamUpload::Orphan;
+    if (requested == StreamUpload::Persistent && !storageSupported) {
+        std::cerr << "Buffer storage is not supported, orphaning instead" << std::endl;
+        return StreamUpload::Orphan;
+    }
+    return requested;
+}
+
+const char* streamUploadName(StreamUpload upload) {
+    switch (upload) {
+    case StreamUpload::Persistent: return "persistent";
+    case StreamUpload::Orphan: return "orphan";
+    default: return "auto";
+    }
+}
+
+const char* lightCullingName(LightCulling culling) {
+    switch (culling) {
+    case LightCulling::Gpu: return "gpu";
+    case LightCulling::Cpu: return "cpu";
+    case LightCulling::None: return "none";
+    default: return "auto";
+    }
+}
+
+// Point lights and per-cluster light lists for the forward+ path. Light
+// lists are rebuilt only when the view changes, by the culling compute
+// shader or on the CPU, and packed into one index buffer with an (offset,
+// count) pair per cluster. The fragment shader reads all three buffers
+// through buffer textures, so it needs nothing newer than GLSL 3.30.
+class LightClusters {
+public:
+    void create(const std::vector<glm::vec4>& pointLights, LightCulling lightCulling);
+    // Rebuild the lists for a new camera or viewport. FrameData must already
+    // hold the frame's matrices; the depth slices are fitted to the cubes.
+    void update(const FrameUniforms& frame, int width, int height, const std::vector<CubeInstance>& cubes);
+    // Lights on texture unit 0, clusters on unit 1, light indices on unit 2
+    void bind() const;
+    void destroy();
+
+    // Defines for the forward+ shaders
+    std::string shaderDefines() const;
+
+    int getLightCount() const { return (int)lights.size(); }
+    glm::ivec3 getClusterCounts() const { return clusterCounts; }
+    float getClusterNear() const { return clusterNear; }
+    float getSliceDepth() const { return sliceDepth; }
+
+private:
+    void cullOnGpu(const FrameUniforms& frame, int width, int height);
+    void cullOnCpu(const FrameUniforms& frame, int width, int height);
+    void reserveLightIndices(size_t capacity);
+
+    std::vector<glm::vec4> lights;
+    LightCulling culling = LightCulling::Cpu;
+    unsigned int lightBuffer = 0;
+    unsigned int lightTexture = 0;
+    unsigned int clusterBuffer = 0;
+    unsigned int clusterTexture = 0;
+    unsigned int lightIndexBuffer = 0;
+    unsigned int lightIndexTexture = 0;
+    size_t lightIndexCapacity = 0;
+
+    glm::ivec3 clusterCounts = glm::ivec3(0);
+    float clusterNear = 0.0f;
+    float sliceDepth = 1.0f;
+
+    ShaderProgram cullProgram;
+    int inverseProjectionUniform = -1;
+    int lightCountUniform = -1;
+    int screenSizeUniform = -1;
+    int clusterNearUniform = -1;
+    int sliceDepthUniform = -1;
+    int lightIndexCapacityUniform = -1;
+
+    // CPU culling scratch space, kept between updates
+    std::vector<std::vector<uint32_t>> cpuLists;
+    std::vector<uint32_t> cpuClusters;
+    std::vector<uint32_t> cpuIndices;
+};
+
+void LightClusters::create(const std::vector<glm::vec4>& pointLights, LightCulling lightCulling) {
+    lights = pointLights;
+    culling = lightCulling;
+
+    glGenBuffers(1, &lightBuffer);
+    glBindBuffer(GL_TEXTURE_BUFFER, lightBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, std::max<size_t>(lights.size(), 1) * sizeof(glm::vec4), lights.data(),
+                 GL_STATIC_DRAW);
+    glGenTextures(1, &lightTexture);
+    glBindTexture(GL_TEXTURE_BUFFER, lightTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, lightBuffer);
+
+    if (culling == LightCulling::None)
+        return;
+    glGenBuffers(1, &clusterBuffer);
+    glGenTextures(1, &clusterTexture);
+    glGenBuffers(1, &lightIndexBuffer);
+    glGenTextures(1, &lightIndexTexture);
+
+    if (culling == LightCulling::Gpu) {
+        std::string defines = shaderDefines() + "#define MAX_LIGHTS_PER_CLUSTER " +
+                              std::to_string(MAX_LIGHTS_PER_CLUSTER) + "u\n";
+        cullProgram = ShaderProgram::compute(lightCullingComputeShaderSource, defines.c_str());
+        inverseProjectionUniform = cullProgram.uniform("inverseProjection");
+        lightCountUniform = cullProgram.uniform("lightCount");
+        screenSizeUniform = cullProgram.uniform("screenSize");
+        clusterNearUniform = cullProgram.uniform("clusterNear");
+        sliceDepthUniform = cullProgram.uniform("sliceDepth");
+        lightIndexCapacityUniform = cullProgram.uniform("lightIndexCapacity");
+    }
+}
+
+std::string LightClusters::shaderDefines() const {
+    if (culling == LightCulling::None)
+        return "";
+    return "#define CULL_LIGHTS\n"
+           "#define CLUSTER_TILE_SIZE " + std::to_string(CLUSTER_TILE_SIZE) + "\n";
+}
+
+// The index buffer starts with a counter for the culling shader, so list
+// offsets are one element past the buffer start
+void LightClusters::reserveLightIndices(size_t capacity) {
+    if (capacity <= lightIndexCapacity)
+        return;
+    lightIndexCapacity = capacity;
+    glBindBuffer(GL_TEXTURE_BUFFER, lightIndexBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, (lightIndexCapacity + 1) * sizeof(uint32_t), nullptr, GL_DYNAMIC_DRAW);
+    glBindTexture(GL_TEXTURE_BUFFER, lightIndexTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, lightIndexBuffer);
+}
+
+void LightClusters::update(const FrameUniforms& frame, int width, int height,
+                           const std::vector<CubeInstance>& cubes) {
+    if (culling == LightCulling::None)
+        return;
+
+    // Fit the depth slices to the view-space depth range of the cubes
+    float near = frame.projection[3][2] / (frame.projection[2][2] - 1.0f);
+    float minDepth = 1e30f, maxDepth = near;
+    for (const CubeInstance& cube : cubes) {
+        float depth = -(frame.view * cube.model[3]).z;
+        float scale = std::max({glm::length(glm::vec3(cube.model[0])), glm::length(glm::vec3(cube.model[1])),
+                                glm::length(glm::vec3(cube.model[2]))});
+        float radius = 0.8660254f * scale; // Half the unit cube's diagonal
+        minDepth = std::min(minDepth, depth - radius);
+        maxDepth = std::max(maxDepth, depth + radius);
+    }
+    clusterNear = std::max(near, minDepth);
+    sliceDepth = std::max(maxDepth - clusterNear, 1e-3f) / CLUSTER_SLICES;
+
+    // Resize the cluster grid with the viewport
+    glm::ivec3 counts((width + CLUSTER_TILE_SIZE - 1) / CLUSTER_TILE_SIZE,
+                      (height + CLUSTER_TILE_SIZE - 1) / CLUSTER_TILE_SIZE, CLUSTER_SLICES);
+    if (counts != clusterCounts) {
+        clusterCounts = counts;
+        glBindBuffer(GL_TEXTURE_BUFFER, clusterBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, (size_t)counts.x * counts.y * counts.z * 2 * sizeof(uint32_t), nullptr,
+                     GL_DYNAMIC_DRAW);
+        glBindTexture(GL_TEXTURE_BUFFER, clusterTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32UI, clusterBuffer);
+        reserveLightIndices((size_t)counts.x * counts.y * counts.z * 16);
+    }
+
+    if (culling == LightCulling::Gpu)
+        cullOnGpu(frame, width, height);
+    else
+        cullOnCpu(frame, width, height);
+}
+
+void LightClusters::cullOnGpu(const FrameUniforms& frame, int width, int height) {
+    cullProgram.use();
+    cullProgram.set(inverseProjectionUniform, glm::inverse(frame.projection));
+    cullProgram.set(lightCountUniform, (int)lights.size());
+    cullProgram.set(screenSizeUniform, glm::vec2(width, height));
+    cullProgram.set(clusterNearUniform, clusterNear);
+    cullProgram.set(sliceDepthUniform, sliceDepth);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, lightBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, clusterBuffer);
+
+    // The culling pass reports how many indices it needed; if the buffer
+    // was too small it is grown and the pass runs again
+    while (true) {
+        cullProgram.set(lightIndexCapacityUniform, (int)lightIndexCapacity);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, lightIndexBuffer);
+        uint32_t needed = 0;
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(needed), &needed);
+        glDispatchCompute(clusterCounts.x, clusterCounts.y, clusterCounts.z);
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(needed), &needed);
+        if (needed <= lightIndexCapacity)
+            break;
+        reserveLightIndices(std::max<size_t>(needed, lightIndexCapacity * 2));
+    }
+}
+
+// Same box test as the compute shader, but each light only visits the
+// clusters under its screen rectangle and depth range, and lists keep the
+// lights in order
+void LightClusters::cullOnCpu(const FrameUniforms& frame, int width, int height) {
+    const int tilesX = clusterCounts.x, tilesY = clusterCounts.y;
+    size_t clusterCount = (size_t)tilesX * tilesY * CLUSTER_SLICES;
+    cpuLists.resize(clusterCount);
+    for (std::vector<uint32_t>& list : cpuLists)
+        list.clear();
+
+    // Directions through the tile corners at a depth of 1
+    glm::mat4 inverseProjection = glm::inverse(frame.projection);
+    std::vector<glm::vec3> rays((size_t)(tilesX + 1) * (tilesY + 1));
+    for (int y = 0; y <= tilesY; y++) {
+        for (int x = 0; x <= tilesX; x++) {
+            glm::vec2 pixel(std::min(x * CLUSTER_TILE_SIZE, width), std::min(y * CLUSTER_TILE_SIZE, height));
+            glm::vec4 point = inverseProjection *
+                              glm::vec4(pixel / glm::vec2(width, height) * 2.0f - 1.0f, 1.0f, 1.0f);
+            rays[y * (tilesX + 1) + x] = glm::vec3(point) / -point.z;
+        }
+    }
+
+    float near = frame.projection[3][2] / (frame.projection[2][2] - 1.0f);
+    for (size_t i = 0; i < lights.size(); i++) {
+        glm::vec3 center = glm::vec3(frame.view * glm::vec4(glm::vec3(lights[i]), 1.0f));
+        float radius = lights[i].w;
+        float depth = -center.z;
+        int minSlice = std::max(0, (int)std::floor((depth - radius - clusterNear) / sliceDepth));
+        int maxSlice = std::min(CLUSTER_SLICES - 1, (int)std::floor((depth + radius - clusterNear) / sliceDepth));
+        if (minSlice > maxSlice)
+            continue;
+
+        // Screen rectangle of the light's bounding box, or the whole screen
+        // when the box crosses the near plane
+        int minTileX = 0, minTileY = 0, maxTileX = tilesX - 1, maxTileY = tilesY - 1;
+        if (depth - radius > near) {
+            glm::vec2 minimum(1e30f), maximum(-1e30f);
+            for (int corner = 0; corner < 8; corner++) {
+                glm::vec3 offset((corner & 1) ? radius : -radius, (corner & 2) ? radius : -radius,
+                                 (corner & 4) ? radius : -radius);
+                glm::vec4 clip = frame.projection * glm::vec4(center + offset, 1.0f);
+                glm::vec2 pixel = (glm::vec2(clip) / clip.w * 0.5f + 0.5f) * glm::vec2(width, height);
+                minimum = glm::min(minimum, pixel);
+                maximum = glm::max(maximum, pixel);
+            }
+            if (maximum.x < 0.0f || maximum.y < 0.0f || minimum.x >= width || minimum.y >= height)
+                continue;
+            minTileX = std::max(minTileX, (int)minimum.x / CLUSTER_TILE_SIZE);
+            minTileY = std::max(minTileY, (int)minimum.y / CLUSTER_TILE_SIZE);
+            maxTileX = std::min(maxTileX, (int)maximum.x / CLUSTER_TILE_SIZE);
+            maxTileY = std::min(maxTileY, (int)maximum.y / CLUSTER_TILE_SIZE);
+        }
+
+        for (int slice = minSlice; slice <= maxSlice; slice++) {
+            float nearDepth = clusterNear + slice * sliceDepth;
+            for (int ty = minTileY; ty <= maxTileY; ty++) {
+                for (int tx = minTileX; tx <= maxTileX; tx++) {
+                    const glm::vec3 corners[4] = {rays[ty * (tilesX + 1) + tx], rays[ty * (tilesX + 1) + tx + 1],
+                                                  rays[(ty + 1) * (tilesX + 1) + tx + 1],
+                                                  rays[(ty + 1) * (tilesX + 1) + tx]};
+                    glm::vec3 boxMin(1e30f), boxMax(-1e30f);
+                    for (const glm::vec3& ray : corners) {
+                        boxMin = glm::min(boxMin, glm::min(ray * nearDepth, ray * (nearDepth + sliceDepth)));
+                        boxMax = glm::max(boxMax, glm::max(ray * nearDepth, ray * (nearDepth + sliceDepth)));
+                    }
+                    glm::vec3 offset = glm::clamp(center, boxMin, boxMax) - center;
+                    if (glm::dot(offset, offset) >= radius * radius)
+                        continue;
+
+                    std::vector<uint32_t>& list = cpuLists[((size_t)slice * tilesY + ty) * tilesX + tx];
+                    if (list.size() < (size_t)MAX_LIGHTS_PER_CLUSTER)
+                        list.push_back((uint32_t)i);
+                }
+            }
+        }
+    }
+
+    // Pack the lists behind the counter element
+    cpuClusters.resize(clusterCount * 2);
+    cpuIndices.assign(1, 0);
+    for (size_t c = 0; c < clusterCount; c++) {
+        cpuClusters[c * 2] = (uint32_t)cpuIndices.size() - 1;
+        cpuClusters[c * 2 + 1] = (uint32_t)cpuLists[c].size();
+        cpuIndices.insert(cpuIndices.end(), cpuLists[c].begin(), cpuLists[c].end());
+    }
+    cpuIndices[0] = (uint32_t)cpuIndices.size() - 1;
+
+    glBindBuffer(GL_TEXTURE_BUFFER, clusterBuffer);
+    glBufferSubData(GL_TEXTURE_BUFFER, 0, cpuClusters.size() * sizeof(uint32_t), cpuClusters.data());
+    reserveLightIndices(cpuIndices.size() - 1);
+    glBindBuffer(GL_TEXTURE_BUFFER, lightIndexBuffer);
+    glBufferSubData(GL_TEXTURE_BUFFER, 0, cpuIndices.size() * sizeof(uint32_t), cpuIndices.data());
+}
+
+void LightClusters::bind() const {
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_BUFFER, lightIndexTexture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_BUFFER, clusterTexture);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_BUFFER, lightTexture);
+}
+
+void LightClusters::destroy() {
+    glDeleteTextures(1, &lightTexture);
+    glDeleteBuffers(1, &lightBuffer);
+    glDeleteTextures(1, &clusterTexture);
+    glDeleteBuffers(1, &clusterBuffer);
+    glDeleteTextures(1, &lightIndexTexture);
+    glDeleteBuffers(1, &lightIndexBuffer);
+    lightTexture = lightBuffer = clusterTexture = clusterBuffer = lightIndexTexture = lightIndexBuffer = 0;
+    lightIndexCapacity = 0;
+    clusterCounts = glm::ivec3(0);
+    cullProgram.destroy();
+    cpuLists.clear();
+}
+
+// Number of squarings that raise to shininess, or -1 when the generic pow()
+// variant has to handle it. Blinn-Phong's 4x exponent adds two.
+int shininessSquarings(const Options& options, float shininess) {
+    if (!options.specializeShininess)
+        return -1;
+    int exponent;
+    float mantissa = std::frexp(shininess, &exponent);
+    // shininess = 2^(exponent - 1) exactly; beyond 2^16 pow() is no slower
+    if (mantissa != 0.5f || exponent < 1 || exponent > 17)
+        return -1;
+    return exponent - 1 + (options.specular == SpecularModel::BlinnPhong ? 2 : 0);
+}
+
+// Defines selecting one permutation of SPECULAR_FUNCTION
+std::string specularDefines(const Options& options, int squarings) {
+    std::string defines;
+    if (options.specular == SpecularModel::BlinnPhong)
+        defines += "#define BLINN_PHONG\n";
+    if (squarings >= 0)
+        defines += "#define SHININESS_SQUARINGS " + std::to_string(squarings) + "\n";
+    return defines;
+}
+
+const char* specularModelName(SpecularModel specular) {
+    return specular == SpecularModel::BlinnPhong ? "blinn" : "phong";
+}
+
+// Draws of one view, each a 64-bit sort key and a payload naming what to
+// draw. Keys order by depth layer, then program, then mesh, then material,
+// then front to back: sorting groups the draws that share state, and the
+// nearest cubes of a group are drawn first so depth testing rejects more of
+// the rest. With more than one layer, nearer layers are drawn first.
+class RenderQueue {
+public:
+    // Field widths from the top: depth layer 8 bits, program 8, mesh 8,
+    // material 16 and view depth 24, the top of the float's bits, which
+    // order like the value when it is not negative
+    static uint64_t key(uint32_t layer, uint32_t program, uint32_t mesh, uint32_t material, float depth) {
+        uint32_t depthBits;
+        float clamped = std::max(depth, 0.0f);
+        std::memcpy(&depthBits, &clamped, sizeof(depthBits));
+        return (uint64_t)(layer & 0xff) << 56 | (uint64_t)(program & 0xff) << 48 | (uint64_t)(mesh & 0xff) << 40 |
+               (uint64_t)(material & 0xffff) << 24 | depthBits >> 8;
+    }
+    static uint32_t program(uint64_t key) { return (uint32_t)(key >> 48) & 0xff; }
+    // Layer, program and mesh: draws sharing them can go in one indirect
+    // command
+    static uint32_t state(uint64_t key) { return (uint32_t)(key >> 40); }
+
+    void clear();
+    void push(uint64_t key, uint32_t payload);
+    // Stable, so equal keys keep the order they were pushed in
+    void sort();
+
+    size_t size() const { return keys.size(); }
+    const std::vector<uint64_t>& getKeys() const { return keys; }
+    const std::vector<uint32_t>& getPayloads() const { return payloads; }
+
+private:
+    std::vector<uint64_t> keys, sortedKeys;
+    std::vector<uint32_t> payloads, sortedPayloads;
+};
+
+void RenderQueue::clear() {
+    keys.clear();
+    payloads.clear();
+}
+
+void RenderQueue::push(uint64_t key, uint32_t payload) {
+    keys.push_back(key);
+    payloads.push_back(payload);
+}
+
+// Least significant digit radix sort, one byte per pass. Bytes every key
+// shares, like the mesh of a one-mesh scene, are skipped.
+void RenderQueue::sort() {
+    size_t count = keys.size();
+    sortedKeys.resize(count);
+    sortedPayloads.resize(count);
+    for (int shift = 0; shift < 64; shift += 8) {
+        size_t offsets[256] = {};
+        for (uint64_t key : keys)
+            offsets[(key >> shift) & 0xff]++;
+        if (count == 0 || offsets[(keys[0] >> shift) & 0xff] == count)
+            continue;
+        size_t sum = 0;
+        for (size_t& offset : offsets) {
+            size_t digits = offset;
+            offset = sum;
+            sum += digits;
+        }
+        for (size_t i = 0; i < count; i++) {
+            size_t slot = offsets[(keys[i] >> shift) & 0xff]++;
+            sortedKeys[slot] = keys[i];
+            sortedPayloads[slot] = payloads[i];
+        }
+        keys.swap(sortedKeys);
+        payloads.swap(sortedPayloads);
+    }
+}
+
+// Everything needed to draw the cube grid, shared by the windowed and
+// headless paths
+class Renderer {
+public:
+    // False if the scene file could not be loaded
+    bool create(const Options& options);
+    void render(int width, int height);
+    void destroy();
+
+    // Orbit the camera around the origin by degrees from the scene's angle,
+    // and move it closer by zoom (> 1) or further away (< 1) than
+    // Options::zoom
+    void setCamera(float degrees, float zoom);
+    // Pose of the cubes with --animate
+    void setTime(float seconds) { animationTime = seconds; }
+    // Switch the forward+ lights between forward and deferred shading. The
+    // other path's programs are compiled the first time it is used.
+    void setDeferred(bool enable);
+    bool isDeferred() const { return deferred; }
+
+    // Time spent loading or generating the scene, and its light count
+    double getSceneLoadTime() const { return sceneLoadTime; }
+    size_t getLightCount() const { return scene.pointLights.empty() ? scene.size() : scene.pointLights.size(); }
+    // Culling statistics for the last frame
+    size_t getCubeCount() const { return cubes.size(); }
+    size_t getVisibleCubes() const { return visibleCubes; }
+    // Lighting shader variants the current path draws with
+    size_t getVariantCount() const { return deferred ? 1 : variantSquarings.size(); }
+    // How the last frame submitted the cubes: the draws in the render queue,
+    // the indirect commands and draw calls they took, whether those were
+    // multi-draw calls, and the GL state changes (program, vertex array,
+    // attribute, buffer and texture binds, uniform writes) and API calls it
+    // made to draw them
+    struct SubmitStats {
+        bool multiDraw = false;
+        size_t draws = 0;
+        size_t commands = 0;
+        size_t drawCalls = 0;
+        size_t stateChanges = 0;
+        size_t apiCalls = 0;
+    };
+    const SubmitStats& getSubmitStats() const { return submitStats; }
+    // Overdraw of a frame: the fragments its shading pass drew, i.e. that
+    // passed the depth test, and the pixels the cubes cover
+    struct OverdrawStats {
+        uint64_t fragments = 0;
+        uint64_t pixels = 0;
+    };
+    // Count the overdraw of the next frame; getOverdraw() waits for the counts
+    void measureOverdraw() { overdrawRequested = true; }
+    OverdrawStats getOverdraw();
+    // Occlusion culling: cubes in the frustum the hi-Z pyramid hid in the
+    // last visibility update, and the size of the pyramid's base
+    size_t getOccludedCubes() const { return occludedCubes; }
+    int getHiZWidth() const { return hiZ.getBaseWidth(); }
+    int getHiZHeight() const { return hiZ.getBaseHeight(); }
+    // True until the pyramid of the current view has culled the cubes; a
+    // window that only redraws on changes should draw again meanwhile
+    bool isOcclusionPending() const {
+        return options.occlusionCulling && !options.animate && occlusionVersion != viewVersion;
+    }
+    // G-buffer memory of the deferred path, 0 until it is first used
+    size_t getGBufferBytes() const { return gBuffer.getBytes(); }
+    // Baked lighting: memory of the lightmap cache and its tile data, how
+    // often it was baked and how long the last bake took
+    size_t getBakeBytes() const { return lightmap.getBytes() + tileBytes; }
+    int getBakeWidth() const { return lightmap.getWidth(); }
+    int getBakeHeight() const { return lightmap.getHeight(); }
+    int getBakeCount() const { return bakeCount; }
+    double getBakeTime() const { return bakeTime; }
+    // Animated instance streaming: whether it is persistently mapped, and
+    // how many frames then waited for the GPU to release buffer space
+    bool isStreamPersistent() const { return instanceStream.isPersistent(); }
+    int getStreamStalls() const { return instanceStream.getStalls(); }
+    // CPU time posing the animated cubes in the last frame, and the threads
+    // and work steals it took
+    double getUpdateTime() const { return updateTime; }
+    int getWorkerThreads() const { return pool->size(); }
+    uint64_t getWorkSteals() const { return pool->getSteals(); }
+
+private:
+    // One permutation of the lighting program for the path in use. Uniforms
+    // another path's shader lacks stay -1, which set() ignores.
+    struct LightingProgram {
+        ShaderProgram program;
+        int objectColor = -1;
+        int lightPos = -1;
+        int shininess = -1;
+        int model = -1;
+        int normalMatrix = -1;
+        int lights = -1;
+        int clusters = -1;
+        int lightIndices = -1;
+        int clusterCounts = -1;
+        int clusterNear = -1;
+        int sliceDepth = -1;
+        int lightCount = -1;
+        int gNormal = -1;
+        int gShininess = -1;
+        int gDepth = -1;
+        int inverseView = -1;
+        int viewportSize = -1;
+        int atlasSize = -1;
+        int screenSize = -1;
+        int lightmap = -1;
+    };
+
+    // Consecutive entries of visibleOrder drawn with one program, as
+    // commandCount entries of drawCommands from firstCommand on
+    struct DrawBatch {
+        size_t variant;
+        uint32_t first;
+        uint32_t count;
+        uint32_t firstCommand;
+        uint32_t commandCount;
+    };
+
+    // Consecutive entries of visibleOrder drawn with one program and mesh
+    struct DrawCommand {
+        uint32_t first;
+        uint32_t count;
+    };
+
+    LightingProgram createProgram(const char* vertexSource, const char* fragmentSource, const std::string& defines);
+    void createForwardPrograms();
+    void createDeferredPrograms();
+    void createBakePrograms();
+    void setLightUniforms(LightingProgram& lighting);
+    // Geometry and lighting passes into the bound framebuffer. False if the
+    // G-buffer could not be created, which switches back to forward shading.
+    bool renderDeferred(int width, int height, unsigned int instanceBuffer, size_t instanceOffset);
+    // Draw the visible cubes into the bound framebuffer, after the frame
+    // uniforms, visibility and light clusters are up to date
+    void submit(int width, int height);
+    // Projection and view for the viewport and camera, when they changed,
+    // into the frame uniform buffer
+    void updateFrameUniforms(int width, int height);
+    // Depth-only pass over the visible cubes, then the queries of the
+    // shading pass that follows. endShading() is called with the shading
+    // pass's depth buffer still bound, to count the covered pixels and build
+    // the hi-Z pyramid from it.
+    void drawDepthPrepass(bool instancedPath, unsigned int instanceBuffer, size_t instanceOffset);
+    void beginShading();
+    void endShading(int width, int height);
+    // Count a GL state change made with calls API calls
+    void countStateChange(size_t calls = 1) {
+        submitStats.stateChanges++;
+        submitStats.apiCalls += calls;
+    }
+    void countDrawCall(size_t commands = 1) {
+        submitStats.commands += commands;
+        submitStats.drawCalls++;
+        submitStats.apiCalls++;
+    }
+    // Shade the visible cubes' faces into the lightmap. False if they do not
+    // fit, in which case the frame is shaded live.
+    bool bake(int width, int height);
+    void updateVisibility();
+    // Point the per-instance attributes at buffer, starting offset bytes in
+    void bindInstanceAttributes(unsigned int buffer, size_t offset);
+
+    Options options;
+    std::vector<CubeInstance> cubes; // At rest, in BVH order
+    SceneData scene;                 // The same cubes, for posing, and the scene settings
+    double sceneLoadTime = 0.0;
+    std::unique_ptr<ThreadPool> pool;
+    std::vector<uint8_t> cubeVariants;   // Index into programs for every cube
+    std::vector<uint16_t> cubeMaterials; // Index of every cube's shininess among the distinct ones
+
+    // Frustum culling, redone whenever the view changes
+    CubeBVH bvh;
+    std::vector<CubeBVH::Range> visibleRanges;
+    std::vector<CubeInstance> visibleInstances;
+    size_t visibleCubes = 0;
+    bool visibilityDirty = true;
+
+    // Visible cubes in render queue order, one batch per shader variant and
+    // one command per mesh within it. With multiDraw the commands are also
+    // in indirectBuffer, and each batch is one multi-draw call.
+    RenderQueue renderQueue;
+    std::vector<uint32_t> visibleOrder;
+    std::vector<DrawBatch> drawBatches;
+    std::vector<DrawCommand> drawCommands;
+    bool multiDraw = false;
+    unsigned int indirectBuffer = 0;
+    SubmitStats submitStats;
+
+    // Depth pre-pass, with the vertex shader of the shading pass it precedes
+    LightingProgram depthProgram;          // Plain forward path
+    LightingProgram instancedDepthProgram; // Instanced, forward+, deferred and baked paths
+
+    // Occlusion culling against the hi-Z pyramid of an earlier frame of the
+    // same view. Cubes at rest are culled once per view; animated cubes
+    // move, so they are culled again with every new pyramid.
+    HiZPyramid hiZ;
+    uint64_t viewVersion = 0;               // Bumped by every viewport or camera change
+    uint64_t occlusionVersion = UINT64_MAX; // View the last pyramid culled
+    size_t occludedCubes = 0;
+
+    // Overdraw counts: fragments of the shading pass, then covered pixels
+    bool overdrawRequested = false;
+    bool overdrawPending = false;
+    unsigned int overdrawQueries[2] = {};
+    LightingProgram coverageProgram;
+    OverdrawStats overdraw;
+
+    // Frame uniforms are only recomputed when the viewport or camera changes
+    FrameUniforms frame = {};
+    int frameWidth = 0;
+    int frameHeight = 0;
+    float camAngle = CAMERA_ANGLE; // Camera rotation in degrees, from the scene's
+    float camZoom = 1.0f;
+    bool cameraDirty = true;
+
+    // Forward, instanced or forward+ program, one per shader variant
+    std::vector<int> variantSquarings;
+    std::string instanceDefines;
+    std::vector<LightingProgram> programs;
+    FrameUniformBuffer frameUniforms;
+
+    // Forward+ lighting, drawn instanced
+    LightClusters lightClusters;
+    bool lightClustersDirty = true;
+
+    // Deferred shading of the forward+ lights: one generic program per pass,
+    // since the G-buffer holds any shininess
+    bool deferred = false;
+    GBuffer gBuffer;
+    LightingProgram gBufferProgram;
+    LightingProgram deferredLightingProgram;
+    unsigned int fullscreenVAO = 0;
+
+    // Baked lighting, valid until the view or viewport changes. The bake
+    // program is the path's lighting rendered into lightmap tiles; the
+    // baked program draws the cubes from them.
+    bool bakeDirty = true;
+    LightmapAtlas lightmap;
+    unsigned int tileBuffer = 0; // Lightmap tile of every visible cube
+    size_t tileBytes = 0;
+    LightingProgram bakeProgram;
+    LightingProgram bakedProgram;
+    int bakeCount = 0;
+    double bakeTime = 0.0;
+
+    Mesh cubeMesh;
+    unsigned int VAO = 0;
+    unsigned int instanceVAO = 0;
+    unsigned int instanceVBO = 0;
+    unsigned int instanceAttributesBuffer = 0;
+    size_t instanceAttributesOffset = 0;
+
+    // Animated instance data, rewritten every frame in visibleOrder
+    StreamBuffer instanceStream;
+    float animationTime = 0.0f;
+    double updateTime = 0.0;
+};
+
+bool Renderer::create(const Options& rendererOptions) {
+    options = rendererOptions;
+
+    // Configure global OpenGL state
+    glEnable(GL_DEPTH_TEST);
+
+    // Cube layout, light positions and shininess for every cube, in SoA
+    // form for the pose jobs and at rest for everything else
+    pool = std::make_unique<ThreadPool>(workerThreadCount(options));
+    auto loadStart = std::chrono::steady_clock::now();
+    {
+        TRACE_ZONE("Load scene");
+        if (!createScene(options, scene, *pool))
+            return false;
+    }
+    sceneLoadTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loadStart).count();
+    cubes.resize(scene.size());
+    poseCubes(scene, nullptr, cubes.size(), false, 0.0f, cubes.data(), *pool);
+    camAngle = scene.camera.angle;
+    camZoom = options.zoom;
+
+    // Forward+ lights follow the original cube order
+    std::vector<glm::vec4> pointLights;
+    if (options.clusteredLighting)
+        pointLights = buildPointLights(options, scene);
+
+    // Cubes are kept in BVH order so visible ones come out as a few ranges;
+    // the render queue then sorts them for drawing
+    if (options.frustumCulling) {
+        std::vector<uint32_t> order;
+        bvh.build(cubes, options.animate, &order);
+        scene.reorder(order);
+    }
+    visibilityDirty = true;
+
+    // One shader variant per distinct squaring count, generic first
+    variantSquarings.clear();
+    for (const CubeInstance& cube : cubes)
+        variantSquarings.push_back(shininessSquarings(options, cube.shininess));
+    std::sort(variantSquarings.begin(), variantSquarings.end());
+    variantSquarings.erase(std::unique(variantSquarings.begin(), variantSquarings.end()), variantSquarings.end());
+    cubeVariants.clear();
+    for (const CubeInstance& cube : cubes) {
+        int squarings = shininessSquarings(options, cube.shininess);
+        cubeVariants.push_back((uint8_t)(std::lower_bound(variantSquarings.begin(), variantSquarings.end(), squarings) -
+                                         variantSquarings.begin()));
+    }
+
+    // Materials are the distinct shininess values; the plain forward path
+    // sets a cube's shininess only when it differs from the last one drawn
+    std::vector<float> materials;
+    for (const CubeInstance& cube : cubes)
+        materials.push_back(cube.shininess);
+    std::sort(materials.begin(), materials.end());
+    materials.erase(std::unique(materials.begin(), materials.end()), materials.end());
+    cubeMaterials.clear();
+    for (const CubeInstance& cube : cubes) {
+        size_t material = std::lower_bound(materials.begin(), materials.end(), cube.shininess) - materials.begin();
+        cubeMaterials.push_back((uint16_t)std::min<size_t>(material, 0xffff));
+    }
+
+    // Multi-draw indirect with a base instance needs OpenGL 4.3
+    bool multiDrawSupported = GLEW_VERSION_4_3 || (GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance);
+    multiDraw = options.multiDraw && (options.instanced || options.clusteredLighting) && multiDrawSupported;
+    if (options.multiDraw && (options.instanced || options.clusteredLighting) && !multiDrawSupported)
+        std::cerr << "Multi-draw indirect is not supported, drawing each command separately" << std::endl;
+    if (multiDraw)
+        glGenBuffers(1, &indirectBuffer);
+
+    // When every cube is rigid the instanced shader derives normals from the
+    // model matrix and skips fetching the per-instance normal matrix
+    bool rigid = std::all_of(cubes.begin(), cubes.end(),
+                             [](const CubeInstance& cube) { return isRigidTransform(cube.model); });
+    instanceDefines = rigid ? "#define RIGID_TRANSFORMS\n" : "";
+
+    // Create and compile shaders, only for the path in use
+    if (options.clusteredLighting)
+        lightClusters.create(pointLights, resolveLightCulling(options.lightCulling));
+    deferred = options.deferred && options.clusteredLighting;
+    if (deferred)
+        createDeferredPrograms();
+    else
+        createForwardPrograms();
+    if (options.bakeLighting && !options.animate)
+        createBakePrograms();
+    if (options.depthPrepass) {
+        if (options.instanced || options.clusteredLighting || options.bakeLighting)
+            instancedDepthProgram =
+                createProgram(instancedVertexShaderSource, depthFragmentShaderSource, instanceDefines);
+        if (!options.instanced && !options.clusteredLighting)
+            depthProgram = createProgram(vertexShaderSource, depthFragmentShaderSource, "");
+    }
+    if (options.occlusionCulling)
+        hiZ.create();
+
+    // Frame-constant uniforms shared by every program
+    frameUniforms.create();
+
+    // Set up vertex data
+    cubeMesh.create(vertices, sizeof(vertices) / (6 * sizeof(float)), options.vertexFormat);
+
+    glGenVertexArrays(1, &VAO);
+    glBindVertexArray(VAO);
+    cubeMesh.bindAttributes();
+
+    // Instanced vertex array: shares the cube mesh and adds one
+    // CubeInstance per cube with an attribute divisor of 1
+    glGenVertexArrays(1, &instanceVAO);
+    glGenBuffers(1, &instanceVBO);
+
+    glBindVertexArray(instanceVAO);
+    cubeMesh.bindAttributes();
+
+    glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+    glBufferData(GL_ARRAY_BUFFER, cubes.size() * sizeof(CubeInstance), cubes.data(), GL_DYNAMIC_DRAW);
+    bindInstanceAttributes(instanceVBO, 0);
+    // Model matrix columns, light position, shininess, normal matrix columns
+    for (int location = 2; location <= 10; location++) {
+        glEnableVertexAttribArray(location);
+        glVertexAttribDivisor(location, 1);
+    }
+
+    if (options.animate && (options.instanced || options.clusteredLighting))
+        instanceStream.create(cubes.size() * sizeof(CubeInstance),
+                              resolveStreamUpload(options.streamUpload) == StreamUpload::Persistent);
+
+    // The fullscreen pass has no vertex attributes, but core profile still
+    // needs a vertex array bound to draw
+    glGenVertexArrays(1, &fullscreenVAO);
+    return true;
+}
+
+Renderer::LightingProgram Renderer::createProgram(const char* vertexSource, const char* fragmentSource,
+                                                  const std::string& defines) {
+    // Invariance costs the compiler some freedom, so only the pre-pass and
+    // the passes that depth test against it ask for it
+    std::string allDefines = options.depthPrepass ? "#define DEPTH_PREPASS\n" + defines : defines;
+    LightingProgram lighting;
+    lighting.program = ShaderProgram(vertexSource, fragmentSource, allDefines.c_str());
+
+    // Uniform locations used in the render loop
+    lighting.objectColor = lighting.program.uniform("objectColor");
+    lighting.lightPos = lighting.program.uniform("lightPos");
+    lighting.shininess = lighting.program.uniform("shininess");
+    lighting.model = lighting.program.uniform("model");
+    lighting.normalMatrix = lighting.program.uniform("normalMatrix");
+    lighting.lights = lighting.program.uniform("lights");
+    lighting.clusters = lighting.program.uniform("clusters");
+    lighting.lightIndices = lighting.program.uniform("lightIndices");
+    lighting.clusterCounts = lighting.program.uniform("clusterCounts");
+    lighting.clusterNear = lighting.program.uniform("clusterNear");
+    lighting.sliceDepth = lighting.program.uniform("sliceDepth");
+    lighting.lightCount = lighting.program.uniform("lightCount");
+    lighting.gNormal = lighting.program.uniform("gNormal");
+    lighting.gShininess = lighting.program.uniform("gShininess");
+    lighting.gDepth = lighting.program.uniform("gDepth");
+    lighting.inverseView = lighting.program.uniform("inverseView");
+    lighting.viewportSize = lighting.program.uniform("viewportSize");
+    lighting.atlasSize = lighting.program.uniform("atlasSize");
+    lighting.screenSize = lighting.program.uniform("screenSize");
+    lighting.lightmap = lighting.program.uniform("lightmap");
+    return lighting;
+}
+
+void Renderer::createForwardPrograms() {
+    TRACE_ZONE("Compile shaders");
+    for (int squarings : variantSquarings) {
+        std::string defines = specularDefines(options, squarings);
+        if (options.clusteredLighting)
+            programs.push_back(createProgram(instancedVertexShaderSource, clusteredFragmentShaderSource,
+                                             lightClusters.shaderDefines() + instanceDefines + defines));
+        else if (options.instanced)
+            programs.push_back(createProgram(instancedVertexShaderSource, instancedFragmentShaderSource,
+                                             instanceDefines + defines));
+        else
+            programs.push_back(createProgram(vertexShaderSource, fragmentShaderSource, defines));
+    }
+}
+
+void Renderer::createDeferredPrograms() {
+    TRACE_ZONE("Compile shaders");
+    gBufferProgram = createProgram(instancedVertexShaderSource, gBufferFragmentShaderSource, instanceDefines);
+    deferredLightingProgram = createProgram(fullscreenVertexShaderSource, deferredLightingFragmentShaderSource,
+                                            lightClusters.shaderDefines() + specularDefines(options, -1));
+}
+
+// Baked with the generic pow() variant, as the specialized ones would take
+// a draw per variant to save time that is only spent once
+void Renderer::createBakePrograms() {
+    std::string defines = "#define BAKE_LIGHTING\n" + instanceDefines + specularDefines(options, -1);
+    if (options.clusteredLighting)
+        bakeProgram = createProgram(instancedVertexShaderSource, clusteredFragmentShaderSource,
+                                    lightClusters.shaderDefines() + defines);
+    else
+        bakeProgram = createProgram(instancedVertexShaderSource, instancedFragmentShaderSource, defines);
+    bakedProgram = createProgram(bakedVertexShaderSource, bakedFragmentShaderSource, "");
+    glGenBuffers(1, &tileBuffer);
+}
+
+void Renderer::setDeferred(bool enable) {
+    if (!options.clusteredLighting || enable == deferred)
+        return;
+    deferred = enable;
+    if (deferred && !gBufferProgram.program.isCreated())
+        createDeferredPrograms();
+    if (!deferred && programs.empty())
+        createForwardPrograms();
+}
+
+// Forward+ light buffers, bound by LightClusters::bind, and cluster layout
+void Renderer::setLightUniforms(LightingProgram& lighting) {
+    lighting.program.set(lighting.lights, 0);
+    lighting.program.set(lighting.clusters, 1);
+    lighting.program.set(lighting.lightIndices, 2);
+    lighting.program.set(lighting.clusterCounts, lightClusters.getClusterCounts());
+    lighting.program.set(lighting.clusterNear, lightClusters.getClusterNear());
+    lighting.program.set(lighting.sliceDepth, lightClusters.getSliceDepth());
+    lighting.program.set(lighting.lightCount, lightClusters.getLightCount());
+}
+
+// The instance VAO must be bound
+void Renderer::bindInstanceAttributes(unsigned int buffer, size_t base) {
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+
+    // Model matrix takes four attribute slots, one per column
+    for (int column = 0; column < 4; column++)
+        glVertexAttribPointer(2 + column, 4, GL_FLOAT, GL_FALSE, sizeof(CubeInstance),
+                              (void*)(base + offsetof(CubeInstance, model) + column * sizeof(glm::vec4)));
+    glVertexAttribPointer(6, 3, GL_FLOAT, GL_FALSE, sizeof(CubeInstance),
+                          (void*)(base + offsetof(CubeInstance, lightPos)));
+    glVertexAttribPointer(7, 1, GL_FLOAT, GL_FALSE, sizeof(CubeInstance),
+                          (void*)(base + offsetof(CubeInstance, shininess)));
+    // Normal matrix takes three slots
+    for (int column = 0; column < 3; column++)
+        glVertexAttribPointer(8 + column, 3, GL_FLOAT, GL_FALSE, sizeof(CubeInstance),
+                              (void*)(base + offsetof(CubeInstance, normalMatrix) + column * sizeof(glm::vec3)));
+    instanceAttributesBuffer = buffer;
+    instanceAttributesOffset = base;
+    countStateChange(10);
+}
+
+void Renderer::render(int width, int height) {
+    TRACE_ZONE("Render");
+    TRACE_GPU_ZONE("Render");
+    glViewport(0, 0, width, height);
+
+    // Render
+    glClearColor(scene.clearColor.r, scene.clearColor.g, scene.clearColor.b, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    updateFrameUniforms(width, height);
+
+    // A pyramid of this view hides cubes, which changes what is drawn and baked
+    if (options.occlusionCulling && hiZ.update() && hiZ.getVersion() == viewVersion &&
+        (options.animate || occlusionVersion != viewVersion)) {
+        visibilityDirty = true;
+        bakeDirty = true;
+    }
+
+    if (visibilityDirty) {
+        TRACE_ZONE("Visibility");
+        updateVisibility();
+        visibilityDirty = false;
+    }
+
+    if (options.clusteredLighting) {
+        if (lightClustersDirty) {
+            TRACE_ZONE("Light clusters");
+            TRACE_GPU_ZONE("Light clusters");
+            lightClusters.update(frame, width, height, cubes);
+            lightClustersDirty = false;
+        }
+        lightClusters.bind();
+    }
+
+    // Uniform writes are counted by the programs
+    TRACE_ZONE("Submit");
+    TRACE_GPU_ZONE("Submit");
+    submitStats = SubmitStats();
+    submitStats.draws = visibleOrder.size();
+    size_t uploads = ShaderProgram::getUploads();
+    submit(width, height);
+    submitStats.stateChanges += ShaderProgram::getUploads() - uploads;
+    submitStats.apiCalls += ShaderProgram::getUploads() - uploads;
+}
+
+void Renderer::updateFrameUniforms(int width, int height) {
+    TRACE_ZONE("Frame uniforms");
+
+    // View/Projection transformations
+    if (width != frameWidth || height != frameHeight) {
+        frame.projection = computeProjection(scene.camera, width, height);
+        frameWidth = width;
+        frameHeight = height;
+        lightClustersDirty = true;
+        visibilityDirty = true;
+        bakeDirty = true;
+        viewVersion++;
+    }
+
+    if (cameraDirty) {
+        // Camera rotation by a fixed angle
+        glm::vec3 cameraPos = computeCameraPos(scene.camera, camAngle, camZoom);
+        frame.view = computeView(scene.camera, cameraPos);
+        frame.viewPos = scene.camera.fixedEye ? scene.camera.eye : cameraPos;
+
+        // Set common light properties
+        frame.lightColor = scene.lightColor;
+        cameraDirty = false;
+        lightClustersDirty = true;
+        visibilityDirty = true;
+        bakeDirty = true;
+        viewVersion++;
+    }
+    frameUniforms.update(frame);
+}
+
+void Renderer::submit(int width, int height) {
+    // Unchanged view: draw the cached faces, one lookup per pixel
+    if (options.bakeLighting && !options.animate && (!bakeDirty || bake(width, height))) {
+        bakeDirty = false;
+        drawDepthPrepass(true, instanceVBO, 0);
+        bakedProgram.program.use();
+        bakedProgram.program.set(bakedProgram.lightmap, 6);
+        lightmap.bindTexture(6);
+        glBindVertexArray(instanceVAO);
+        countStateChange();  // Program
+        countStateChange(2); // Texture unit and texture
+        countStateChange();  // Vertex array
+        if (instanceAttributesBuffer != instanceVBO || instanceAttributesOffset != 0)
+            bindInstanceAttributes(instanceVBO, 0);
+        beginShading();
+        cubeMesh.drawInstanced((GLsizei)visibleOrder.size());
+        countDrawCall();
+        endShading(width, height);
+        return;
+    }
+
+    // Animated cubes are posed by the worker threads in draw order, on the
+    // instanced paths straight into the stream buffer when it is
+    // persistently mapped
+    bool instancedPath = options.instanced || options.clusteredLighting;
+    unsigned int instanceBuffer = instanceVBO;
+    size_t instanceOffset = 0;
+    if (options.animate) {
+        TRACE_ZONE("Pose cubes");
+        auto updateStart = std::chrono::steady_clock::now();
+        if (instancedPath) {
+            CubeInstance* instances = (CubeInstance*)instanceStream.map(visibleOrder.size() * sizeof(CubeInstance));
+            poseCubes(scene, visibleOrder.data(), visibleOrder.size(), true, animationTime, instances, *pool);
+            instanceOffset = instanceStream.unmap();
+            instanceBuffer = instanceStream.getBuffer();
+        } else {
+            visibleInstances.resize(visibleOrder.size());
+            poseCubes(scene, visibleOrder.data(), visibleOrder.size(), true, animationTime, visibleInstances.data(),
+                      *pool);
+        }
+        updateTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - updateStart).count();
+    }
+
+    if (deferred && renderDeferred(width, height, instanceBuffer, instanceOffset)) {
+        if (options.animate)
+            instanceStream.fence();
+        return;
+    }
+
+    drawDepthPrepass(instancedPath, instanceBuffer, instanceOffset);
+
+    // Every draw uses the cube mesh, so the vertex array is bound once
+    glBindVertexArray(instancedPath ? instanceVAO : VAO);
+    countStateChange();
+    submitStats.multiDraw = multiDraw;
+    if (multiDraw) {
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+        countStateChange();
+        // Commands address the instances from the start of this frame's data
+        if (instanceBuffer != instanceAttributesBuffer || instanceOffset != instanceAttributesOffset)
+            bindInstanceAttributes(instanceBuffer, instanceOffset);
+    }
+
+    // Render cubes, one batch per shader variant and depth layer
+    beginShading();
+    for (const DrawBatch& batch : drawBatches) {
+        LightingProgram& lighting = programs[batch.variant];
+        lighting.program.use();
+        countStateChange();
+        lighting.program.set(lighting.objectColor, scene.objectColor);
+        if (options.clusteredLighting)
+            setLightUniforms(lighting);
+
+        if (multiDraw) {
+            // The variant's commands, one per mesh, in one call
+            cubeMesh.multiDrawIndirect(batch.firstCommand * sizeof(IndirectCommand), (GLsizei)batch.commandCount);
+            countDrawCall(batch.commandCount);
+            continue;
+        }
+
+        if (instancedPath) {
+            // Every visible cube of a command in one draw call
+            for (uint32_t i = batch.firstCommand; i < batch.firstCommand + batch.commandCount; i++) {
+                size_t offset = instanceOffset + drawCommands[i].first * sizeof(CubeInstance);
+                if (instanceBuffer != instanceAttributesBuffer || offset != instanceAttributesOffset)
+                    bindInstanceAttributes(instanceBuffer, offset);
+                cubeMesh.drawInstanced((GLsizei)drawCommands[i].count);
+                countDrawCall();
+            }
+            continue;
+        }
+
+        for (uint32_t i = batch.first; i < batch.first + batch.count; i++) {
+            const CubeInstance& cube = options.animate ? visibleInstances[i] : cubes[visibleOrder[i]];
+
+            // Set static light position for this cube
+            lighting.program.set(lighting.lightPos, cube.lightPos);
+
+            // Set shininess for this cube
+            lighting.program.set(lighting.shininess, cube.shininess);
+
+            // Model transformation
+            lighting.program.set(lighting.model, cube.model);
+            lighting.program.set(lighting.normalMatrix, cube.normalMatrix);
+
+            // Draw cube
+            cubeMesh.draw();
+            countDrawCall();
+        }
+    }
+    endShading(width, height);
+
+    if (options.animate && instancedPath)
+        instanceStream.fence();
+}
+
+// Front to back within each state group, like the shading pass: the
+// instanced paths draw every visible cube in one call, the plain forward
+// path cube by cube with only the model matrix set
+void Renderer::drawDepthPrepass(bool instancedPath, unsigned int instanceBuffer, size_t instanceOffset) {
+    if (!options.depthPrepass)
+        return;
+    TRACE_GPU_ZONE("Depth pre-pass");
+    // Pushed back a depth unit, the nearest surface of each pixel still
+    // passes the shading pass's less test and everything behind it fails.
+    // An equal test would let every face tying with it through too, and the
+    // last drawn rather than the first would win the pixel.
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(0.0f, 1.0f);
+    countStateChange(3);
+    if (instancedPath) {
+        instancedDepthProgram.program.use();
+        glBindVertexArray(instanceVAO);
+        countStateChange(); // Program
+        countStateChange(); // Vertex array
+        if (instanceBuffer != instanceAttributesBuffer || instanceOffset != instanceAttributesOffset)
+            bindInstanceAttributes(instanceBuffer, instanceOffset);
+        cubeMesh.drawInstanced((GLsizei)visibleOrder.size());
+        countDrawCall(0);
+    } else {
+        depthProgram.program.use();
+        glBindVertexArray(VAO);
+        countStateChange(); // Program
+        countStateChange(); // Vertex array
+        for (size_t i = 0; i < visibleOrder.size(); i++) {
+            const CubeInstance& cube = options.animate ? visibleInstances[i] : cubes[visibleOrder[i]];
+            depthProgram.program.set(depthProgram.model, cube.model);
+            cubeMesh.draw();
+            countDrawCall(0);
+        }
+    }
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glDisable(GL_POLYGON_OFFSET_FILL);
+    countStateChange(2);
+}
+
+// Start counting the shading pass's fragments when overdraw was requested
+void Renderer::beginShading() {
+    if (overdrawRequested) {
+        if (!overdrawQueries[0])
+            glGenQueries(2, overdrawQueries);
+        glBeginQuery(GL_SAMPLES_PASSED, overdrawQueries[0]);
+    }
+}
+
+void Renderer::endShading(int width, int height) {
+    // Covered pixels: a fullscreen triangle on the far plane passes the
+    // depth test wherever a cube is nearer
+    if (overdrawRequested) {
+        glEndQuery(GL_SAMPLES_PASSED);
+        if (!coverageProgram.program.isCreated())
+            coverageProgram = createProgram(fullscreenVertexShaderSource, depthFragmentShaderSource, "");
+        coverageProgram.program.use();
+        glBindVertexArray(fullscreenVAO);
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        glDepthMask(GL_FALSE);
+        glDepthFunc(GL_GREATER);
+        glDepthRange(1.0, 1.0);
+        glBeginQuery(GL_SAMPLES_PASSED, overdrawQueries[1]);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glEndQuery(GL_SAMPLES_PASSED);
+        glDepthRange(0.0, 1.0);
+        glDepthFunc(GL_LESS);
+        glDepthMask(GL_TRUE);
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        overdrawRequested = false;
+        overdrawPending = true;
+    }
+
+    // Cubes at rest need one pyramid per view, animated ones every frame's
+    if (options.occlusionCulling && (options.animate || occlusionVersion != viewVersion)) {
+        TRACE_GPU_ZONE("Hi-Z pyramid");
+        hiZ.build(width, height, frame.projection, viewVersion);
+    }
+}
+
+Renderer::OverdrawStats Renderer::getOverdraw() {
+    if (overdrawPending) {
+        GLuint64 fragments = 0, pixels = 0;
+        glGetQueryObjectui64v(overdrawQueries[0], GL_QUERY_RESULT, &fragments);
+        glGetQueryObjectui64v(overdrawQueries[1], GL_QUERY_RESULT, &pixels);
+        overdraw = OverdrawStats{fragments, pixels};
+        overdrawPending = false;
+    }
+    return overdraw;
+}
+
+// The geometry pass writes the nearest surface of every pixel into the
+// G-buffer, with all visible cubes in one instanced draw; the lighting pass
+// then shades each covered pixel of the target exactly once, however many
+// cubes overlap it
+bool Renderer::renderDeferred(int width, int height, unsigned int instanceBuffer, size_t instanceOffset) {
+    TRACE_GPU_ZONE("Deferred");
+    int target;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target);
+    // Grown to the largest viewport so far; dynamic resolution changes the
+    // viewport too often to reallocate every time
+    if (width > gBuffer.getWidth() || height > gBuffer.getHeight()) {
+        int gBufferWidth = std::max(width, gBuffer.getWidth());
+        int gBufferHeight = std::max(height, gBuffer.getHeight());
+        gBuffer.destroy();
+        if (!gBuffer.create(gBufferWidth, gBufferHeight)) {
+            std::cerr << "Falling back to forward shading" << std::endl;
+            glBindFramebuffer(GL_FRAMEBUFFER, target);
+            setDeferred(false);
+            return false;
+        }
+    }
+
+    // Geometry pass. Normal and shininess are only read where a cube was
+    // drawn, so they need no clear.
+    gBuffer.bind();
+    gBuffer.clear();
+    countStateChange(2); // Framebuffer and viewport
+    drawDepthPrepass(true, instanceBuffer, instanceOffset);
+    gBufferProgram.program.use();
+    glBindVertexArray(instanceVAO);
+    countStateChange(); // Program
+    countStateChange(); // Vertex array
+    if (instanceBuffer != instanceAttributesBuffer || instanceOffset != instanceAttributesOffset)
+        bindInstanceAttributes(instanceBuffer, instanceOffset);
+    beginShading();
+    cubeMesh.drawInstanced((GLsizei)visibleOrder.size());
+    countDrawCall();
+    endShading(width, height);
+
+    // Lighting pass over the target, already cleared to the background
+    glBindFramebuffer(GL_FRAMEBUFFER, target);
+    glDisable(GL_DEPTH_TEST);
+    LightingProgram& lighting = deferredLightingProgram;
+    lighting.program.use();
+    lighting.program.set(lighting.objectColor, scene.objectColor);
+    setLightUniforms(lighting);
+    lighting.program.set(lighting.gNormal, 3);
+    lighting.program.set(lighting.gShininess, 4);
+    lighting.program.set(lighting.gDepth, 5);
+    lighting.program.set(lighting.inverseView, glm::inverse(frame.view));
+    lighting.program.set(lighting.viewportSize, glm::vec2((float)width, (float)height));
+    gBuffer.bindTextures();
+    glBindVertexArray(fullscreenVAO);
+    countStateChange();  // Framebuffer
+    countStateChange();  // Program
+    countStateChange(6); // Three texture units and textures
+    countStateChange();  // Vertex array
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    countDrawCall();
+    glEnable(GL_DEPTH_TEST);
+    return true;
+}
+
+// Every visible cube gets a lightmap tile with faces about as many texels
+// across as the face covers pixels, rounded up to a power of two. The bake
+// pass rasterizes each face into its square, running the path's own
+// lighting shader at the texel's point on the face, so highlights come out
+// as they would on screen; drawing then filters between texels.
+bool Renderer::bake(int width, int height) {
+    TRACE_ZONE("Bake");
+    TRACE_GPU_ZONE("Bake");
+    auto start = std::chrono::steady_clock::now();
+
+    // Projected face size, from the nearest point of the cube's bounding sphere
+    float near = frame.projection[3][2] / (frame.projection[2][2] - 1.0f);
+    float pixelsPerUnit = frame.projection[1][1] * 0.5f * height;
+    std::vector<int> faceSizes(visibleOrder.size());
+    for (size_t i = 0; i < visibleOrder.size(); i++) {
+        const CubeInstance& cube = cubes[visibleOrder[i]];
+        float scale = std::max({glm::length(glm::vec3(cube.model[0])), glm::length(glm::vec3(cube.model[1])),
+                                glm::length(glm::vec3(cube.model[2]))});
+        float depth = -(frame.view * cube.model[3]).z - 0.87f * scale;
+        float pixels = scale * pixelsPerUnit / std::max(depth, near);
+        float texels = pixels < LIGHTMAP_OVERSAMPLE_BELOW ? 2.0f * pixels : pixels;
+        int size = 1;
+        while (size < texels && size < LIGHTMAP_MAX_FACE_SIZE)
+            size *= 2;
+        faceSizes[i] = size;
+    }
+
+    int maxTextureSize;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+    int atlasWidth, atlasHeight;
+    std::vector<glm::vec3> tiles = packLightmapTiles(faceSizes, std::min(maxTextureSize, LIGHTMAP_MAX_ATLAS_SIZE),
+                                                     atlasWidth, atlasHeight);
+    if (tiles.empty() && !faceSizes.empty()) {
+        std::cerr << "Too many cubes for the lightmap, shading live" << std::endl;
+        return false;
+    }
+
+    int target;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target);
+    if (atlasWidth != lightmap.getWidth() || atlasHeight != lightmap.getHeight()) {
+        lightmap.destroy();
+        if (!lightmap.create(atlasWidth, atlasHeight)) {
+            glBindFramebuffer(GL_FRAMEBUFFER, target);
+            return false;
+        }
+    }
+
+    // Tiles follow visibleOrder, like the instance data
+    tileBytes = tiles.size() * sizeof(glm::vec3);
+    glBindVertexArray(instanceVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, tileBuffer);
+    glBufferData(GL_ARRAY_BUFFER, std::max<size_t>(tileBytes, 1), tiles.data(), GL_STATIC_DRAW);
+    glVertexAttribPointer(11, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
+    glVertexAttribDivisor(11, 1);
+    glEnableVertexAttribArray(11);
+    if (instanceAttributesBuffer != instanceVBO || instanceAttributesOffset != 0)
+        bindInstanceAttributes(instanceVBO, 0);
+
+    lightmap.bind();
+    glViewport(0, 0, atlasWidth, atlasHeight);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glDisable(GL_DEPTH_TEST);
+    LightingProgram& lighting = bakeProgram;
+    lighting.program.use();
+    lighting.program.set(lighting.objectColor, scene.objectColor);
+    if (options.clusteredLighting)
+        setLightUniforms(lighting);
+    lighting.program.set(lighting.atlasSize, glm::vec2((float)atlasWidth, (float)atlasHeight));
+    lighting.program.set(lighting.screenSize, glm::vec2((float)width, (float)height));
+    cubeMesh.drawInstanced((GLsizei)visibleOrder.size());
+    glEnable(GL_DEPTH_TEST);
+    glBindFramebuffer(GL_FRAMEBUFFER, target);
+    glViewport(0, 0, width, height);
+
+    // Finished here so the reported time covers the GPU work
+    glFinish();
+    bakeTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    bakeCount++;
+    return true;
+}
+
+// Find the cubes inside the view frustum and not hidden behind the hi-Z
+// pyramid, and sort them through the render queue. The instanced paths
+// draw them packed at the start of the instance buffer, in queue order.
+void Renderer::updateVisibility() {
+    if (options.frustumCulling)
+        bvh.cull(frame.projection * frame.view, visibleRanges);
+    else
+        visibleRanges.assign(1, CubeBVH::Range{0, (uint32_t)cubes.size()});
+
+    // Depth layers split the visible cubes' depth range evenly
+    float nearestDepth = 1e30f, farthestDepth = 0.0f;
+    if (options.depthLayers > 1) {
+        for (const CubeBVH::Range& range : visibleRanges) {
+            for (uint32_t i = range.first; i < range.first + range.count; i++) {
+                float depth = -(frame.view * cubes[i].model[3]).z;
+                nearestDepth = std::min(nearestDepth, depth);
+                farthestDepth = std::max(farthestDepth, depth);
+            }
+        }
+    }
+    float layerScale = farthestDepth > nearestDepth ? options.depthLayers / (farthestDepth - nearestDepth) : 0.0f;
+
+    // Every cube is a draw of the one cube mesh, at its view depth at rest,
+    // unless the pyramid of this view hides it
+    bool occlusion = options.occlusionCulling && hiZ.isReady() && hiZ.getVersion() == viewVersion;
+    const uint32_t cubeMeshId = 0;
+    renderQueue.clear();
+    occludedCubes = 0;
+    for (const CubeBVH::Range& range : visibleRanges) {
+        for (uint32_t i = range.first; i < range.first + range.count; i++) {
+            glm::vec3 center = glm::vec3(frame.view * cubes[i].model[3]);
+            if (occlusion && hiZ.isOccluded(center, cubeBoundingRadius(cubes[i].model))) {
+                occludedCubes++;
+                continue;
+            }
+            float depth = -center.z;
+            uint32_t layer = std::min((uint32_t)std::max((depth - nearestDepth) * layerScale, 0.0f),
+                                      (uint32_t)options.depthLayers - 1);
+            renderQueue.push(RenderQueue::key(layer, cubeVariants[i], cubeMeshId, cubeMaterials[i], depth), i);
+        }
+    }
+    if (occlusion)
+        occlusionVersion = viewVersion;
+    visibleCubes = renderQueue.size();
+    renderQueue.sort();
+    visibleOrder = renderQueue.getPayloads();
+
+    // Runs of one program make a batch, runs of one mesh within them a command
+    const std::vector<uint64_t>& keys = renderQueue.getKeys();
+    drawBatches.clear();
+    drawCommands.clear();
+    for (uint32_t first = 0; first < keys.size();) {
+        uint32_t end = first + 1;
+        while (end < keys.size() && RenderQueue::state(keys[end]) == RenderQueue::state(keys[first]))
+            end++;
+        size_t variant = RenderQueue::program(keys[first]);
+        if (drawBatches.empty() || drawBatches.back().variant != variant)
+            drawBatches.push_back(DrawBatch{variant, first, 0, (uint32_t)drawCommands.size(), 0});
+        drawBatches.back().count += end - first;
+        drawBatches.back().commandCount++;
+        drawCommands.push_back(DrawCommand{first, end - first});
+        first = end;
+    }
+    if (multiDraw) {
+        std::vector<IndirectCommand> commands;
+        for (const DrawCommand& command : drawCommands)
+            commands.push_back(cubeMesh.indirectCommand(command.count, command.first));
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(IndirectCommand), commands.data(),
+                     GL_DYNAMIC_DRAW);
+    }
+
+    // Animated cubes are streamed by render()
+    if ((options.instanced || options.clusteredLighting || options.bakeLighting) && !options.animate) {
+        visibleInstances.clear();
+        for (uint32_t index : visibleOrder)
+            visibleInstances.push_back(cubes[index]);
+        glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, visibleInstances.size() * sizeof(CubeInstance), visibleInstances.data());
+    }
+}
+
+void Renderer::setCamera(float degrees, float zoom) {
+    float angle = scene.camera.angle + degrees;
+    float factor = options.zoom * zoom;
+    if (angle == camAngle && factor == camZoom)
+        return;
+    camAngle = angle;
+    camZoom = factor;
+    cameraDirty = true;
+}
+
+void Renderer::destroy() {
+    glDeleteVertexArrays(1, &VAO);
+    glDeleteVertexArrays(1, &instanceVAO);
+    glDeleteBuffers(1, &instanceVBO);
+    instanceStream.destroy();
+    cubeMesh.destroy();
+    pool.reset();
+    for (LightingProgram& lighting : programs)
+        lighting.program.destroy();
+    programs.clear();
+    gBufferProgram.program.destroy();
+    deferredLightingProgram.program.destroy();
+    bakeProgram.program.destroy();
+    bakedProgram.program.destroy();
+    depthProgram.program.destroy();
+    instancedDepthProgram.program.destroy();
+    coverageProgram.program.destroy();
+    glDeleteQueries(2, overdrawQueries);
+    std::fill(std::begin(overdrawQueries), std::end(overdrawQueries), 0u);
+    overdrawRequested = overdrawPending = false;
+    hiZ.destroy();
+    glDeleteBuffers(1, &tileBuffer);
+    tileBuffer = 0;
+    glDeleteBuffers(1, &indirectBuffer);
+    indirectBuffer = 0;
+    lightmap.destroy();
+    glDeleteVertexArrays(1, &fullscreenVAO);
+    fullscreenVAO = 0;
+    gBuffer.destroy();
+    lightClusters.destroy();
+    frameUniforms.destroy();
+}
+
+void processInput(GLFWwindow* window) {
+    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
+        glfwSetWindowShouldClose(window, true);
+}
+
+// Lane primitives for the shading kernel, overloaded for one lane (float)
+// and for SIMD vectors
+inline void loadLanes(const float* p, float& v) { v = *p; }
+inline void storeLanes(float* p, float v) { *p = v; }
+inline int32_t bitsOf(float v) { int32_t i; std::memcpy(&i, &v, sizeof(i)); return i; }
+inline float fromBits(int32_t i) { float v; std::memcpy(&v, &i, sizeof(v)); return v; }
+inline float toFloat(int32_t i) { return (float)i; }
+inline int32_t truncToInt(float v) { return (int32_t)v; }
+inline float select(bool mask, float a, float b) { return mask ? a : b; }
+inline int32_t selectInt(bool mask, int32_t a, int32_t b) { return mask ? a : b; }
+inline float vmax(float a, float b) { return a > b ? a : b; }
+inline float vsqrt(float v) { return std::sqrt(v); }
+template<typename F> F splat(float value);
+template<> inline float splat<float>(float value) { return value; }
+
+#ifdef SHINE_SIMD
+#if defined(__AVX2__)
+const int SIMD_LANES = 8;
+#else
+const int SIMD_LANES = 4;
+#endif
+typedef float SimdFloat __attribute__((vector_size(SIMD_LANES * sizeof(float))));
+typedef int32_t SimdInt __attribute__((vector_size(SIMD_LANES * sizeof(int32_t))));
+
+inline void loadLanes(const float* p, SimdFloat& v) { std::memcpy(&v, p, sizeof(v)); }
+inline void storeLanes(float* p, SimdFloat v) { std::memcpy(p, &v, sizeof(v)); }
+inline SimdInt bitsOf(SimdFloat v) { return (SimdInt)v; }
+inline SimdFloat fromBits(SimdInt i) { return (SimdFloat)i; }
+inline SimdFloat toFloat(SimdInt i) { return __builtin_convertvector(i, SimdFloat); }
+inline SimdInt truncToInt(SimdFloat v) { return __builtin_convertvector(v, SimdInt); }
+inline SimdFloat select(SimdInt mask, SimdFloat a, SimdFloat b) {
+    return fromBits((mask & bitsOf(a)) | (~mask & bitsOf(b)));
+}
+inline SimdInt selectInt(SimdInt mask, SimdInt a, SimdInt b) { return (mask & a) | (~mask & b); }
+inline SimdFloat vmax(SimdFloat a, SimdFloat b) { return select(a > b, a, b); }
+inline SimdFloat vsqrt(SimdFloat v) {
+#if defined(__AVX2__)
+    return (SimdFloat)_mm256_sqrt_ps((__m256)v);
+#elif defined(__SSE2__)
+    return (SimdFloat)_mm_sqrt_ps((__m128)v);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    return (SimdFloat)vsqrtq_f32((float32x4_t)v);
+#else
+    for (int i = 0; i < SIMD_LANES; i++)
+        v[i] = std::sqrt(v[i]);
+    return v;
+#endif
+}
+template<> inline SimdFloat splat<SimdFloat>(float value) { return SimdFloat{} + value; }
+#endif
+
+// log2 for x > 0: the exponent comes from the float bits and the mantissa,
+// reduced to [sqrt(1/2), sqrt(2)), goes through an atanh series
+template<typename F>
+F lanesLog2(F x) {
+    auto bits = bitsOf(x);
+    auto exponent = ((bits >> 23) & 0xff) - 127;
+    F mantissa = fromBits((bits & 0x7fffff) | 0x3f800000);
+    auto large = mantissa > 1.41421356f;
+    mantissa = select(large, mantissa * 0.5f, mantissa);
+    exponent = selectInt(large, exponent + 1, exponent);
+
+    F t = (mantissa - 1.0f) / (mantissa + 1.0f);
+    F t2 = t * t;
+    F series = 1.0f + t2 * (1.0f / 3.0f + t2 * (1.0f / 5.0f + t2 * (1.0f / 7.0f + t2 * (1.0f / 9.0f))));
+    return toFloat(exponent) + t * series * 2.88539008f; // 2 / ln(2)
+}
+
+// exp2 for y >= -126: 2^floor(y) built from bits times a Taylor series for
+// the fractional part
+template<typename F>
+F lanesExp2(F y) {
+    y = vmax(y, splat<F>(-126.0f));
+    F whole = toFloat(truncToInt(y));
+    whole = select(whole > y, whole - 1.0f, whole);
+    F f = (y - whole) * 0.693147181f;
+    F series = 1.0f + f * (1.0f + f * (1.0f / 2.0f + f * (1.0f / 6.0f + f * (1.0f / 24.0f +
+               f * (1.0f / 120.0f + f * (1.0f / 720.0f + f * (1.0f / 5040.0f)))))));
+    return series * fromBits((truncToInt(whole) + 127) << 23);
+}
+
+// pow(x, e) for x >= 0 and e > 0, with pow(0, e) = 0 like GLSL on every GPU
+template<typename F>
+F lanesPow(F x, F e) {
+    F result = lanesExp2(e * lanesLog2(vmax(x, splat<F>(1e-30f))));
+    return select(x > 0.0f, result, splat<F>(0.0f));
+}
+
+// Covered pixels waiting for shading, in SoA form. The arrays are padded to
+// a whole number of SIMD vectors.
+struct ShadingBatch {
+    std::vector<float> px, py, pz; // FragPos
+    std::vector<float> nx, ny, nz; // Normal, not yet normalized
+    std::vector<float> lx, ly, lz; // Light position
+    std::vector<float> shininess;
+    std::vector<float> r, g, b;    // Shaded colour
+
+    void resize(size_t count) {
+        for (std::vector<float>* array : {&px, &py, &pz, &nx, &ny, &nz, &lx, &ly, &lz, &shininess, &r, &g, &b})
+            array->resize(count);
+    }
+};
+
+// Phong or Blinn-Phong shading with the same ambient, diffuse and
+// specular terms as fragmentShaderSource, F lanes at a time. color is the
+// light colour times the object colour.
+template<typename F>
+void shadeBatch(ShadingBatch& batch, size_t count, const glm::vec3& viewPos, const glm::vec3& color,
+                SpecularModel specular) {
+    const size_t lanes = sizeof(F) / sizeof(float);
+    for (size_t i = 0; i < count; i += lanes) {
+        F px, py, pz, nx, ny, nz, lx, ly, lz, shininess;
+        loadLanes(&batch.px[i], px);
+        loadLanes(&batch.py[i], py);
+        loadLanes(&batch.pz[i], pz);
+        loadLanes(&batch.nx[i], nx);
+        loadLanes(&batch.ny[i], ny);
+        loadLanes(&batch.nz[i], nz);
+        loadLanes(&batch.lx[i], lx);
+        loadLanes(&batch.ly[i], ly);
+        loadLanes(&batch.lz[i], lz);
+        loadLanes(&batch.shininess[i], shininess);
+
+        // Diffuse lighting
+        F normScale = 1.0f / vsqrt(nx * nx + ny * ny + nz * nz);
+        nx = nx * normScale;
+        ny = ny * normScale;
+        nz = nz * normScale;
+        F ldx = lx - px, ldy = ly - py, ldz = lz - pz;
+        F lightScale = 1.0f / vsqrt(ldx * ldx + ldy * ldy + ldz * ldz);
+        ldx = ldx * lightScale;
+        ldy = ldy * lightScale;
+        ldz = ldz * lightScale;
+        F normDotLight = nx * ldx + ny * ldy + nz * ldz;
+        F diff = vmax(normDotLight, splat<F>(0.0f));
+
+        // Specular lighting, reflect(-lightDir, norm) = 2 * dot(N, L) * N - L
+        F vx = viewPos.x - px, vy = viewPos.y - py, vz = viewPos.z - pz;
+        F viewScale = 1.0f / vsqrt(vx * vx + vy * vy + vz * vz);
+        F spec;
+        if (specular == SpecularModel::BlinnPhong) {
+            // Half vector between the light and view directions
+            F hx = ldx + vx * viewScale, hy = ldy + vy * viewScale, hz = ldz + vz * viewScale;
+            F normDotHalf = (nx * hx + ny * hy + nz * hz) / vsqrt(hx * hx + hy * hy + hz * hz);
+            spec = lanesPow(vmax(normDotHalf, splat<F>(0.0f)), shininess * 4.0f);
+        } else {
+            F rx = 2.0f * normDotLight * nx - ldx;
+            F ry = 2.0f * normDotLight * ny - ldy;
+            F rz = 2.0f * normDotLight * nz - ldz;
+            F viewDotReflect = (vx * rx + vy * ry + vz * rz) * viewScale;
+            spec = lanesPow(vmax(viewDotReflect, splat<F>(0.0f)), shininess);
+        }
+
+        // Combine results
+        F light = 0.1f + diff + 0.5f * spec;
+        storeLanes(&batch.r[i], light * color.r);
+        storeLanes(&batch.g[i], light * color.g);
+        storeLanes(&batch.b[i], light * color.b);
+    }
+}
+
+// Float colour to 8 bits the way GL converts to a UNORM8 target
+inline uint8_t toUnorm8(float value) {
+    return (uint8_t)(std::min(std::max(value, 0.0f), 1.0f) * 255.0f + 0.5f);
+}
+
+// Screen-space triangle ready for rasterization
+struct SoftwareTriangle {
+    glm::vec2 screen[3];
+    float depth[3];
+    float invW[3];
+    glm::vec3 world[3];
+    glm::vec3 normal[3];
+    int cube;
+};
+
+struct ClipVertex {
+    glm::vec4 clip;
+    glm::vec3 world;
+    glm::vec3 normal;
+};
+
+// Clip a triangle against the near plane (z >= -w), giving 0, 1 or 2 triangles
+int clipNear(const ClipVertex input[3], ClipVertex output[6]) {
+    ClipVertex polygon[4];
+    int count = 0;
+    for (int i = 0; i < 3; i++) {
+        const ClipVertex& a = input[i];
+        const ClipVertex& b = input[(i + 1) % 3];
+        float da = a.clip.z + a.clip.w;
+        float db = b.clip.z + b.clip.w;
+        if (da >= 0.0f)
+            polygon[count++] = a;
+        if ((da >= 0.0f) != (db >= 0.0f)) {
+            float t = da / (da - db);
+            polygon[count++] = ClipVertex{a.clip + (b.clip - a.clip) * t, a.world + (b.world - a.world) * t,
+                                          a.normal + (b.normal - a.normal) * t};
+        }
+    }
+    if (count < 3)
+        return 0;
+    output[0] = polygon[0];
+    output[1] = polygon[1];
+    output[2] = polygon[2];
+    if (count == 3)
+        return 1;
+    output[3] = polygon[0];
+    output[4] = polygon[2];
+    output[5] = polygon[3];
+    return 2;
+}
+
+// Side length of the square screen tiles the software renderer works in
+const int SOFTWARE_TILE_SIZE = 32;
+
+// CPU reference renderer for the scene Renderer draws, independent of any GL
+// implementation. Cubes are transformed and binned into screen tiles in
+// parallel chunks; each tile is then rasterized with a depth buffer and its
+// visible pixels shaded in one SIMD batch. Returns tightly packed RGB rows,
+// top row first, like Framebuffer::readPixels. The scene gives the camera
+// and colours, cubes its cubes at rest.
+std::vector<uint8_t> renderSoftware(const Options& options, const SceneData& scene,
+                                    const std::vector<CubeInstance>& cubes, int width, int height, ThreadPool& pool) {
+    const SceneCamera& camera = scene.camera;
+    glm::vec3 cameraPos = computeCameraPos(camera, camera.angle, options.zoom);
+    glm::mat4 viewProjection = computeProjection(camera, width, height) * computeView(camera, cameraPos);
+    glm::vec3 viewPos = camera.fixedEye ? camera.eye : cameraPos;
+    glm::vec3 color = scene.lightColor * scene.objectColor;
+
+    int tilesX = (width + SOFTWARE_TILE_SIZE - 1) / SOFTWARE_TILE_SIZE;
+    int tilesY = (height + SOFTWARE_TILE_SIZE - 1) / SOFTWARE_TILE_SIZE;
+    int tileCount = tilesX * tilesY;
+
+    // Geometry and binning, in chunks of consecutive cubes so that walking
+    // the chunks in order keeps the original draw order
+    int chunkCount = std::min((int)cubes.size(), pool.size() * 4);
+    std::vector<std::vector<SoftwareTriangle>> triangles(chunkCount);
+    std::vector<std::vector<std::vector<int>>> bins(chunkCount, std::vector<std::vector<int>>(tileCount));
+    const size_t vertexCount = sizeof(vertices) / (6 * sizeof(float));
+
+    pool.parallelFor(chunkCount, [&](int chunk) {
+        size_t begin = cubes.size() * chunk / chunkCount;
+        size_t end = cubes.size() * (chunk + 1) / chunkCount;
+        for (size_t c = begin; c < end; c++) {
+            const CubeInstance& cube = cubes[c];
+            glm::mat4 modelViewProjection = viewProjection * cube.model;
+            for (size_t v = 0; v < vertexCount; v += 3) {
+                ClipVertex corners[3];
+                for (int k = 0; k < 3; k++) {
+                    const float* vertex = vertices + (v + k) * 6;
+                    glm::vec4 position(vertex[0], vertex[1], vertex[2], 1.0f);
+                    corners[k].clip = modelViewProjection * position;
+                    corners[k].world = glm::vec3(cube.model * position);
+                    corners[k].normal = cube.normalMatrix * glm::vec3(vertex[3], vertex[4], vertex[5]);
+                }
+
+                // Skip triangles entirely outside one of the side planes
+                bool outside = false;
+                for (int axis = 0; axis < 2 && !outside; axis++) {
+                    outside = (corners[0].clip[axis] > corners[0].clip.w && corners[1].clip[axis] > corners[1].clip.w &&
+                               corners[2].clip[axis] > corners[2].clip.w) ||
+                              (corners[0].clip[axis] < -corners[0].clip.w && corners[1].clip[axis] < -corners[1].clip.w &&
+                               corners[2].clip[axis] < -corners[2].clip.w);
+                }
+                if (outside)
+                    continue;
+
+                ClipVertex clipped[6];
+                int clippedCount = clipNear(corners, clipped);
+                for (int t = 0; t < clippedCount; t++) {
+                    SoftwareTriangle triangle;
+                    triangle.cube = (int)c;
+                    glm::vec2 minimum(1e30f), maximum(-1e30f);
+                    for (int k = 0; k < 3; k++) {
+                        const ClipVertex& corner = clipped[t * 3 + k];
+                        float invW = 1.0f / corner.clip.w;
+                        glm::vec3 ndc = glm::vec3(corner.clip) * invW;
+                        triangle.screen[k] = glm::vec2((ndc.x * 0.5f + 0.5f) * width, (ndc.y * 0.5f + 0.5f) * height);
+                        triangle.depth[k] = ndc.z * 0.5f + 0.5f;
+                        triangle.invW[k] = invW;
+                        triangle.world[k] = corner.world;
+                        triangle.normal[k] = corner.normal;
+                        minimum = glm::min(minimum, triangle.screen[k]);
+                        maximum = glm::max(maximum, triangle.screen[k]);
+                    }
+
+                    int tileX0 = std::max(0, (int)std::floor(minimum.x) / SOFTWARE_TILE_SIZE);
+                    int tileY0 = std::max(0, (int)std::floor(minimum.y) / SOFTWARE_TILE_SIZE);
+                    int tileX1 = std::min(tilesX - 1, (int)std::floor(maximum.x) / SOFTWARE_TILE_SIZE);
+                    int tileY1 = std::min(tilesY - 1, (int)std::floor(maximum.y) / SOFTWARE_TILE_SIZE);
+                    if (tileX0 > tileX1 || tileY0 > tileY1)
+                        continue;
+
+                    int index = (int)triangles[chunk].size();
+                    triangles[chunk].push_back(triangle);
+                    for (int ty = tileY0; ty <= tileY1; ty++)
+                        for (int tx = tileX0; tx <= tileX1; tx++)
+                            bins[chunk][ty * tilesX + tx].push_back(index);
+                }
+            }
+        }
+    });
+
+    std::vector<uint8_t> pixels((size_t)width * height * 3);
+    uint8_t clear[3] = {toUnorm8(scene.clearColor.r), toUnorm8(scene.clearColor.g), toUnorm8(scene.clearColor.b)};
+
+    pool.parallelFor(tileCount, [&](int tile) {
+        int x0 = (tile % tilesX) * SOFTWARE_TILE_SIZE;
+        int y0 = (tile / tilesX) * SOFTWARE_TILE_SIZE;
+        int x1 = std::min(x0 + SOFTWARE_TILE_SIZE, width);
+        int y1 = std::min(y0 + SOFTWARE_TILE_SIZE, height);
+        const int pixelCount = SOFTWARE_TILE_SIZE * SOFTWARE_TILE_SIZE;
+
+        // Visibility: nearest triangle and its barycentrics per pixel
+        float depth[pixelCount];
+        const SoftwareTriangle* visible[pixelCount];
+        glm::vec3 weights[pixelCount];
+        std::fill(depth, depth + pixelCount, 1.0f);
+        std::fill(visible, visible + pixelCount, nullptr);
+
+        for (int chunk = 0; chunk < chunkCount; chunk++) {
+            for (int index : bins[chunk][tile]) {
+                const SoftwareTriangle& triangle = triangles[chunk][index];
+                const glm::vec2* v = triangle.screen;
+                float area = (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[1].y - v[0].y) * (v[2].x - v[0].x);
+                if (area == 0.0f)
+                    continue;
+
+                // Edge i is opposite vertex i, oriented so inside is positive
+                float sign = area > 0.0f ? 1.0f : -1.0f;
+                float edgeA[3], edgeB[3];
+                bool inclusive[3];
+                for (int e = 0; e < 3; e++) {
+                    const glm::vec2& a = v[(e + 1) % 3];
+                    const glm::vec2& b = v[(e + 2) % 3];
+                    edgeA[e] = -(b.y - a.y) * sign;
+                    edgeB[e] = (b.x - a.x) * sign;
+                    // Top-left rule so shared edges are covered exactly once
+                    inclusive[e] = edgeA[e] > 0.0f || (edgeA[e] == 0.0f && edgeB[e] < 0.0f);
+                }
+                float invArea = 1.0f / (area * sign);
+
+                float minX = std::min({v[0].x, v[1].x, v[2].x}), maxX = std::max({v[0].x, v[1].x, v[2].x});
+                float minY = std::min({v[0].y, v[1].y, v[2].y}), maxY = std::max({v[0].y, v[1].y, v[2].y});
+                int px0 = std::max(x0, (int)std::floor(minX - 0.5f));
+                int px1 = std::min(x1 - 1, (int)std::ceil(maxX - 0.5f));
+                int py0 = std::max(y0, (int)std::floor(minY - 0.5f));
+                int py1 = std::min(y1 - 1, (int)std::ceil(maxY - 0.5f));
+
+                for (int y = py0; y <= py1; y++) {
+                    float sampleY = y + 0.5f;
+                    for (int x = px0; x <= px1; x++) {
+                        float sampleX = x + 0.5f;
+                        float w[3];
+                        bool inside = true;
+                        for (int e = 0; e < 3 && inside; e++) {
+                            // Relative to the edge's start, which keeps small, distant
+                            // triangles precise enough to resolve their depth order
+                            const glm::vec2& start = v[(e + 1) % 3];
+                            w[e] = edgeA[e] * (sampleX - start.x) + edgeB[e] * (sampleY - start.y);
+                            inside = w[e] > 0.0f || (w[e] == 0.0f && inclusive[e]);
+                        }
+                        if (!inside)
+                            continue;
+
+                        glm::vec3 lambda(w[0] * invArea, w[1] * invArea, w[2] * invArea);
+                        float z = triangle.depth[0] + lambda.y * (triangle.depth[1] - triangle.depth[0]) +
+                                  lambda.z * (triangle.depth[2] - triangle.depth[0]);
+                        int p = (y - y0) * SOFTWARE_TILE_SIZE + (x - x0);
+                        if (z < depth[p] && z >= 0.0f) {
+                            depth[p] = z;
+                            visible[p] = &triangle;
+                            weights[p] = lambda;
+                        }
+                    }
+                }
+            }
+        }
+
+        // Gather visible pixels into a shading batch
+        thread_local ShadingBatch batch;
+        batch.resize(pixelCount);
+        int pixelIndex[pixelCount];
+        size_t count = 0;
+        for (int p = 0; p < pixelCount; p++) {
+            const SoftwareTriangle* triangle = visible[p];
+            if (!triangle)
+                continue;
+            // Perspective-correct interpolation weights
+            glm::vec3 perspective = weights[p] * glm::vec3(triangle->invW[0], triangle->invW[1], triangle->invW[2]);
+            perspective /= perspective.x + perspective.y + perspective.z;
+            glm::vec3 world = triangle->world[0] * perspective.x + triangle->world[1] * perspective.y +
+                              triangle->world[2] * perspective.z;
+            glm::vec3 normal = triangle->normal[0] * perspective.x + triangle->normal[1] * perspective.y +
+                               triangle->normal[2] * perspective.z;
+            const CubeInstance& cube = cubes[triangle->cube];
+            batch.px[count] = world.x;
+            batch.py[count] = world.y;
+            batch.pz[count] = world.z;
+            batch.nx[count] = normal.x;
+            batch.ny[count] = normal.y;
+            batch.nz[count] = normal.z;
+            batch.lx[count] = cube.lightPos.x;
+            batch.ly[count] = cube.lightPos.y;
+            batch.lz[count] = cube.lightPos.z;
+            batch.shininess[count] = cube.shininess;
+            pixelIndex[count++] = p;
+        }
+
+#ifdef SHINE_SIMD
+        if (options.simd) {
+            // Pad the last vector with copies of the last pixel
+            size_t padded = (count + SIMD_LANES - 1) / SIMD_LANES * SIMD_LANES;
+            for (size_t i = count; i < padded; i++) {
+                for (std::vector<float>* array : {&batch.px, &batch.py, &batch.pz, &batch.nx, &batch.ny, &batch.nz,
+                                                  &batch.lx, &batch.ly, &batch.lz, &batch.shininess})
+                    (*array)[i] = (*array)[i - 1];
+            }
+            shadeBatch<SimdFloat>(batch, count, viewPos, color, options.specular);
+        } else
+#endif
+        {
+            shadeBatch<float>(batch, count, viewPos, color, options.specular);
+        }
+
+        // Write the tile, GL's bottom-up rows flipped to top-down
+        for (int y = y0; y < y1; y++) {
+            uint8_t* row = pixels.data() + (size_t)(height - 1 - y) * width * 3;
+            for (int x = x0; x < x1; x++) {
+                std::memcpy(row + x * 3, clear, 3);
+            }
+        }
+        for (size_t i = 0; i < count; i++) {
+            int p = pixelIndex[i];
+            int x = x0 + p % SOFTWARE_TILE_SIZE;
+            int y = y0 + p / SOFTWARE_TILE_SIZE;
+            uint8_t* pixel = pixels.data() + ((size_t)(height - 1 - y) * width + x) * 3;
+            pixel[0] = toUnorm8(batch.r[i]);
+            pixel[1] = toUnorm8(batch.g[i]);
+            pixel[2] = toUnorm8(batch.b[i]);
+        }
+    });
+    return pixels;
+}
+
+// Dynamic resolution controller: picks the share of the output's width and
+// height to render, from the time the frames take. Fill cost goes with the
+// pixel count, so the scale follows the square root of the time ratio,
+// aiming 10% under the target. It drops as soon as a frame runs over but
+// rises by at most 5% a frame, and only with 20% of the target to spare,
+// so it settles instead of oscillating. Scales are multiples of 1/32 to
+// keep the viewport from changing size every frame.
+const float DYNAMIC_RESOLUTION_MIN_SCALE = 0.25f;
+
+class ResolutionController {
+public:
+    explicit ResolutionController(double targetMs) : target(targetMs) {}
+
+    // Account for the time of the frame just rendered at getScale()
+    void update(double frameMs);
+    // Forget the frame counts, keeping the scale
+    void resetStats();
+
+    float getScale() const { return scale; }
+    // A size of the output scaled for rendering
+    int scaled(int size) const { return std::max(1, (int)std::lround(size * scale)); }
+    double getTarget() const { return target; }
+    int getFrames() const { return frames; }
+    // Share of the frames that met the target
+    double getHitRate() const { return frames ? (double)hits / frames : 0.0; }
+    double getMeanScale() const { return frames ? scaleSum / frames : scale; }
+
+private:
+    double target;
+    float scale = 1.0f;
+    int cooldown = 0;
+    int frames = 0;
+    int hits = 0;
+    double scaleSum = 0.0;
+};
+
+void ResolutionController::update(double frameMs) {
+    frames++;
+    scaleSum += scale;
+    if (frameMs <= target)
+        hits++;
+    // Frames already in flight when the scale changed do not show it yet
+    if (cooldown > 0) {
+        cooldown--;
+        return;
+    }
+
+    double ratio = std::sqrt(0.9 * target / std::max(frameMs, 0.001));
+    float next = scale;
+    if (frameMs > target)
+        next = std::floor(scale * (float)std::max(ratio, 0.5) * 32.0f) / 32.0f;
+    else if (frameMs < 0.8 * target)
+        next = std::ceil(scale * (float)std::min(ratio, 1.05) * 32.0f) / 32.0f;
+    next = std::clamp(next, DYNAMIC_RESOLUTION_MIN_SCALE, 1.0f);
+    if (next != scale) {
+        scale = next;
+        cooldown = 2;
+    }
+}
+
+void ResolutionController::resetStats() {
+    frames = hits = 0;
+    scaleSum = 0.0;
+}
+
+// Lock-free single-producer single-consumer triple buffer. The writer fills
+// back() and publishes it into the middle slot; the reader swaps a newly
+// published middle slot for its front one. Neither side ever waits, and
+// the reader always gets the latest whole value.
+template <typename T>
+class TripleBuffer {
+public:
+    // Writer side
+    T& back() { return slots[backSlot]; }
+    void publish() { backSlot = middle.exchange(backSlot | FRESH, std::memory_order_acq_rel) & SLOT; }
+
+    // Reader side. True if a value was published since the last call, which
+    // front() then returns.
+    bool update() {
+        if (!(middle.load(std::memory_order_relaxed) & FRESH))
+            return false;
+        frontSlot = middle.exchange(frontSlot, std::memory_order_acq_rel) & SLOT;
+        return true;
+    }
+    bool fresh() const { return middle.load(std::memory_order_relaxed) & FRESH; }
+    const T& front() const { return slots[frontSlot]; }
+
+private:
+    static const int SLOT = 3;
+    static const int FRESH = 4;
+
+    T slots[3] = {};
+    int backSlot = 0;
+    std::atomic<int> middle{1};
+    int frontSlot = 2;
+};
+
+// What the render thread needs for a frame, published by the main thread
+// whenever input or the window changed it. Copied whole, so the render
+// thread never sees half an update.
+struct FrameSnapshot {
+    int width = 0; // Framebuffer size
+    int height = 0;
+    float orbit = 0.0f; // Camera, see Renderer::setCamera
+    float zoom = 1.0f;
+    bool deferred = false;
+    uint64_t sceneVersion = 0;   // Changes when the scene must be rendered again
+    uint64_t presentVersion = 0; // Changes when the window must be refreshed
+    // Steady clock of the oldest input not yet on screen, 0 if none
+    int64_t inputTime = 0;
+};
+
+// Dynamic resolution state for the window title, published by the render
+// thread
+struct RenderStatus {
+    float scale = 1.0f;
+    int width = 0;
+    int height = 0;
+    double hitRate = 0.0;
+};
+
+// Shared by the main thread and the render thread
+struct WindowChannel {
+    TripleBuffer<FrameSnapshot> snapshots;
+    TripleBuffer<RenderStatus> status;
+    // inputTime of the last snapshot whose frame was presented
+    std::atomic<int64_t> shownInput{0};
+    std::atomic<bool> quit{false};
+    std::atomic<bool> failed{false};
+    // Only for the render thread to sleep on while it has nothing to draw;
+    // snapshots themselves never take the lock
+    std::mutex idleMutex;
+    std::condition_variable idle;
+
+    void wakeRenderThread() {
+        { std::lock_guard<std::mutex> lock(idleMutex); }
+        idle.notify_one();
+    }
+};
+
+int64_t steadyNanoseconds() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Window state shared with the GLFW callbacks, main thread only
+struct WindowState {
+    WindowChannel* channel = nullptr;
+    bool clusteredLighting = false; // Deferred shading can be toggled
+    FrameSnapshot next;             // Published when changed
+    bool changed = true;
+
+    // Input changed the scene: it has to be rendered again, and the frame
+    // showing it measures the latency from the oldest input not yet shown
+    void sceneInput() {
+        next.sceneVersion++;
+        if (next.inputTime == 0 || channel->shownInput.load() >= next.inputTime)
+            next.inputTime = steadyNanoseconds();
+        changed = true;
+    }
+};
+
+void framebuffer_size_callback(GLFWwindow* window, int width, int height) {
+    WindowState* state = (WindowState*)glfwGetWindowUserPointer(window);
+    state->next.sceneVersion++;
+    state->changed = true;
+}
+
+// The window system lost the window contents (exposed, restored, ...)
+void window_refresh_callback(GLFWwindow* window) {
+    WindowState* state = (WindowState*)glfwGetWindowUserPointer(window);
+    state->next.presentVersion++;
+    state->changed = true;
+}
+
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+    if (action == GLFW_RELEASE)
+        return;
+    WindowState* state = (WindowState*)glfwGetWindowUserPointer(window);
+    if (key == GLFW_KEY_LEFT || key == GLFW_KEY_RIGHT) {
+        state->next.orbit += key == GLFW_KEY_LEFT ? -5.0f : 5.0f;
+        state->sceneInput();
+    } else if (key == GLFW_KEY_UP || key == GLFW_KEY_DOWN) {
+        state->next.zoom *= key == GLFW_KEY_UP ? 1.25f : 0.8f;
+        state->sceneInput();
+    } else if (key == GLFW_KEY_G && action == GLFW_PRESS && state->clusteredLighting) {
+        state->next.deferred = !state->next.deferred;
+        state->sceneInput();
+    }
+}
+
+// Load GL entry points for the current context
+bool initGLEW() {
+    glewExperimental = GL_TRUE;
+    GLenum result = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    // GLX builds of GLEW report this under EGL even though the GL entry
+    // points themselves loaded fine
+    if (result == GLEW_ERROR_NO_GLX_DISPLAY)
+        result = GLEW_OK;
+#endif
+    if (result != GLEW_OK) {
+        std::cerr << "Failed to initialize GLEW" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Call after FrameCapture::destroy, once every frame has been written
+void reportCapture(const Options& options, const FrameCapture& capture) {
+    std::cout << "Captured " << capture.getWritten() << " frame(s) to " << options.capture << " ("
+              << capture.getDropped() << " dropped, " << capture.getLate() << " late)" << std::endl;
+}
+
+// The render thread owns the GL context. It renders the latest snapshot
+// into a frame cache when the scene changed, or every frame when
+// continuous, and presents the cache at the pace of options.presentMode.
+void renderLoop(GLFWwindow* window, const Options& options, WindowChannel& channel) {
+    TRACE_THREAD("Render");
+    glfwMakeContextCurrent(window);
+    glfwSwapInterval(options.presentMode == PresentMode::Vsync ? 1 : 0);
+
+    Renderer renderer;
+    if (!renderer.create(options)) {
+        channel.failed = true;
+        glfwPostEmptyEvent();
+        glfwMakeContextCurrent(nullptr);
+        return;
+    }
+    TRACE_GPU_START();
+
+    // The scene is rendered into this cache only when something changed and
+    // is otherwise just copied to the window
+    Framebuffer frameCache;
+
+    // With a frame budget the scene is rendered into scaledFrame at the
+    // controller's resolution and stretched over the cache. The main thread
+    // shows the scale and how many frames met the budget in the title.
+    bool dynamicResolution = options.targetFrameMs > 0.0f;
+    ResolutionController resolution(options.targetFrameMs);
+    Framebuffer scaledFrame;
+    double statusTime = 0.0;
+
+    // Recording, animation and dynamic resolution redraw every frame. The
+    // capture stream size is fixed by the first frame.
+    FrameCapture capture;
+    bool capturing = false;
+    bool continuous = options.continuous || !options.capture.empty() || options.animate || dynamicResolution;
+
+    // Capped presents are spaced by sleeping until the next deadline; a late
+    // frame moves the schedule instead of rushing the frames after it
+    auto framePeriod = std::chrono::nanoseconds(1000000000 / options.maxFps);
+    auto nextPresent = std::chrono::steady_clock::now();
+
+    uint64_t renderedScene = UINT64_MAX;
+    uint64_t presentedVersion = UINT64_MAX;
+    bool deferred = renderer.isDeferred();
+    int64_t shownInput = 0;
+    int latencyFrames = 0;
+    double latencySum = 0.0, latencyMax = 0.0;
+
+    while (!channel.quit.load()) {
+        // Sleep until the main thread publishes, unless redrawing anyway.
+        // Occlusion culling takes a frame or two more to apply to a new view.
+        bool fresh = channel.snapshots.update();
+        const FrameSnapshot& snapshot = channel.snapshots.front();
+        bool minimized = snapshot.width <= 0 || snapshot.height <= 0;
+        bool redraw = continuous || renderer.isOcclusionPending();
+        if (!fresh && (!redraw || minimized)) {
+            std::unique_lock<std::mutex> lock(channel.idleMutex);
+            channel.idle.wait(lock, [&] { return channel.snapshots.fresh() || channel.quit.load(); });
+            continue;
+        }
+        if (minimized)
+            continue;
+
+        TRACE_ZONE("Frame");
+        bool presentNeeded = snapshot.presentVersion != presentedVersion;
+        presentedVersion = snapshot.presentVersion;
+        if (snapshot.width != frameCache.getWidth() || snapshot.height != frameCache.getHeight()) {
+            frameCache.destroy();
+            if (!frameCache.create(snapshot.width, snapshot.height))
+                break;
+            if (dynamicResolution) {
+                scaledFrame.destroy();
+                if (!scaledFrame.create(snapshot.width, snapshot.height))
+                    break;
+            }
+            renderedScene = UINT64_MAX;
+        }
+
+        if (snapshot.sceneVersion != renderedScene || redraw) {
+            renderer.setCamera(snapshot.orbit, snapshot.zoom);
+            if (snapshot.deferred != deferred) {
+                deferred = snapshot.deferred;
+                renderer.setDeferred(deferred);
+                std::cout << "Shading: " << (renderer.isDeferred() ? "deferred" : "forward") << std::endl;
+            }
+            renderer.setTime((float)glfwGetTime());
+            if (dynamicResolution) {
+                auto frameStart = std::chrono::steady_clock::now();
+                int renderWidth = resolution.scaled(snapshot.width);
+                int renderHeight = resolution.scaled(snapshot.height);
+                scaledFrame.bind();
+                renderer.render(renderWidth, renderHeight);
+                scaledFrame.upscaleTo(frameCache, renderWidth, renderHeight);
+                // Finished before presenting, so the controller sees the
+                // frame's whole cost rather than the wait for vsync
+                glFinish();
+                resolution.update(
+                    std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count());
+
+                if (glfwGetTime() - statusTime >= 0.5) {
+                    statusTime = glfwGetTime();
+                    channel.status.back() = RenderStatus{resolution.getScale(), resolution.scaled(snapshot.width),
+                                                         resolution.scaled(snapshot.height), resolution.getHitRate()};
+                    channel.status.publish();
+                    glfwPostEmptyEvent();
+                    resolution.resetStats();
+                }
+            } else {
+                frameCache.bind();
+                renderer.render(snapshot.width, snapshot.height);
+            }
+            renderedScene = snapshot.sceneVersion;
+            presentNeeded = true;
+
+            if (!options.capture.empty() && !capturing) {
+                capturing = capture.create(options.capture, snapshot.width, snapshot.height, options.captureFps);
+                if (!capturing)
+                    break;
+            }
+            if (capturing)
+                capture.capture(frameCache);
+        }
+
+        if (presentNeeded) {
+            if (options.presentMode == PresentMode::Capped) {
+                TRACE_ZONE("Pace");
+                std::this_thread::sleep_until(nextPresent);
+                nextPresent = std::max(nextPresent + framePeriod, std::chrono::steady_clock::now());
+            }
+            {
+                TRACE_ZONE("glfwSwapBuffers");
+                TRACE_GPU_ZONE("Present");
+                frameCache.blitToScreen();
+                glfwSwapBuffers(window);
+            }
+            // Input to photon: the swapped frame is finished, as close to
+            // reaching the screen as the driver lets us see
+            if (snapshot.inputTime != 0 && snapshot.inputTime != shownInput) {
+                glFinish();
+                double latency = (steadyNanoseconds() - snapshot.inputTime) / 1.0e6;
+                latencyFrames++;
+                latencySum += latency;
+                latencyMax = std::max(latencyMax, latency);
+                shownInput = snapshot.inputTime;
+                channel.shownInput.store(shownInput);
+            }
+        }
+        TRACE_COLLECT();
+    }
+    if (!channel.quit.load()) {
+        channel.failed = true;
+        glfwPostEmptyEvent();
+    }
+
+    // Cleanup
+    TRACE_GPU_STOP();
+    capture.destroy();
+    if (capturing)
+        reportCapture(options, capture);
+    if (latencyFrames > 0)
+        std::printf("Input to photon: %d input frame(s), mean %.1f ms, max %.1f ms\n", latencyFrames,
+                    latencySum / latencyFrames, latencyMax);
+    frameCache.destroy();
+    scaledFrame.destroy();
+    renderer.destroy();
+    glfwMakeContextCurrent(nullptr);
+}
+
+int runWindowed(const Options& options) {
+    // Initialize GLFW
+    if (!glfwInit()) {
+        std::cerr << "Failed to initialize GLFW" << std::endl;
+        return -1;
+    }
+
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 #ifdef __APPLE__
@@ -184,126 +6874,923 @@ int main() {
         return -1;
     }
     glfwMakeContextCurrent(window);
+
+    // Initialize GLEW, then hand the context over to the render thread
+    if (!initGLEW()) {
+        glfwTerminate();
+        return -1;
+    }
+    glfwMakeContextCurrent(nullptr);
+
+    WindowChannel channel;
+    WindowState state;
+    state.channel = &channel;
+    state.clusteredLighting = options.clusteredLighting;
+    state.next.deferred = options.deferred && options.clusteredLighting;
+    glfwSetWindowUserPointer(window, &state);
     glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+    glfwSetWindowRefreshCallback(window, window_refresh_callback);
+    glfwSetKeyCallback(window, key_callback);
+
+    std::thread renderThread(renderLoop, window, std::cref(options), std::ref(channel));
+
+    // The main thread only handles events and publishes the snapshots they
+    // change, sleeping in glfwWaitEvents until input arrives or the render
+    // thread has news for the title
+    while (!glfwWindowShouldClose(window) && !channel.failed.load()) {
+        {
+            TRACE_ZONE("processInput");
+            processInput(window);
+        }
+
+        int width, height;
+        glfwGetFramebufferSize(window, &width, &height);
+        if (width != state.next.width || height != state.next.height) {
+            state.next.width = width;
+            state.next.height = height;
+            state.changed = true;
+        }
+        if (state.changed) {
+            channel.snapshots.back() = state.next;
+            channel.snapshots.publish();
+            channel.wakeRenderThread();
+            state.changed = false;
+        }
+
+        if (channel.status.update()) {
+            const RenderStatus& status = channel.status.front();
+            char title[160];
+            std::snprintf(title, sizeof(title),
+                          "Specular Lighting Demo - %d%% resolution (%dx%d), %d%% of frames within %.1f ms",
+                          (int)std::lround(status.scale * 100.0f), status.width, status.height,
+                          (int)std::lround(status.hitRate * 100.0), options.targetFrameMs);
+            glfwSetWindowTitle(window, title);
+        }
+
+        TRACE_ZONE("glfwWaitEvents");
+        glfwWaitEvents();
+    }
+
+    // Cleanup
+    channel.quit = true;
+    channel.wakeRenderThread();
+    renderThread.join();
+    glfwTerminate();
+    return channel.failed.load() ? -1 : 0;
+}
+
+int runHeadless(const Options& options) {
+    auto startTime = std::chrono::steady_clock::now();
+    HeadlessContext context;
+    if (!context.create())
+        return -1;
 
     // Initialize GLEW
-    glewExperimental = GL_TRUE;
-    if (glewInit() != GLEW_OK) {
-        std::cerr << "Failed to initialize GLEW" << std::endl;
+    if (!initGLEW()) {
+        context.destroy();
         return -1;
     }
+    std::cout << "Headless renderer: " << glGetString(GL_RENDERER) << " (OpenGL "
+              << glGetString(GL_VERSION) << ")" << std::endl;
 
-    // Configure global OpenGL state
-    glEnable(GL_DEPTH_TEST);
+    Framebuffer target;
+    if (!target.create(options.width, options.height)) {
+        context.destroy();
+        return -1;
+    }
+
+    Renderer renderer;
+    if (!renderer.create(options)) {
+        target.destroy();
+        context.destroy();
+        return -1;
+    }
+    if (!options.sceneFile.empty())
+        std::cout << "Scene: " << renderer.getCubeCount() << " cube(s) and " << renderer.getLightCount()
+                  << " light(s) loaded from " << options.sceneFile << " in " << renderer.getSceneLoadTime() << " ms"
+                  << std::endl;
 
-    // Create and compile shaders
-    unsigned int shaderProgram = createShaderProgram(vertexShaderSource, fragmentShaderSource);
+    FrameCapture capture;
+    if (!options.capture.empty() &&
+        !capture.create(options.capture, options.width, options.height, options.captureFps)) {
+        renderer.destroy();
+        target.destroy();
+        context.destroy();
+        return -1;
+    }
 
-    // Set up vertex data
-    unsigned int VBO, VAO;
-    glGenVertexArrays(1, &VAO);
-    glGenBuffers(1, &VBO);
+    // With a frame budget every frame is rendered into scaledTarget, at the
+    // controller's resolution, and finished so the controller sees its
+    // whole cost. The first frame includes startup and is left out.
+    bool dynamicResolution = options.targetFrameMs > 0.0f;
+    ResolutionController resolution(options.targetFrameMs);
+    Framebuffer scaledTarget;
+    if (dynamicResolution && !scaledTarget.create(options.width, options.height)) {
+        capture.destroy();
+        renderer.destroy();
+        target.destroy();
+        context.destroy();
+        return -1;
+    }
 
-    glBindVertexArray(VAO);
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+    int frames = options.frames > 0 ? options.frames : 1;
+    double updateTime = 0.0;
+    target.bind();
+    TRACE_GPU_START();
+    for (int frame = 0; frame < frames; frame++) {
+        TRACE_ZONE("Frame");
+        auto frameStart = std::chrono::steady_clock::now();
+        renderer.setTime(frame * ANIMATION_TIME_STEP);
+        if (frame == frames - 1)
+            renderer.measureOverdraw();
+        if (dynamicResolution) {
+            int renderWidth = resolution.scaled(options.width);
+            int renderHeight = resolution.scaled(options.height);
+            scaledTarget.bind();
+            renderer.render(renderWidth, renderHeight);
+            scaledTarget.upscaleTo(target, renderWidth, renderHeight);
+            glFinish();
+            if (frame > 0)
+                resolution.update(
+                    std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count());
+        } else {
+            renderer.render(options.width, options.height);
+        }
+        updateTime += renderer.getUpdateTime();
+        if (!options.capture.empty())
+            capture.capture(target);
+        if (frame == 0) {
+            // Startup is done once the first frame is, since drivers may
+            // finish compiling shaders at their first draw
+            glFinish();
+            std::chrono::duration<double, std::milli> startup = std::chrono::steady_clock::now() - startTime;
+            std::cout << "Startup: " << startup.count() << " ms to the first frame, "
+                      << programCache.hits << " program(s) from the cache, "
+                      << programCache.misses << " compiled" << std::endl;
+        }
+        TRACE_COLLECT();
+    }
 
-    // Position attribute
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(0);
-    // Normal attribute
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(3 * sizeof(float)));
-    glEnableVertexAttribArray(1);
+    capture.destroy();
+    if (!options.capture.empty())
+        reportCapture(options, capture);
+    if (dynamicResolution)
+        std::printf("Dynamic resolution: %.0f%% (%dx%d) at the end, mean %.0f%%, %.0f%% of %d frame(s) within %.1f ms\n",
+                    resolution.getScale() * 100.0f, resolution.scaled(options.width),
+                    resolution.scaled(options.height), resolution.getMeanScale() * 100.0,
+                    resolution.getHitRate() * 100.0, resolution.getFrames(), resolution.getTarget());
+    if (options.animate)
+        std::cout << "Scene update: " << updateTime / frames << " ms per frame on " << renderer.getWorkerThreads()
+                  << " thread(s), " << renderer.getWorkSteals() << " work steal(s)" << std::endl;
+    if (options.animate && (options.instanced || options.clusteredLighting)) {
+        if (renderer.isStreamPersistent())
+            std::cout << "Instance stream: persistent, waited for the GPU in " << renderer.getStreamStalls() << " of "
+                      << frames << " frame(s)" << std::endl;
+        else
+            std::cout << "Instance stream: orphaned" << std::endl;
+    }
+
+    std::vector<uint8_t> pixels;
+    {
+        TRACE_ZONE("Read back");
+        pixels = target.readPixels();
+    }
+    TRACE_GPU_STOP();
+    bool written = writeImage(options.output.c_str(), options.width, options.height, pixels);
+    if (written)
+        std::cout << "Wrote " << frames << " frame(s), last one to " << options.output << std::endl;
+    std::cout << "Drew " << renderer.getVisibleCubes() << " of " << renderer.getCubeCount() << " cubes ("
+              << renderer.getCubeCount() - renderer.getVisibleCubes() << " culled)" << std::endl;
+    const Renderer::SubmitStats& submitted = renderer.getSubmitStats();
+    std::cout << "Render queue: " << submitted.draws << " draw(s) in " << submitted.commands << " command(s) and "
+              << submitted.drawCalls << " draw call(s)" << (submitted.multiDraw ? " (multi-draw indirect)" : "")
+              << ", " << submitted.stateChanges << " state change(s) and " << submitted.apiCalls
+              << " API call(s) in the last frame" << std::endl;
+    Renderer::OverdrawStats overdraw = renderer.getOverdraw();
+    std::printf("Overdraw: %llu fragment(s) shaded over %llu covered pixel(s), %.2f per pixel%s\n",
+                (unsigned long long)overdraw.fragments, (unsigned long long)overdraw.pixels,
+                overdraw.pixels ? (double)overdraw.fragments / overdraw.pixels : 0.0,
+                options.depthPrepass ? " after the depth pre-pass" : "");
+    if (options.occlusionCulling)
+        std::cout << "Occlusion culling: " << renderer.getOccludedCubes() << " of "
+                  << renderer.getVisibleCubes() + renderer.getOccludedCubes() << " cube(s) in the frustum hidden by a "
+                  << renderer.getHiZWidth() << "x" << renderer.getHiZHeight() << " hi-Z pyramid" << std::endl;
+    if (renderer.getBakeCount() > 0)
+        std::cout << "Baked lighting: " << renderer.getBakeWidth() << "x" << renderer.getBakeHeight()
+                  << " lightmap, " << renderer.getBakeBytes() / 1024 << " KiB, baked " << renderer.getBakeCount()
+                  << " time(s), last in " << renderer.getBakeTime() << " ms" << std::endl;
+    if (renderer.isDeferred())
+        std::cout << "Deferred shading: " << GBuffer::BYTES_PER_PIXEL << " byte(s) per pixel, "
+                  << renderer.getGBufferBytes() / 1024 << " KiB G-buffer" << std::endl;
+
+    // Cleanup
+    renderer.destroy();
+    scaledTarget.destroy();
+    target.destroy();
+    context.destroy();
+    return written ? 0 : -1;
+}
+
+int simdLanes(const Options& options) {
+#ifdef SHINE_SIMD
+    if (options.simd)
+        return SIMD_LANES;
+#endif
+    return 1;
+}
+
+int runSoftware(const Options& options) {
+    if (options.clusteredLighting) {
+        std::cerr << "The software renderer does not support --clustered-lights or --deferred" << std::endl;
+        return -1;
+    }
+    if (options.animate) {
+        std::cerr << "The software renderer does not support --animate" << std::endl;
+        return -1;
+    }
+    ThreadPool pool(workerThreadCount(options));
+    SceneData scene;
+    if (!createScene(options, scene, pool))
+        return -1;
+    std::vector<CubeInstance> cubes = poseAtRest(scene, pool);
+    std::cout << "Software renderer: " << pool.size() << " thread(s), " << simdLanes(options)
+              << " shading lane(s)" << std::endl;
+
+    int frames = options.frames > 0 ? options.frames : 1;
+    std::vector<uint8_t> pixels;
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; frame++)
+        pixels = renderSoftware(options, scene, cubes, options.width, options.height, pool);
+    double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::printf("%d frame(s), %.3f ms/frame\n", frames, elapsed / frames);
+
+    bool written = writeImage(options.output.c_str(), options.width, options.height, pixels);
+    if (written)
+        std::cout << "Wrote " << options.output << std::endl;
+    return written ? 0 : -1;
+}
+
+// Largest per-channel difference a pixel may have before validation counts
+// it as a mismatch, and the share of mismatches that still passes.
+// Rasterization differences on edges and sub-pixel cubes account for the
+// expected mismatches.
+const int VALIDATE_TOLERANCE = 3;
+const double VALIDATE_MAX_MISMATCH_PERCENT = 1.0;
 
-    // Shininess values for different cubes
-    float shininessValues[] = {2.0f, 4.0f, 8.0f, 16.0f, 32.0f, 64.0f, 128.0f, 256.0f};
+int runValidate(const Options& options) {
+    if (options.clusteredLighting) {
+        std::cerr << "The software renderer does not support --clustered-lights or --deferred" << std::endl;
+        return -1;
+    }
+    if (options.animate) {
+        std::cerr << "The software renderer does not support --animate" << std::endl;
+        return -1;
+    }
+    HeadlessContext context;
+    if (!context.create())
+        return -1;
+    if (!initGLEW()) {
+        context.destroy();
+        return -1;
+    }
+
+    Framebuffer target;
+    if (!target.create(options.width, options.height)) {
+        context.destroy();
+        return -1;
+    }
+    Renderer renderer;
+    if (!renderer.create(options)) {
+        target.destroy();
+        context.destroy();
+        return -1;
+    }
+    target.bind();
+    renderer.render(options.width, options.height);
+    std::vector<uint8_t> expected = target.readPixels();
+    std::string glRenderer = (const char*)glGetString(GL_RENDERER);
+    renderer.destroy();
+    target.destroy();
+    context.destroy();
 
-    // Initialize light positions for each cube
-    int j = 3;
-    std::vector<glm::vec3> lightPositions;
-    for (int i = 0; i < 8; i++) {
-        float x = (i % 4) * 2.2f - 2.3f - (j * 0.35); // Same x as cube
-        float y = (i / 4) * -2.8f + 1.7f; // Same y as cube
-        lightPositions.push_back(glm::vec3(x, y, 2.0f)); // Position lights in front of cubes
-        if(j == 0){
-             j = 3;
-        }else{
-             j--;
+    ThreadPool pool(workerThreadCount(options));
+    SceneData scene;
+    if (!createScene(options, scene, pool))
+        return -1;
+    std::vector<uint8_t> actual = renderSoftware(options, scene, poseAtRest(scene, pool), options.width, options.height,
+                                                 pool);
+
+    int maxDiff = 0;
+    double totalDiff = 0.0;
+    size_t mismatches = 0;
+    for (size_t i = 0; i < expected.size(); i += 3) {
+        int pixelDiff = 0;
+        for (int c = 0; c < 3; c++) {
+            int diff = std::abs((int)expected[i + c] - (int)actual[i + c]);
+            pixelDiff = std::max(pixelDiff, diff);
+            totalDiff += diff;
         }
+        maxDiff = std::max(maxDiff, pixelDiff);
+        if (pixelDiff > VALIDATE_TOLERANCE)
+            mismatches++;
     }
+    double mismatchPercent = 100.0 * mismatches / (expected.size() / 3);
+    bool passed = mismatchPercent <= VALIDATE_MAX_MISMATCH_PERCENT;
+    std::printf("GL (%s) vs software: max diff %d, mean diff %.4f, %.3f%% of pixels over %d -> %s\n",
+                glRenderer.c_str(), maxDiff, totalDiff / expected.size(),
+                mismatchPercent, VALIDATE_TOLERANCE, passed ? "PASS" : "FAIL");
+    return passed ? 0 : 1;
+}
 
-    // Render loop
-    while (!glfwWindowShouldClose(window)) {
-        processInput(window);
+// Distance of the material sweep's camera from its cube: the cube spans
+// about 80% of a square tile's width and 90% of its height, and any closer
+// its corners reach the tile's edges
+const float SWEEP_CAMERA_DISTANCE = 3.0f;
 
-        // Render
-        glClearColor(0.175f, 0.175f, 0.175f, 1.0f); // Set background to light grey
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+// Per-instance data of one material sweep tile
+struct SweepTile {
+    glm::vec2 tile;     // Column and row in the atlas, from the top left
+    glm::vec3 material; // Shininess, specular strength and light shift
+    glm::vec3 color;
+};
 
-        // Activate shader
-        glUseProgram(shaderProgram);
+// Combination index of a sweep split into its values: shininess varies
+// fastest, then the specular strength, the object colour and the light shift
+SweepTile sweepCombination(const Options& options, const std::vector<glm::vec3>& colors, size_t index) {
+    SweepTile tile = {};
+    tile.material.x = options.shininess[index % options.shininess.size()];
+    index /= options.shininess.size();
+    tile.material.y = options.sweepStrengths[index % options.sweepStrengths.size()];
+    index /= options.sweepStrengths.size();
+    tile.color = colors[index % colors.size()];
+    index /= colors.size();
+    tile.material.z = options.sweepShifts[index];
+    return tile;
+}
 
-        // View/Projection transformations
-        glm::mat4 projection = glm::perspective(glm::radians(45.0f),
-                               (float)WIDTH / (float)HEIGHT, 0.1f, 100.0f);
+// The sweep's atlases are numbered by a run of #s in --output, added before
+// the extension when it has none: shine.png gives shine_0000.png,
+// shine_0001.png, ...
+std::string sweepAtlasPattern(const std::string& output) {
+    if (output.find('#') != std::string::npos)
+        return output;
+    size_t slash = output.find_last_of("/\\");
+    size_t dot = output.find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        dot = output.size();
+    return output.substr(0, dot) + "_####" + output.substr(dot);
+}
 
-        // Camera rotation by a fixed angle
-        float camAngle = glm::radians(-10.0f); // Rotate camera by 45 degrees
-        float radius = 10.0f;
-        glm::vec3 cameraPos = glm::vec3(radius * sin(camAngle), 0.0f, radius * cos(camAngle));
+// The manifest sits next to the atlases, named like them without the number
+// and with a .json extension
+std::string sweepManifestPath(const std::string& pattern) {
+    size_t first = pattern.find('#');
+    size_t last = pattern.find_first_not_of('#', first);
+    std::string path = pattern.substr(0, first);
+    if (!path.empty() && (path.back() == '_' || path.back() == '-'))
+        path.pop_back();
+    path += last == std::string::npos ? "" : pattern.substr(last);
+    size_t dot = path.find_last_of('.');
+    if (dot != std::string::npos && path.find_first_of("/\\", dot) == std::string::npos)
+        path.erase(dot);
+    return path + ".json";
+}
 
-        glm::mat4 view = glm::lookAt(cameraPos,
-                                     glm::vec3(0.0f, 0.0f, 0.0f), // Look at origin
-                                     glm::vec3(0.0f, 1.0f, 0.0f)); // Up vector
+bool writeSweepJson(const std::string& path, const Options& options, const std::vector<glm::vec3>& colors,
+                    const std::string& pattern, int atlases, int columns, int rows, size_t combinations,
+                    double renderMs, double totalMs) {
+    std::ofstream file(path);
+    auto writeList = [&](const std::vector<float>& values) {
+        file << "[";
+        for (size_t i = 0; i < values.size(); i++)
+            file << (i ? ", " : "") << values[i];
+        file << "]";
+    };
 
-        // Pass projection and view matrices to shader
-        glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "projection"), 1,
-                           GL_FALSE, glm::value_ptr(projection));
-        glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "view"), 1,
-                           GL_FALSE, glm::value_ptr(view));
+    file << "{\n"
+         << "  \"renderer\": \"" << jsonEscape((const char*)glGetString(GL_RENDERER)) << "\",\n"
+         << "  \"version\": \"" << jsonEscape((const char*)glGetString(GL_VERSION)) << "\",\n"
+         << "  \"specular\": \"" << specularModelName(options.specular) << "\",\n"
+         << "  \"atlas_width\": " << options.width << ", \"atlas_height\": " << options.height
+         << ", \"tile_size\": " << options.tileSize << ", \"columns\": " << columns << ", \"rows\": " << rows
+         << ",\n"
+         << "  \"combinations\": " << combinations << ",\n"
+         << "  \"order\": [\"shininess\", \"specular_strength\", \"object_color\", \"light_shift\"],\n"
+         << "  \"shininess\": ";
+    writeList(options.shininess);
+    file << ",\n  \"specular_strength\": ";
+    writeList(options.sweepStrengths);
+    file << ",\n  \"object_color\": [";
+    for (size_t i = 0; i < colors.size(); i++)
+        file << (i ? ", " : "") << "[" << colors[i].r << ", " << colors[i].g << ", " << colors[i].b << "]";
+    file << "],\n  \"light_shift\": ";
+    writeList(options.sweepShifts);
+    file << ",\n  \"atlases\": [";
+    for (int i = 0; i < atlases; i++)
+        file << (i ? ", " : "") << "\"" << jsonEscape(formatSequencePath(pattern, i)) << "\"";
+    file << "],\n"
+         << "  \"render_ms\": " << renderMs << ", \"total_ms\": " << totalMs
+         << ", \"combinations_per_second\": " << combinations / (totalMs / 1000.0) << "\n"
+         << "}\n";
+    if (!file)
+        std::cerr << "Failed to write " << path << std::endl;
+    return (bool)file;
+}
 
-        // Camera position
-        glUniform3fv(glGetUniformLocation(shaderProgram, "viewPos"), 1, glm::value_ptr(cameraPos));
+// Render every combination of the sweep values into the tiles of atlases
+// the size of the headless image, one instanced draw per atlas, and stream
+// each atlas to disk once it is drawn. Throughput is reported both until
+// the last atlas is drawn and read back, and until it is written.
+int runSweep(const Options& options) {
+    int columns = options.width / options.tileSize;
+    int rows = options.height / options.tileSize;
+    if (columns < 1 || rows < 1) {
+        std::cerr << "A " << options.tileSize << " pixel tile does not fit in a " << options.width << "x"
+                  << options.height << " atlas" << std::endl;
+        return -1;
+    }
+    std::vector<glm::vec3> colors = options.sweepColors;
+    if (colors.empty())
+        colors.push_back(OBJECT_COLOR);
+    size_t combinations =
+        options.shininess.size() * options.sweepStrengths.size() * colors.size() * options.sweepShifts.size();
+    size_t tilesPerAtlas = (size_t)columns * rows;
+    int atlases = (int)((combinations + tilesPerAtlas - 1) / tilesPerAtlas);
 
-        // Set common light properties
-        glUniform3f(glGetUniformLocation(shaderProgram, "lightColor"), 1.0f, 1.0f, 1.0f);
-        glUniform3f(glGetUniformLocation(shaderProgram, "objectColor"), 1.0f, 0.5f, 0.31f);
+    HeadlessContext context;
+    if (!context.create())
+        return -1;
+    if (!initGLEW()) {
+        context.destroy();
+        return -1;
+    }
+    std::cout << "Sweep renderer: " << glGetString(GL_RENDERER) << " (OpenGL " << glGetString(GL_VERSION) << ")"
+              << std::endl;
 
-        // Render cubes
-        glBindVertexArray(VAO);
-        for (int i = 0; i < 8; i++) {
-            // Calculate cube position
-            float x = (i % 4) * 2.2f - 3.3f;
-            float y = (i / 4) * -2.8f + 1.7f;
+    Framebuffer atlas;
+    if (!atlas.create(options.width, options.height)) {
+        context.destroy();
+        return -1;
+    }
+    std::string pattern = sweepAtlasPattern(options.output);
+    FrameCapture writer;
+    if (!writer.create(pattern, options.width, options.height, 0, true)) {
+        atlas.destroy();
+        context.destroy();
+        return -1;
+    }
 
-            // Set static light position for this cube
-            glUniform3fv(glGetUniformLocation(shaderProgram, "lightPos"), 1, glm::value_ptr(lightPositions[i]));
+    ShaderProgram program(sweepVertexShaderSource, sweepFragmentShaderSource, specularDefines(options, -1).c_str());
+    FrameUniformBuffer frameUniforms;
+    frameUniforms.create();
+    Mesh cubeMesh;
+    cubeMesh.create(vertices, sizeof(vertices) / (6 * sizeof(float)), options.vertexFormat);
 
-            // Set shininess for this cube
-            glUniform1f(glGetUniformLocation(shaderProgram, "shininess"), shininessValues[i]);
+    // The cube mesh with one SweepTile per instance
+    unsigned int vao, tileBuffer;
+    glGenVertexArrays(1, &vao);
+    glGenBuffers(1, &tileBuffer);
+    glBindVertexArray(vao);
+    cubeMesh.bindAttributes();
+    glBindBuffer(GL_ARRAY_BUFFER, tileBuffer);
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(SweepTile), (void*)offsetof(SweepTile, tile));
+    glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(SweepTile), (void*)offsetof(SweepTile, material));
+    glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(SweepTile), (void*)offsetof(SweepTile, color));
+    for (int location = 2; location <= 4; location++) {
+        glEnableVertexAttribArray(location);
+        glVertexAttribDivisor(location, 1);
+    }
 
-            // Model transformation
-            glm::mat4 model = glm::mat4(1.0f);
-            model = glm::translate(model, glm::vec3(x, y, 0.0f));
-            model = glm::rotate(model, glm::radians(9.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-            model = glm::scale(model, glm::vec3(1.5f, 1.5f, 1.5f));
+    // Every tile shows a cube posed as in the grid, from the grid's camera
+    // angle, with the scene's default colours
+    SceneCamera camera;
+    camera.distance = SWEEP_CAMERA_DISTANCE;
+    glm::vec3 cameraPos = computeCameraPos(camera, camera.angle);
+    FrameUniforms frame = {};
+    frame.projection = computeProjection(camera, 1, 1);
+    frame.view = computeView(camera, cameraPos);
+    frame.viewPos = cameraPos;
+    frame.lightColor = LIGHT_COLOR;
+    frameUniforms.update(frame);
+    glm::mat4 model = glm::rotate(glm::mat4(1.0f), glm::radians(9.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    model = glm::scale(model, glm::vec3(1.5f));
+    program.use();
+    program.set(program.uniform("model"), model);
+    program.set(program.uniform("normalMatrix"), computeNormalMatrix(model));
+    program.set(program.uniform("tileSize"), glm::vec2(2.0f * options.tileSize / options.width,
+                                                       2.0f * options.tileSize / options.height));
+
+    glEnable(GL_DEPTH_TEST);
+    for (int plane = 0; plane < 4; plane++)
+        glEnable(GL_CLIP_DISTANCE0 + plane);
+    glClearColor(CLEAR_COLOR.r, CLEAR_COLOR.g, CLEAR_COLOR.b, 1.0f);
+    glViewport(0, 0, options.width, options.height);
 
-            glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(model));
+    std::cout << "Sweep: " << combinations << " combination(s) of " << options.shininess.size() << " shininess x "
+              << options.sweepStrengths.size() << " specular strength(s) x " << colors.size() << " colour(s) x "
+              << options.sweepShifts.size() << " light shift(s), " << columns << "x" << rows << " tiles of "
+              << options.tileSize << " pixels per atlas" << std::endl;
 
-            // Draw cube
-            glDrawArrays(GL_TRIANGLES, 0, 36);
+    std::vector<SweepTile> tiles(tilesPerAtlas);
+    auto start = std::chrono::steady_clock::now();
+    TRACE_GPU_START();
+    for (int index = 0; index < atlases; index++) {
+        TRACE_ZONE("Atlas");
+        size_t first = (size_t)index * tilesPerAtlas;
+        size_t count = std::min(tilesPerAtlas, combinations - first);
+        for (size_t i = 0; i < count; i++) {
+            tiles[i] = sweepCombination(options, colors, first + i);
+            tiles[i].tile = glm::vec2((float)(i % columns), (float)(i / columns));
+        }
+        {
+            TRACE_GPU_ZONE("Sweep");
+            atlas.bind();
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            // Orphaned, so the atlas still being drawn keeps its tiles
+            glBufferData(GL_ARRAY_BUFFER, tiles.size() * sizeof(SweepTile), nullptr, GL_STREAM_DRAW);
+            glBufferSubData(GL_ARRAY_BUFFER, 0, count * sizeof(SweepTile), tiles.data());
+            cubeMesh.drawInstanced((GLsizei)count);
+        }
+        writer.capture(atlas);
+        TRACE_COLLECT();
+    }
+    glFinish();
+    double renderMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    writer.destroy();
+    double totalMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    TRACE_GPU_STOP();
+
+    bool written = writer.getWritten() == atlases;
+    std::printf("Rendered %d atlas(es) in %.1f ms, %.0f combinations/s\n", atlases, renderMs,
+                combinations / (renderMs / 1000.0));
+    std::printf("Wrote %d atlas(es) as %s in %.1f ms, %.0f combinations/s, waited for the writer %d time(s)\n",
+                writer.getWritten(), pattern.c_str(), totalMs, combinations / (totalMs / 1000.0), writer.getStalls());
+    std::string manifest = sweepManifestPath(pattern);
+    if (written && writeSweepJson(manifest, options, colors, pattern, atlases, columns, rows, combinations, renderMs,
+                                  totalMs))
+        std::cout << "Wrote " << manifest << std::endl;
+    else
+        written = false;
+
+    // Cleanup
+    for (int plane = 0; plane < 4; plane++)
+        glDisable(GL_CLIP_DISTANCE0 + plane);
+    glDeleteVertexArrays(1, &vao);
+    glDeleteBuffers(1, &tileBuffer);
+    cubeMesh.destroy();
+    program.destroy();
+    frameUniforms.destroy();
+    atlas.destroy();
+    context.destroy();
+    return written ? 0 : -1;
+}
+
+// Summary of a series of frame times, in milliseconds
+struct FrameStats {
+    double min = 0.0;
+    double mean = 0.0;
+    double p50 = 0.0;
+    double p95 = 0.0;
+    double p99 = 0.0;
+};
+
+// Nearest-rank percentiles, so results are always one of the samples
+FrameStats computeFrameStats(std::vector<double> samples) {
+    FrameStats stats;
+    if (samples.empty())
+        return stats;
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&](double p) {
+        size_t rank = (size_t)std::ceil(p / 100.0 * samples.size());
+        return samples[std::max<size_t>(rank, 1) - 1];
+    };
+    stats.min = samples.front();
+    for (double sample : samples)
+        stats.mean += sample;
+    stats.mean /= samples.size();
+    stats.p50 = percentile(50.0);
+    stats.p95 = percentile(95.0);
+    stats.p99 = percentile(99.0);
+    return stats;
+}
+
+// Results of one benchmark scene
+struct BenchResult {
+    std::string name;
+    Options options;
+    size_t cubes = 0;
+    size_t lights = 0;
+    size_t visibleCubes = 0;
+    size_t shaderVariants = 0;
+    size_t lightmapBytes = 0; // Baked lighting only
+    Renderer::SubmitStats submitted; // Of the last measured frame
+    size_t occludedCubes = 0;
+    Renderer::OverdrawStats overdraw; // Of a frame after the measured ones
+    // Dynamic resolution only: the scale at the end and over the measured
+    // frames, and the share of them within the budget
+    float finalScale = 1.0f;
+    double meanScale = 1.0;
+    double hitRate = 0.0;
+    FrameStats cpu;
+    FrameStats update; // Animated scenes only
+    FrameStats gpu;
+};
+
+bool writeBenchJson(const char* path, const Options& options, const std::vector<BenchResult>& results) {
+    std::ofstream file(path);
+    auto writeStats = [&](const FrameStats& stats) {
+        file << "{\"min\": " << stats.min << ", \"mean\": " << stats.mean << ", \"p50\": " << stats.p50
+             << ", \"p95\": " << stats.p95 << ", \"p99\": " << stats.p99 << "}";
+    };
+    const char* meshNames[] = {"float", "packed", "half"};
+
+    file << "{\n"
+         << "  \"renderer\": \"" << jsonEscape((const char*)glGetString(GL_RENDERER)) << "\",\n"
+         << "  \"version\": \"" << jsonEscape((const char*)glGetString(GL_VERSION)) << "\",\n"
+         << "  \"warmup_frames\": " << options.warmupFrames << ",\n"
+         << "  \"frames\": " << (options.frames > 0 ? options.frames : 100) << ",\n"
+         << "  \"scenes\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& result = results[i];
+        file << "    {\"name\": \"" << jsonEscape(result.name) << "\", \"cubes\": " << result.cubes
+             << ", \"visible_cubes\": " << result.visibleCubes
+             << ", \"width\": " << result.options.width << ", \"height\": " << result.options.height
+             << ", \"lights\": " << result.lights << ", \"scene_file\": ";
+        if (!result.options.sceneFile.empty())
+            file << "\"" << jsonEscape(result.options.sceneFile) << "\"";
+        else
+            file << "null";
+        file << ", \"shininess\": [";
+        for (size_t j = 0; j < result.options.shininess.size(); j++)
+            file << (j ? ", " : "") << result.options.shininess[j];
+        file << "], \"instanced\": " << (result.options.instanced ? "true" : "false")
+             << ", \"mesh\": \"" << meshNames[(int)result.options.vertexFormat] << "\""
+             << ", \"specular\": \"" << specularModelName(result.options.specular) << "\""
+             << ", \"shader_variants\": " << result.shaderVariants
+             << ", \"animate\": " << (result.options.animate ? "true" : "false")
+             << ", \"stream_upload\": ";
+        if (result.options.animate && (result.options.instanced || result.options.clusteredLighting))
+            file << "\"" << streamUploadName(resolveStreamUpload(result.options.streamUpload)) << "\"";
+        else
+            file << "null";
+        file << ", \"light_culling\": ";
+        if (result.options.clusteredLighting)
+            file << "\"" << lightCullingName(resolveLightCulling(result.options.lightCulling)) << "\"";
+        else
+            file << "null";
+        file << ", \"deferred\": " << (result.options.deferred ? "true" : "false")
+             << ", \"bake_lighting\": " << (result.options.bakeLighting ? "true" : "false")
+             << ", \"lightmap_bytes\": " << result.lightmapBytes << ", \"multi_draw\": "
+             << (result.submitted.multiDraw ? "true" : "false") << ", \"draw_commands\": " << result.submitted.commands
+             << ", \"draw_calls\": " << result.submitted.drawCalls << ", \"state_changes\": "
+             << result.submitted.stateChanges << ", \"api_calls\": " << result.submitted.apiCalls
+             << ", \"depth_layers\": " << result.options.depthLayers
+             << ", \"depth_prepass\": " << (result.options.depthPrepass ? "true" : "false")
+             << ", \"occlusion_culling\": " << (result.options.occlusionCulling ? "true" : "false")
+             << ", \"occluded_cubes\": " << result.occludedCubes << ", \"overdraw\": {\"fragments\": "
+             << result.overdraw.fragments << ", \"pixels\": " << result.overdraw.pixels << "}"
+             << ", \"dynamic_resolution\": ";
+        if (result.options.targetFrameMs > 0.0f)
+            file << "{\"budget_ms\": " << result.options.targetFrameMs << ", \"final_scale\": " << result.finalScale
+                 << ", \"mean_scale\": " << result.meanScale << ", \"hit_rate\": " << result.hitRate << "}";
+        else
+            file << "null";
+        file << ",\n     \"cpu_ms\": ";
+        writeStats(result.cpu);
+        file << ",\n     \"gpu_ms\": ";
+        writeStats(result.gpu);
+        if (result.options.animate) {
+            file << ",\n     \"update_ms\": ";
+            writeStats(result.update);
+        }
+        file << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    file << "  ]\n}\n";
+    if (!file)
+        std::cerr << "Failed to write " << path << std::endl;
+    return (bool)file;
+}
+
+// Render each benchmark scene headless for a fixed number of warm-up and
+// measured frames. CPU frame time is wall-clock time from the start of the
+// frame until glFinish returns, which on llvmpipe includes rasterization;
+// GPU time comes from a GL_TIME_ELAPSED query around the frame's commands.
+// Every frame is finished before the next starts, so runs are repeatable.
+int runBenchmark(const Options& options) {
+    HeadlessContext context;
+    if (!context.create())
+        return -1;
+
+    // Initialize GLEW
+    if (!initGLEW()) {
+        context.destroy();
+        return -1;
+    }
+    std::cout << "Benchmark renderer: " << glGetString(GL_RENDERER) << " (OpenGL "
+              << glGetString(GL_VERSION) << ")" << std::endl;
+    TRACE_GPU_START();
+
+    std::vector<std::string> scenes = options.benchScenes;
+    if (scenes.empty())
+        scenes = {"grid=4x2", "grid=32x32", "grid=128x128", "grid=128x128,specialize=0",
+                  "grid=32x32,clustered=1,lights=64", "grid=32x32,clustered=1,lights=1024",
+                  "grid=32x32,clustered=1,lights=1024,specialize=0", "grid=32x32,clustered=1,lights=4096",
+                  "grid=128x128,clustered=1,lights=4096", "grid=128x128,deferred=1,lights=4096",
+                  "grid=128x128,clustered=1,lights=4096,zoom=8", "grid=128x128,deferred=1,lights=4096,zoom=8"};
+    int frames = options.frames > 0 ? options.frames : 100;
+
+    std::printf("%-40s %8s %8s %10s %7s %9s | %-35s | %-35s\n", "scene", "cubes", "visible", "size", "lights",
+                "update ms", "cpu ms  min / mean / p50 / p95 / p99", "gpu ms  min / mean / p50 / p95 / p99");
+
+    unsigned int query;
+    glGenQueries(1, &query);
+
+    std::vector<BenchResult> results;
+    for (const std::string& scene : scenes) {
+        BenchResult result;
+        result.name = scene;
+        result.options = options;
+        if (!parseScene(scene, result.options)) {
+            glDeleteQueries(1, &query);
+            context.destroy();
+            return -1;
+        }
+        const Options& sceneOptions = result.options;
+
+        Framebuffer target;
+        if (!target.create(sceneOptions.width, sceneOptions.height)) {
+            glDeleteQueries(1, &query);
+            context.destroy();
+            return -1;
+        }
+        Renderer renderer;
+        if (!renderer.create(sceneOptions)) {
+            target.destroy();
+            glDeleteQueries(1, &query);
+            context.destroy();
+            return -1;
+        }
+        result.cubes = renderer.getCubeCount();
+        result.lights = renderer.getLightCount();
+        target.bind();
+
+        // With a frame budget frames are rendered into scaledTarget at the
+        // controller's resolution and stretched over the target; the
+        // warm-up frames give the controller time to settle
+        bool dynamicResolution = sceneOptions.targetFrameMs > 0.0f;
+        ResolutionController resolution(sceneOptions.targetFrameMs);
+        Framebuffer scaledTarget;
+        if (dynamicResolution && !scaledTarget.create(sceneOptions.width, sceneOptions.height)) {
+            renderer.destroy();
+            target.destroy();
+            glDeleteQueries(1, &query);
+            context.destroy();
+            return -1;
+        }
+        auto renderFrame = [&](int frame) {
+            TRACE_ZONE("Frame");
+            renderer.setTime(frame * ANIMATION_TIME_STEP);
+            if (!dynamicResolution) {
+                renderer.render(sceneOptions.width, sceneOptions.height);
+                return;
+            }
+            int renderWidth = resolution.scaled(sceneOptions.width);
+            int renderHeight = resolution.scaled(sceneOptions.height);
+            scaledTarget.bind();
+            renderer.render(renderWidth, renderHeight);
+            scaledTarget.upscaleTo(target, renderWidth, renderHeight);
+        };
+
+        for (int frame = 0; frame < options.warmupFrames; frame++) {
+            auto start = std::chrono::steady_clock::now();
+            renderFrame(frame);
+            glFinish();
+            if (dynamicResolution)
+                resolution.update(
+                    std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+            TRACE_COLLECT();
+        }
+        resolution.resetStats();
+
+        std::vector<double> cpuTimes, gpuTimes, updateTimes;
+        for (int frame = 0; frame < frames; frame++) {
+            auto start = std::chrono::steady_clock::now();
+            glBeginQuery(GL_TIME_ELAPSED, query);
+            renderFrame(options.warmupFrames + frame);
+            glEndQuery(GL_TIME_ELAPSED);
+            glFinish();
+            auto end = std::chrono::steady_clock::now();
+
+            GLuint64 gpuTime = 0;
+            glGetQueryObjectui64v(query, GL_QUERY_RESULT, &gpuTime);
+
+            cpuTimes.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+            gpuTimes.push_back(gpuTime / 1.0e6);
+            updateTimes.push_back(renderer.getUpdateTime());
+            if (dynamicResolution)
+                resolution.update(cpuTimes.back());
+            TRACE_COLLECT();
         }
+        result.cpu = computeFrameStats(cpuTimes);
+        result.update = computeFrameStats(updateTimes);
+        result.gpu = computeFrameStats(gpuTimes);
+        result.visibleCubes = renderer.getVisibleCubes();
+        result.shaderVariants = renderer.getVariantCount();
+        result.lightmapBytes = renderer.getBakeBytes();
+        result.submitted = renderer.getSubmitStats();
+        result.occludedCubes = renderer.getOccludedCubes();
+        result.finalScale = resolution.getScale();
+        result.meanScale = resolution.getMeanScale();
+        result.hitRate = resolution.getHitRate();
+
+        // Counted in a frame of its own, so the measured ones pay nothing
+        renderer.measureOverdraw();
+        renderFrame(options.warmupFrames + frames);
+        result.overdraw = renderer.getOverdraw();
 
-        // Swap buffers and poll events
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+        renderer.destroy();
+        scaledTarget.destroy();
+        target.destroy();
+
+        char size[32], cpu[64], gpu[64];
+        std::snprintf(size, sizeof(size), "%dx%d", sceneOptions.width, sceneOptions.height);
+        std::snprintf(cpu, sizeof(cpu), "%.2f / %.2f / %.2f / %.2f / %.2f",
+                      result.cpu.min, result.cpu.mean, result.cpu.p50, result.cpu.p95, result.cpu.p99);
+        std::snprintf(gpu, sizeof(gpu), "%.2f / %.2f / %.2f / %.2f / %.2f",
+                      result.gpu.min, result.gpu.mean, result.gpu.p50, result.gpu.p95, result.gpu.p99);
+        char update[32] = "-";
+        if (sceneOptions.animate)
+            std::snprintf(update, sizeof(update), "%.2f", result.update.mean);
+        std::printf("%-40s %8zu %8zu %10s %7zu %9s | %-35s | %-35s\n", scene.c_str(), result.cubes, result.visibleCubes,
+                    size, result.lights, update, cpu, gpu);
+        if (dynamicResolution)
+            std::printf("  dynamic resolution: %.0f%% at the end, mean %.0f%%, %.0f%% of frames within %.1f ms\n",
+                        result.finalScale * 100.0f, result.meanScale * 100.0, result.hitRate * 100.0,
+                        sceneOptions.targetFrameMs);
+        if (sceneOptions.depthLayers > 1 || sceneOptions.depthPrepass || sceneOptions.occlusionCulling)
+            std::printf("  overdraw: %.2f fragments per covered pixel, %zu cube(s) occluded\n",
+                        result.overdraw.pixels ? (double)result.overdraw.fragments / result.overdraw.pixels : 0.0,
+                        result.occludedCubes);
+        std::fflush(stdout);
+        results.push_back(result);
     }
 
+    bool written = writeBenchJson(options.benchJson.c_str(), options, results);
+
     // Cleanup
-    glDeleteVertexArrays(1, &VAO);
-    glDeleteBuffers(1, &VBO);
-    glDeleteProgram(shaderProgram);
+    TRACE_GPU_STOP();
+    glDeleteQueries(1, &query);
+    context.destroy();
+    return written ? 0 : -1;
+}
 
-    glfwTerminate();
+// Write the scene, generated or loaded, to options.saveScene: converts
+// between the text and binary forms
+int runSaveScene(const Options& options) {
+    ThreadPool pool(workerThreadCount(options));
+    SceneData scene;
+    if (!createScene(options, scene, pool))
+        return -1;
+    auto start = std::chrono::steady_clock::now();
+    if (!saveScene(options.saveScene, scene, pool))
+        return -1;
+    double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Wrote " << scene.size() << " cube(s) and " << scene.pointLights.size() << " point light(s) to "
+              << options.saveScene << " in " << elapsed << " ms" << std::endl;
     return 0;
 }
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options))
+        return -1;
+    programCache.setDirectory(options.shaderCache);
+
+    if (!options.trace.empty()) {
+#ifdef SHINE_TRACE
+        tracer.start(options.trace);
+#else
+        std::cerr << "--trace needs a build with -DSHINE_TRACE" << std::endl;
+        return -1;
+#endif
+    }
+
+    int result;
+    if (!options.saveScene.empty())
+        result = runSaveScene(options);
+    else if (options.bench)
+        result = runBenchmark(options);
+    else if (options.sweep)
+        result = runSweep(options);
+    else if (options.validate)
+        result = runValidate(options);
+    else if (options.software)
+        result = runSoftware(options);
+    else
+        result = options.headless ? runHeadless(options) : runWindowed(options);
+#ifdef SHINE_TRACE
+    if (!tracer.finish())
+        result = -1;
+#endif
+    return result;
+}